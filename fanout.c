@@ -0,0 +1,1263 @@
+/* ice9r - Client to remotely run a command on a Windows 9x computer
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fanout.h"
+#include "fold.h"
+#include "protocol.h"
+
+/* Longest line of output held back waiting for a newline before it is printed
+ * with the host prefix anyway.
+*/
+#define LINE_MAX_LENGTH 4096
+
+#define RECVBUF_SIZE (sizeof(struct MessageHeader) + 65535)
+
+#define MAX_EVENTS 64
+
+/* Pushed files are sent in I messages of this size. */
+#define PUSH_CHUNK_SIZE 65535
+
+/* Most push messages handed to the kernel in one sendmsg() call. */
+#define PUSH_MAX_CHUNKS 16
+
+/* Formatted output is written out after each round of events, or sooner if
+ * this much has built up.
+*/
+#define OUTPUT_FLUSH_SIZE (64 * 1024)
+
+enum HostState
+{
+	HS_WAITING,     /* Not started yet. */
+	HS_CONNECTING,  /* Waiting for connect() to complete. */
+	HS_RUNNING,     /* Sending the request and receiving output. */
+	HS_DONE,
+};
+
+enum HostResult
+{
+	HR_EXITED,          /* exit_code is valid. */
+	HR_UNRESOLVED,      /* Host name could not be resolved. */
+	HR_CONNECT_FAILED,
+	HR_TIMED_OUT,       /* Connection not established within the connect timeout. */
+	HR_LOST,            /* Connection closed before the exit status was received. */
+};
+
+/* Output from one stream of a host, held until a complete line is available. */
+struct LineBuffer
+{
+	char data[LINE_MAX_LENGTH];
+	size_t used;
+};
+
+struct Host
+{
+	const char *name;
+	struct Worker *worker;
+	
+	enum HostState state;
+	enum HostResult result;
+	int error;  /* errno value for HR_CONNECT_FAILED/HR_LOST */
+	
+	int sock;
+	uint64_t deadline;
+	
+	/* Position in the worker's list of connecting hosts. */
+	struct Host *connecting_prev;
+	struct Host *connecting_next;
+	
+	size_t request_sent;
+	
+	/* Position in the push stream, see push_iovecs(). */
+	uint64_t push_sent;
+	
+	unsigned char *recvbuf;
+	size_t recvbuf_used;
+	
+	struct LineBuffer *stdout_line;
+	struct LineBuffer *stderr_line;
+	
+	/* Output held for folding instead of being printed as it arrives. */
+	struct Capture *stdout_capture;
+	struct Capture *stderr_capture;
+	
+	bool have_result;
+	int32_t last_result;
+	
+	int32_t exit_code;
+};
+
+/* Output formatted by a worker, written to the real stream in one go. */
+struct OutputBuffer
+{
+	FILE *stream;
+	
+	char *data;
+	size_t size;
+	size_t used;
+};
+
+/* State shared by all workers. */
+struct Fanout
+{
+	const struct FanoutOptions *options;
+	
+	struct Host *hosts;
+	size_t num_hosts;
+	
+	/* Next host not yet claimed by any worker. */
+	atomic_size_t next_host;
+	
+	/* Output of finished hosts, when folding. */
+	struct FoldTable *fold_table;
+};
+
+/* One event loop, run on its own thread.
+ *
+ * Hosts aren't divided between workers up front, each one claims the next
+ * unstarted host from the shared list whenever it has a free slot, so workers
+ * whose hosts finish quickly take on more of the rest.
+*/
+struct Worker
+{
+	struct Fanout *fanout;
+	pthread_t thread;
+	
+	int epfd;
+	
+	size_t max_active;
+	size_t num_active;
+	
+	/* Hosts waiting for connect() to complete, in the order they started. All
+	 * hosts have the same timeout, so this is also the order of their deadlines.
+	*/
+	struct Host *connecting_head;
+	struct Host *connecting_tail;
+	
+	struct OutputBuffer stdout_buf;
+	struct OutputBuffer stderr_buf;
+};
+
+static void *worker_main(void *arg);
+static struct Host *worker_claim_host(struct Worker *worker);
+static uint64_t monotonic_ms(void);
+static void raise_fd_limit(size_t num_hosts, size_t fds_per_host);
+static bool host_resolve(const char *name, int default_port, struct sockaddr_in *addr);
+static bool host_start(struct Host *host);
+static void host_event(struct Host *host, uint32_t events);
+static void host_send(struct Host *host);
+static bool host_send_pending(const struct Host *host);
+static uint64_t push_stream_length(const struct FanoutOptions *options);
+static int push_iovecs(const struct FanoutOptions *options, uint64_t offset, struct iovec *iov, struct MessageHeader *headers);
+static void host_recv(struct Host *host);
+static bool host_message(struct Host *host, const struct MessageHeader *header, const unsigned char *payload);
+static void host_finish(struct Host *host, enum HostResult result, int error);
+static void connecting_remove(struct Host *host);
+static void host_output(struct Host *host, unsigned char stream, const unsigned char *data, size_t length);
+static void host_fold(struct Host *host);
+static void line_output(const struct Host *host, struct OutputBuffer *output, struct LineBuffer *line, const unsigned char *data, size_t length);
+static void line_flush(const struct Host *host, struct OutputBuffer *output, struct LineBuffer *line);
+static void output_append(struct OutputBuffer *output, const void *data, size_t length);
+static void output_printf(struct OutputBuffer *output, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void output_flush(struct OutputBuffer *output);
+static void print_summary(const struct Host *hosts, size_t num_hosts);
+static int compare_int32(const void *a, const void *b);
+
+char **fanout_parse_hosts(const char *spec, size_t *num_hosts)
+{
+	char **hosts = NULL;
+	size_t hosts_size = 0;
+	*num_hosts = 0;
+	
+	char *list;
+	const char *separators;
+	
+	if(spec[0] == '@')
+	{
+		FILE *fh = fopen((spec + 1), "r");
+		if(fh == NULL)
+		{
+			fprintf(stderr, "Unable to open %s: %s\n", (spec + 1), strerror(errno));
+			return NULL;
+		}
+		
+		size_t list_size = 0;
+		list = NULL;
+		
+		if(getdelim(&list, &list_size, '\0', fh) < 0 && ferror(fh))
+		{
+			fprintf(stderr, "Unable to read %s: %s\n", (spec + 1), strerror(errno));
+			
+			free(list);
+			fclose(fh);
+			
+			return NULL;
+		}
+		
+		fclose(fh);
+		
+		if(list == NULL)
+		{
+			list = strdup("");
+		}
+		
+		/* One host per line, anything after a '#' is a comment. */
+		separators = " \t\r\n";
+		
+		for(char *p = list; (p = strchr(p, '#')) != NULL;)
+		{
+			size_t comment_len = strcspn(p, "\n");
+			memset(p, ' ', comment_len);
+		}
+	}
+	else{
+		list = strdup(spec);
+		separators = ",";
+	}
+	
+	assert(list != NULL);
+	
+	char *saveptr;
+	
+	for(char *name = strtok_r(list, separators, &saveptr); name != NULL; name = strtok_r(NULL, separators, &saveptr))
+	{
+		if(*num_hosts == hosts_size)
+		{
+			hosts_size = hosts_size > 0 ? (hosts_size * 2) : 64;
+			
+			hosts = realloc(hosts, (hosts_size * sizeof(*hosts)));
+			assert(hosts != NULL);
+		}
+		
+		hosts[(*num_hosts)++] = strdup(name);
+		assert(hosts[*num_hosts - 1] != NULL);
+	}
+	
+	free(list);
+	
+	if(*num_hosts == 0)
+	{
+		fprintf(stderr, "No hosts in %s\n", spec);
+		
+		free(hosts);
+		return NULL;
+	}
+	
+	return hosts;
+}
+
+void fanout_free_hosts(char **hosts, size_t num_hosts)
+{
+	for(size_t i = 0; i < num_hosts; ++i)
+	{
+		free(hosts[i]);
+	}
+	
+	free(hosts);
+}
+
+int fanout_run(char **host_names, size_t num_hosts, const struct FanoutOptions *options)
+{
+	struct Fanout fanout;
+	
+	fanout.options = options;
+	fanout.num_hosts = num_hosts;
+	atomic_init(&(fanout.next_host), 0);
+	
+	fanout.hosts = calloc(num_hosts, sizeof(*(fanout.hosts)));
+	assert(fanout.hosts != NULL);
+	
+	fanout.fold_table = options->fold ? fold_table_new() : NULL;
+	
+	for(size_t i = 0; i < num_hosts; ++i)
+	{
+		fanout.hosts[i].name = host_names[i];
+		fanout.hosts[i].state = HS_WAITING;
+		fanout.hosts[i].sock = -1;
+	}
+	
+	size_t max_parallel = options->max_parallel < num_hosts ? options->max_parallel : num_hosts;
+	
+	/* A socket for each host, plus files for any stdout/stderr output being
+	 * spilled while folding.
+	*/
+	raise_fd_limit(max_parallel, (options->fold ? 3 : 1));
+	
+	/* One worker per core by default, but never more workers than there are
+	 * connection slots to share between them.
+	*/
+	
+	size_t num_workers = options->threads;
+	
+	if(num_workers == 0)
+	{
+		long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_workers = num_cpus > 0 ? num_cpus : 1;
+	}
+	
+	if(num_workers > max_parallel)
+	{
+		num_workers = max_parallel;
+	}
+	
+	struct Worker *workers = calloc(num_workers, sizeof(*workers));
+	assert(workers != NULL);
+	
+	for(size_t w = 0; w < num_workers; ++w)
+	{
+		struct Worker *worker = &(workers[w]);
+		
+		worker->fanout = &fanout;
+		
+		/* Split the concurrency limit as evenly as possible. */
+		worker->max_active = (max_parallel / num_workers) + (w < (max_parallel % num_workers) ? 1 : 0);
+		
+		worker->stdout_buf.stream = stdout;
+		worker->stderr_buf.stream = stderr;
+		
+		worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if(worker->epfd < 0)
+		{
+			perror("epoll_create1");
+			exit(EX_OSERR);
+		}
+	}
+	
+	/* The first worker runs on this thread. */
+	
+	for(size_t w = 1; w < num_workers; ++w)
+	{
+		int error = pthread_create(&(workers[w].thread), NULL, &worker_main, &(workers[w]));
+		if(error != 0)
+		{
+			fprintf(stderr, "pthread_create: %s\n", strerror(error));
+			exit(EX_OSERR);
+		}
+	}
+	
+	worker_main(&(workers[0]));
+	
+	for(size_t w = 1; w < num_workers; ++w)
+	{
+		pthread_join(workers[w].thread, NULL);
+	}
+	
+	for(size_t w = 0; w < num_workers; ++w)
+	{
+		close(workers[w].epfd);
+		
+		free(workers[w].stderr_buf.data);
+		free(workers[w].stdout_buf.data);
+	}
+	
+	free(workers);
+	
+	if(fanout.fold_table != NULL)
+	{
+		fold_table_print(fanout.fold_table, stdout, host_names);
+		fold_table_free(fanout.fold_table);
+	}
+	
+	print_summary(fanout.hosts, num_hosts);
+	
+	/* Exit with zero only if every host ran the command successfully. */
+	
+	int status = 0;
+	
+	for(size_t i = 0; i < num_hosts; ++i)
+	{
+		if(fanout.hosts[i].result != HR_EXITED)
+		{
+			status = EX_UNAVAILABLE;
+			break;
+		}
+		else if(fanout.hosts[i].exit_code != 0)
+		{
+			status = 1;
+		}
+	}
+	
+	free(fanout.hosts);
+	
+	return status;
+}
+
+static void *worker_main(void *arg)
+{
+	struct Worker *worker = (struct Worker*)(arg);
+	
+	while(1)
+	{
+		/* Take on more hosts while below our share of the concurrency limit. */
+		
+		struct Host *host;
+		
+		while(worker->num_active < worker->max_active && (host = worker_claim_host(worker)) != NULL)
+		{
+			if(host_start(host))
+			{
+				++(worker->num_active);
+			}
+		}
+		
+		output_flush(&(worker->stderr_buf));
+		
+		if(worker->num_active == 0)
+		{
+			/* Nothing running and nothing left to claim. */
+			break;
+		}
+		
+		/* Wake up in time for the earliest connect timeout. */
+		
+		int timeout = -1;
+		
+		if(worker->connecting_head != NULL)
+		{
+			uint64_t now = monotonic_ms();
+			timeout = worker->connecting_head->deadline > now ? (int)(worker->connecting_head->deadline - now) : 0;
+		}
+		
+		struct epoll_event events[MAX_EVENTS];
+		
+		int num_events = epoll_wait(worker->epfd, events, MAX_EVENTS, timeout);
+		if(num_events < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			
+			perror("epoll_wait");
+			exit(EX_OSERR);
+		}
+		
+		for(int e = 0; e < num_events; ++e)
+		{
+			host = (struct Host*)(events[e].data.ptr);
+			
+			host_event(host, events[e].events);
+			
+			if(host->state == HS_DONE)
+			{
+				--(worker->num_active);
+			}
+		}
+		
+		uint64_t now = monotonic_ms();
+		
+		while(worker->connecting_head != NULL && worker->connecting_head->deadline <= now)
+		{
+			host_finish(worker->connecting_head, HR_TIMED_OUT, ETIMEDOUT);
+			--(worker->num_active);
+		}
+		
+		output_flush(&(worker->stdout_buf));
+		output_flush(&(worker->stderr_buf));
+	}
+	
+	output_flush(&(worker->stdout_buf));
+	output_flush(&(worker->stderr_buf));
+	
+	return NULL;
+}
+
+/* Claims the next host nobody has started yet, or returns NULL if none remain. */
+static struct Host *worker_claim_host(struct Worker *worker)
+{
+	struct Fanout *fanout = worker->fanout;
+	
+	size_t idx = atomic_fetch_add(&(fanout->next_host), 1);
+	
+	if(idx >= fanout->num_hosts)
+	{
+		return NULL;
+	}
+	
+	struct Host *host = &(fanout->hosts[idx]);
+	host->worker = worker;
+	
+	return host;
+}
+
+static uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ((uint64_t)(ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* Raises the soft limit on open files towards the hard limit if necessary to
+ * have the given number of descriptors for every host running at once.
+*/
+static void raise_fd_limit(size_t num_hosts, size_t fds_per_host)
+{
+	size_t wanted = (num_hosts * fds_per_host) + 64;
+	
+	struct rlimit limit;
+	
+	if(getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= wanted)
+	{
+		return;
+	}
+	
+	limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > wanted) ? wanted : limit.rlim_max;
+	
+	if(setrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur < wanted)
+	{
+		fprintf(stderr, "Warning: Open file limit is too low to run on %zu hosts at once\n", num_hosts);
+	}
+}
+
+/* Resolves a host name with an optional :<port> suffix. */
+static bool host_resolve(const char *name, int default_port, struct sockaddr_in *addr)
+{
+	char host[256];
+	int port = default_port;
+	
+	const char *colon = strrchr(name, ':');
+	size_t host_len = colon != NULL ? (size_t)(colon - name) : strlen(name);
+	
+	if(host_len >= sizeof(host))
+	{
+		return false;
+	}
+	
+	memcpy(host, name, host_len);
+	host[host_len] = '\0';
+	
+	if(colon != NULL)
+	{
+		port = atoi(colon + 1);
+	}
+	
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	struct addrinfo *result;
+	
+	if(getaddrinfo(host, NULL, &hints, &result) != 0)
+	{
+		return false;
+	}
+	
+	memcpy(addr, result->ai_addr, sizeof(*addr));
+	addr->sin_port = htons(port);
+	
+	freeaddrinfo(result);
+	
+	return true;
+}
+
+/* Starts connecting to a host. Returns false if the host has already failed. */
+static bool host_start(struct Host *host)
+{
+	struct Worker *worker = host->worker;
+	const struct FanoutOptions *options = worker->fanout->options;
+	
+	struct sockaddr_in addr;
+	
+	if(!host_resolve(host->name, options->default_port, &addr))
+	{
+		host_finish(host, HR_UNRESOLVED, 0);
+		return false;
+	}
+	
+	host->sock = socket(AF_INET, (SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC), 0);
+	if(host->sock < 0)
+	{
+		perror("socket");
+		exit(EX_OSERR);
+	}
+	
+	host->deadline = monotonic_ms() + options->connect_timeout;
+	
+	if(connect(host->sock, (struct sockaddr*)(&addr), sizeof(addr)) != 0 && errno != EINPROGRESS)
+	{
+		host_finish(host, HR_CONNECT_FAILED, errno);
+		return false;
+	}
+	
+	host->state = HS_CONNECTING;
+	
+	host->connecting_prev = worker->connecting_tail;
+	host->connecting_next = NULL;
+	
+	if(worker->connecting_tail != NULL)
+	{
+		worker->connecting_tail->connecting_next = host;
+	}
+	else{
+		worker->connecting_head = host;
+	}
+	
+	worker->connecting_tail = host;
+	
+	struct epoll_event event;
+	event.events = EPOLLOUT;
+	event.data.ptr = host;
+	
+	if(epoll_ctl(worker->epfd, EPOLL_CTL_ADD, host->sock, &event) != 0)
+	{
+		perror("epoll_ctl");
+		exit(EX_OSERR);
+	}
+	
+	return true;
+}
+
+static void host_event(struct Host *host, uint32_t events)
+{
+	struct Worker *worker = host->worker;
+	const struct FanoutOptions *options = worker->fanout->options;
+	
+	if(host->state == HS_CONNECTING)
+	{
+		int error = 0;
+		socklen_t error_len = sizeof(error);
+		
+		getsockopt(host->sock, SOL_SOCKET, SO_ERROR, &error, &error_len);
+		
+		if(error != 0)
+		{
+			host_finish(host, HR_CONNECT_FAILED, error);
+			return;
+		}
+		
+		connecting_remove(host);
+		host->state = HS_RUNNING;
+		
+		host->recvbuf = malloc(RECVBUF_SIZE);
+		assert(host->recvbuf != NULL);
+		
+		if(options->fold)
+		{
+			host->stdout_capture = malloc(sizeof(struct Capture));
+			host->stderr_capture = malloc(sizeof(struct Capture));
+			
+			assert(host->stdout_capture != NULL && host->stderr_capture != NULL);
+			
+			capture_init(host->stdout_capture);
+			capture_init(host->stderr_capture);
+		}
+		else{
+			host->stdout_line = calloc(1, sizeof(struct LineBuffer));
+			host->stderr_line = calloc(1, sizeof(struct LineBuffer));
+			
+			assert(host->stdout_line != NULL && host->stderr_line != NULL);
+		}
+		
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT;
+		event.data.ptr = host;
+		
+		epoll_ctl(worker->epfd, EPOLL_CTL_MOD, host->sock, &event);
+		
+		host_send(host);
+		return;
+	}
+	
+	if((events & EPOLLOUT) && host_send_pending(host))
+	{
+		host_send(host);
+	}
+	
+	if(host->state == HS_RUNNING && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+	{
+		host_recv(host);
+	}
+}
+
+/* Sends as much of the remaining request as the socket will take. */
+static void host_send(struct Host *host)
+{
+	const struct FanoutOptions *options = host->worker->fanout->options;
+	
+	while(host->request_sent < options->request_length)
+	{
+		ssize_t sent = send(host->sock, ((const char*)(options->request) + host->request_sent),
+			(options->request_length - host->request_sent), MSG_NOSIGNAL);
+		
+		if(sent < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return;
+			}
+			
+			host_finish(host, HR_LOST, errno);
+			return;
+		}
+		
+		host->request_sent += sent;
+	}
+	
+	/* Followed by the file being pushed, if any. Each host sends from the same
+	 * mapping of the file at its own pace.
+	*/
+	
+	uint64_t push_length = push_stream_length(options);
+	
+	while(host->push_sent < push_length)
+	{
+		struct iovec iov[PUSH_MAX_CHUNKS * 2];
+		struct MessageHeader headers[PUSH_MAX_CHUNKS];
+		
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		
+		msg.msg_iov = iov;
+		msg.msg_iovlen = push_iovecs(options, host->push_sent, iov, headers);
+		
+		ssize_t sent = sendmsg(host->sock, &msg, MSG_NOSIGNAL);
+		
+		if(sent < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return;
+			}
+			
+			host_finish(host, HR_LOST, errno);
+			return;
+		}
+		
+		host->push_sent += sent;
+	}
+	
+	/* Whole request sent, only interested in output from now on. */
+	
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = host;
+	
+	epoll_ctl(host->worker->epfd, EPOLL_CTL_MOD, host->sock, &event);
+}
+
+static bool host_send_pending(const struct Host *host)
+{
+	const struct FanoutOptions *options = host->worker->fanout->options;
+	
+	return host->request_sent < options->request_length
+		|| host->push_sent < push_stream_length(options);
+}
+
+/* The file being pushed is sent as a stream of I messages, each holding
+ * PUSH_CHUNK_SIZE bytes of the file except the last, followed by an empty one
+ * for end of file.
+*/
+static uint64_t push_stream_length(const struct FanoutOptions *options)
+{
+	if(!options->push)
+	{
+		return 0;
+	}
+	
+	uint64_t num_chunks = (options->push_length + PUSH_CHUNK_SIZE - 1) / PUSH_CHUNK_SIZE;
+	
+	return options->push_length + ((num_chunks + 1) * sizeof(struct MessageHeader));
+}
+
+/* Builds the iovecs for sending the push stream from offset onwards, pointing
+ * straight into the file's mapping. headers must have room for PUSH_MAX_CHUNKS.
+ * Returns the number of iovecs used.
+*/
+static int push_iovecs(const struct FanoutOptions *options, uint64_t offset, struct iovec *iov, struct MessageHeader *headers)
+{
+	const uint64_t chunk_stride = sizeof(struct MessageHeader) + PUSH_CHUNK_SIZE;
+	uint64_t num_chunks = (options->push_length + PUSH_CHUNK_SIZE - 1) / PUSH_CHUNK_SIZE;
+	
+	uint64_t chunk = offset / chunk_stride;
+	size_t chunk_offset = offset % chunk_stride;
+	
+	int num_iov = 0;
+	
+	for(int h = 0; h < PUSH_MAX_CHUNKS && chunk <= num_chunks; ++h, ++chunk, chunk_offset = 0)
+	{
+		uint64_t data_begin = chunk * PUSH_CHUNK_SIZE;
+		size_t data_length = 0;
+		
+		if(chunk < num_chunks)
+		{
+			data_length = (options->push_length - data_begin) < PUSH_CHUNK_SIZE
+				? (options->push_length - data_begin)
+				: PUSH_CHUNK_SIZE;
+		}
+		
+		headers[h].command = 'I';
+		headers[h].payload_length = data_length;
+		
+		if(chunk_offset < sizeof(struct MessageHeader))
+		{
+			iov[num_iov].iov_base = (char*)(&(headers[h])) + chunk_offset;
+			iov[num_iov].iov_len = sizeof(struct MessageHeader) - chunk_offset;
+			++num_iov;
+			
+			chunk_offset = sizeof(struct MessageHeader);
+		}
+		
+		size_t data_offset = chunk_offset - sizeof(struct MessageHeader);
+		
+		if(data_offset < data_length)
+		{
+			iov[num_iov].iov_base = (void*)(options->push_data + data_begin + data_offset);
+			iov[num_iov].iov_len = data_length - data_offset;
+			++num_iov;
+		}
+	}
+	
+	return num_iov;
+}
+
+static void host_recv(struct Host *host)
+{
+	ssize_t r = recv(host->sock, (host->recvbuf + host->recvbuf_used), (RECVBUF_SIZE - host->recvbuf_used), 0);
+	
+	if(r <= 0)
+	{
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		
+		host_finish(host, HR_LOST, (r < 0 ? errno : 0));
+		return;
+	}
+	
+	host->recvbuf_used += r;
+	
+	size_t consumed = 0;
+	
+	while((host->recvbuf_used - consumed) >= sizeof(struct MessageHeader))
+	{
+		const struct MessageHeader *header = (const struct MessageHeader*)(host->recvbuf + consumed);
+		size_t total_length = sizeof(*header) + header->payload_length;
+		
+		if((host->recvbuf_used - consumed) < total_length)
+		{
+			break;
+		}
+		
+		if(!host_message(host, header, (const unsigned char*)(header + 1)))
+		{
+			return;
+		}
+		
+		consumed += total_length;
+	}
+	
+	memmove(host->recvbuf, (host->recvbuf + consumed), (host->recvbuf_used - consumed));
+	host->recvbuf_used -= consumed;
+}
+
+/* Handles one message from a host. Returns false once the host is finished. */
+static bool host_message(struct Host *host, const struct MessageHeader *header, const unsigned char *payload)
+{
+	struct Worker *worker = host->worker;
+	const struct FanoutOptions *options = worker->fanout->options;
+	
+	switch(header->command)
+	{
+		case 'O':
+		case 'E':
+			host_output(host, header->command, payload, header->payload_length);
+			break;
+			
+		case 'R':
+		{
+			struct CommandResult result;
+			
+			if(header->payload_length != sizeof(result))
+			{
+				host_finish(host, HR_LOST, EPROTO);
+				return false;
+			}
+			
+			memcpy(&result, payload, sizeof(result));
+			
+			host->have_result = true;
+			host->last_result = result.exit_code;
+			
+			char line[64];
+			int line_len = snprintf(line, sizeof(line), "[%u] Exit status %d\n", (unsigned)(result.index + 1), (int)(result.exit_code));
+			
+			host_output(host, 'E', (const unsigned char*)(line), line_len);
+			
+			break;
+		}
+		
+		case 'X':
+		{
+			int32_t exit_codes[MAX_PIPELINE_STAGES];
+			
+			if(header->payload_length == 0
+				|| header->payload_length > sizeof(exit_codes)
+				|| (header->payload_length % sizeof(*exit_codes)) != 0)
+			{
+				host_finish(host, HR_LOST, EPROTO);
+				return false;
+			}
+			
+			memcpy(exit_codes, payload, header->payload_length);
+			
+			size_t num_exit_codes = header->payload_length / sizeof(*exit_codes);
+			host->exit_code = exit_codes[num_exit_codes - 1];
+			
+			if(host->have_result)
+			{
+				host->exit_code = host->last_result;
+			}
+			
+			for(size_t s = num_exit_codes; options->pipefail && s > 0; --s)
+			{
+				if(exit_codes[s - 1] != 0)
+				{
+					host->exit_code = exit_codes[s - 1];
+					break;
+				}
+			}
+			
+			host_finish(host, HR_EXITED, 0);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static void host_finish(struct Host *host, enum HostResult result, int error)
+{
+	struct Worker *worker = host->worker;
+	
+	if(host->state == HS_CONNECTING)
+	{
+		connecting_remove(host);
+	}
+	
+	if(host->stdout_line != NULL)
+	{
+		line_flush(host, &(worker->stdout_buf), host->stdout_line);
+		line_flush(host, &(worker->stderr_buf), host->stderr_line);
+	}
+	
+	host->state = HS_DONE;
+	host->result = result;
+	host->error = error;
+	
+	if(host->stdout_capture != NULL)
+	{
+		host_fold(host);
+	}
+	
+	free(host->stderr_line);
+	host->stderr_line = NULL;
+	
+	free(host->stdout_line);
+	host->stdout_line = NULL;
+	
+	free(host->recvbuf);
+	host->recvbuf = NULL;
+	
+	if(host->sock >= 0)
+	{
+		epoll_ctl(worker->epfd, EPOLL_CTL_DEL, host->sock, NULL);
+		
+		close(host->sock);
+		host->sock = -1;
+	}
+	
+	switch(result)
+	{
+		case HR_EXITED:
+			break;
+			
+		case HR_UNRESOLVED:
+			output_printf(&(worker->stderr_buf), "%s: Unable to resolve host\n", host->name);
+			break;
+			
+		case HR_CONNECT_FAILED:
+		case HR_TIMED_OUT:
+			output_printf(&(worker->stderr_buf), "%s: Unable to connect: %s\n", host->name, strerror(error));
+			break;
+			
+		case HR_LOST:
+			output_printf(&(worker->stderr_buf), "%s: Connection lost: %s\n", host->name, (error != 0 ? strerror(error) : "Connection closed"));
+			break;
+	}
+}
+
+static void connecting_remove(struct Host *host)
+{
+	struct Worker *worker = host->worker;
+	
+	if(host->connecting_prev != NULL)
+	{
+		host->connecting_prev->connecting_next = host->connecting_next;
+	}
+	else{
+		worker->connecting_head = host->connecting_next;
+	}
+	
+	if(host->connecting_next != NULL)
+	{
+		host->connecting_next->connecting_prev = host->connecting_prev;
+	}
+	else{
+		worker->connecting_tail = host->connecting_prev;
+	}
+	
+	host->connecting_prev = NULL;
+	host->connecting_next = NULL;
+}
+
+/* Handles output from a host, either printing it as it arrives or capturing
+ * it for folding. Zero length means end of file.
+*/
+static void host_output(struct Host *host, unsigned char stream, const unsigned char *data, size_t length)
+{
+	struct Worker *worker = host->worker;
+	
+	if(host->stdout_capture != NULL)
+	{
+		capture_append((stream == 'O' ? host->stdout_capture : host->stderr_capture), data, length);
+	}
+	else if(length == 0)
+	{
+		line_flush(host, (stream == 'O' ? &(worker->stdout_buf) : &(worker->stderr_buf)), (stream == 'O' ? host->stdout_line : host->stderr_line));
+	}
+	else{
+		line_output(host, (stream == 'O' ? &(worker->stdout_buf) : &(worker->stderr_buf)), (stream == 'O' ? host->stdout_line : host->stderr_line), data, length);
+	}
+}
+
+/* Hands the output captured from a finished host over to the fold table. */
+static void host_fold(struct Host *host)
+{
+	struct Fanout *fanout = host->worker->fanout;
+	
+	char status[64];
+	
+	if(host->result == HR_EXITED)
+	{
+		snprintf(status, sizeof(status), "exit %d", (int)(host->exit_code));
+	}
+	else{
+		snprintf(status, sizeof(status), "connection lost");
+	}
+	
+	fold_table_add(fanout->fold_table, (host - fanout->hosts), status, host->stdout_capture, host->stderr_capture);
+	
+	free(host->stderr_capture);
+	host->stderr_capture = NULL;
+	
+	free(host->stdout_capture);
+	host->stdout_capture = NULL;
+}
+
+/* Formats output from a host, one line at a time with the host name in front. */
+static void line_output(const struct Host *host, struct OutputBuffer *output, struct LineBuffer *line, const unsigned char *data, size_t length)
+{
+	for(size_t i = 0; i < length; ++i)
+	{
+		line->data[line->used++] = data[i];
+		
+		if(data[i] == '\n' || line->used == LINE_MAX_LENGTH)
+		{
+			output_printf(output, "%s: %.*s%s", host->name, (int)(line->used), line->data, (data[i] == '\n' ? "" : "\n"));
+			line->used = 0;
+		}
+	}
+}
+
+/* Formats any incomplete last line of output. */
+static void line_flush(const struct Host *host, struct OutputBuffer *output, struct LineBuffer *line)
+{
+	if(line->used > 0)
+	{
+		output_printf(output, "%s: %.*s\n", host->name, (int)(line->used), line->data);
+		line->used = 0;
+	}
+}
+
+static void output_append(struct OutputBuffer *output, const void *data, size_t length)
+{
+	if((output->used + length) > output->size)
+	{
+		output->size = (output->used + length) * 2;
+		
+		output->data = realloc(output->data, output->size);
+		assert(output->data != NULL);
+	}
+	
+	memcpy((output->data + output->used), data, length);
+	output->used += length;
+	
+	if(output->used >= OUTPUT_FLUSH_SIZE)
+	{
+		output_flush(output);
+	}
+}
+
+static void output_printf(struct OutputBuffer *output, const char *fmt, ...)
+{
+	char buf[LINE_MAX_LENGTH + 512];
+	
+	va_list argv;
+	va_start(argv, fmt);
+	
+	int length = vsnprintf(buf, sizeof(buf), fmt, argv);
+	
+	va_end(argv);
+	
+	if(length > 0)
+	{
+		output_append(output, buf, (length < sizeof(buf) ? length : (sizeof(buf) - 1)));
+	}
+}
+
+/* Writes out everything formatted so far. The stream is locked for the whole
+ * write, so output from different workers never interleaves mid-line.
+*/
+static void output_flush(struct OutputBuffer *output)
+{
+	if(output->used > 0)
+	{
+		flockfile(output->stream);
+		
+		fwrite(output->data, output->used, 1, output->stream);
+		fflush(output->stream);
+		
+		funlockfile(output->stream);
+		
+		output->used = 0;
+	}
+}
+
+static void print_summary(const struct Host *hosts, size_t num_hosts)
+{
+	/* Collect the distinct exit statuses. */
+	
+	int32_t *codes = malloc(num_hosts * sizeof(*codes));
+	assert(codes != NULL);
+	
+	size_t num_codes = 0;
+	size_t num_failed = 0;
+	size_t num_unreachable = 0;
+	
+	for(size_t i = 0; i < num_hosts; ++i)
+	{
+		if(hosts[i].result != HR_EXITED)
+		{
+			++num_unreachable;
+			continue;
+		}
+		
+		if(hosts[i].exit_code != 0)
+		{
+			++num_failed;
+		}
+		
+		codes[num_codes++] = hosts[i].exit_code;
+	}
+	
+	qsort(codes, num_codes, sizeof(*codes), &compare_int32);
+	
+	fprintf(stderr, "\n%zu hosts: %zu succeeded, %zu failed, %zu unreachable\n",
+		num_hosts, (num_hosts - num_failed - num_unreachable), num_failed, num_unreachable);
+	
+	for(size_t c = 0; c < num_codes; ++c)
+	{
+		if(c > 0 && codes[c] == codes[c - 1])
+		{
+			continue;
+		}
+		
+		fprintf(stderr, "  exit %d:", (int)(codes[c]));
+		
+		for(size_t i = 0; i < num_hosts; ++i)
+		{
+			if(hosts[i].result == HR_EXITED && hosts[i].exit_code == codes[c])
+			{
+				fprintf(stderr, " %s", hosts[i].name);
+			}
+		}
+		
+		fprintf(stderr, "\n");
+	}
+	
+	if(num_unreachable > 0)
+	{
+		fprintf(stderr, "  unreachable:");
+		
+		for(size_t i = 0; i < num_hosts; ++i)
+		{
+			if(hosts[i].result != HR_EXITED)
+			{
+				fprintf(stderr, " %s", hosts[i].name);
+			}
+		}
+		
+		fprintf(stderr, "\n");
+	}
+	
+	free(codes);
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+	int32_t ia = *(const int32_t*)(a);
+	int32_t ib = *(const int32_t*)(b);
+	
+	return (ia > ib) - (ia < ib);
+}
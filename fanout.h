@@ -0,0 +1,80 @@
+/* ice9r - Client to remotely run a command on a Windows 9x computer
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef ICE9_FANOUT_H
+#define ICE9_FANOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Running one request on many hosts at once. */
+
+struct FanoutOptions
+{
+	/* Messages sent to every host, from the first A up to and including the
+	 * message which starts execution, along with anything needed to finish it.
+	*/
+	const void *request;
+	size_t request_length;
+	
+	int default_port;
+	
+	int max_parallel;     /* Hosts connecting or running at once. */
+	int connect_timeout;  /* Milliseconds. */
+	
+	int threads;          /* Event loop threads, zero for one per core. */
+	
+	bool pipefail;
+	
+	/* File to send to every host after the request, which should be an upload
+	 * (see --push). The same data is shared by every host.
+	*/
+	bool push;
+	const unsigned char *push_data;
+	size_t push_length;
+	
+	/* Print each distinct output once with the hosts which produced it, after
+	 * every host has finished.
+	*/
+	bool fold;
+};
+
+/* Parses a host list given as a comma separated list or @<file>, returns an
+ * array of host names (which may have :<port> suffixes) or NULL on error.
+*/
+char **fanout_parse_hosts(const char *spec, size_t *num_hosts);
+void fanout_free_hosts(char **hosts, size_t num_hosts);
+
+/* Runs the request on every host, printing output as it arrives followed by a
+ * summary of the exit statuses. Returns the exit status for ice9r.
+*/
+int fanout_run(char **hosts, size_t num_hosts, const struct FanoutOptions *options);
+
+#endif /* !ICE9_FANOUT_H */
@@ -0,0 +1,461 @@
+/* ice9r - Client to remotely run a command on a Windows 9x computer
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "fold.h"
+
+/* Output larger than this is moved out of memory into a temporary file. */
+#define CAPTURE_MEMORY_MAX (32 * 1024)
+
+/* 64-bit FNV-1a */
+#define HASH_INIT 0xCBF29CE484222325ULL
+#define HASH_PRIME 0x100000001B3ULL
+
+struct FoldGroup
+{
+	struct FoldGroup *next;
+	
+	char *status;
+	
+	struct Capture stdout_capture;
+	struct Capture stderr_capture;
+	
+	/* Offsets of the captures in the table's spill file, or -1 if the capture
+	 * wasn't moved there.
+	*/
+	off_t stdout_offset;
+	off_t stderr_offset;
+	
+	size_t *hosts;
+	size_t num_hosts;
+	size_t hosts_size;
+};
+
+struct FoldTable
+{
+	pthread_mutex_t lock;
+	
+	struct FoldGroup *groups;
+	size_t num_groups;
+	
+	/* Spilled output of every group, so only one file is held open however
+	 * many distinct outputs there are.
+	*/
+	FILE *spill;
+};
+
+static bool capture_spill(struct Capture *capture);
+static bool capture_equal(const struct Capture *a, const struct Capture *b);
+static off_t fold_table_store(struct FoldTable *table, struct Capture *capture);
+static void capture_print(struct FoldTable *table, const struct Capture *capture, off_t offset, FILE *output);
+static int compare_host_idx(const void *a, const void *b);
+static int compare_groups(const void *a, const void *b);
+
+void capture_init(struct Capture *capture)
+{
+	capture->hash = HASH_INIT;
+	capture->length = 0;
+	
+	capture->data = NULL;
+	capture->data_size = 0;
+	
+	capture->spill = NULL;
+}
+
+void capture_append(struct Capture *capture, const void *data, size_t length)
+{
+	if(length == 0)
+	{
+		return;
+	}
+	
+	const unsigned char *p = (const unsigned char*)(data);
+	
+	for(size_t i = 0; i < length; ++i)
+	{
+		capture->hash = (capture->hash ^ p[i]) * HASH_PRIME;
+	}
+	
+	if(capture->spill == NULL && (capture->length + length) > CAPTURE_MEMORY_MAX)
+	{
+		/* If the output can't be spilled (e.g. out of file descriptors) it
+		 * stays in memory, spilling is tried again on the next append.
+		*/
+		capture_spill(capture);
+	}
+	
+	if(capture->spill != NULL)
+	{
+		if(fwrite(data, length, 1, capture->spill) != 1)
+		{
+			fprintf(stderr, "Unable to write temporary file: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	else{
+		if((capture->length + length) > capture->data_size)
+		{
+			capture->data_size = (capture->length + length) * 2;
+			
+			if(capture->data_size > CAPTURE_MEMORY_MAX && (capture->length + length) <= CAPTURE_MEMORY_MAX)
+			{
+				capture->data_size = CAPTURE_MEMORY_MAX;
+			}
+			
+			capture->data = realloc(capture->data, capture->data_size);
+			assert(capture->data != NULL);
+		}
+		
+		memcpy((capture->data + capture->length), data, length);
+	}
+	
+	capture->length += length;
+}
+
+void capture_free(struct Capture *capture)
+{
+	if(capture->spill != NULL)
+	{
+		fclose(capture->spill);
+		capture->spill = NULL;
+	}
+	
+	free(capture->data);
+	capture->data = NULL;
+}
+
+struct FoldTable *fold_table_new(void)
+{
+	struct FoldTable *table = malloc(sizeof(struct FoldTable));
+	assert(table != NULL);
+	
+	pthread_mutex_init(&(table->lock), NULL);
+	
+	table->groups = NULL;
+	table->num_groups = 0;
+	
+	table->spill = NULL;
+	
+	return table;
+}
+
+void fold_table_add(struct FoldTable *table, size_t host_idx, const char *status, struct Capture *stdout_capture, struct Capture *stderr_capture)
+{
+	pthread_mutex_lock(&(table->lock));
+	
+	struct FoldGroup *group;
+	
+	for(group = table->groups; group != NULL; group = group->next)
+	{
+		if(strcmp(group->status, status) == 0
+			&& capture_equal(&(group->stdout_capture), stdout_capture)
+			&& capture_equal(&(group->stderr_capture), stderr_capture))
+		{
+			break;
+		}
+	}
+	
+	if(group != NULL)
+	{
+		/* Same as an earlier host, no need to keep this copy. */
+		
+		capture_free(stdout_capture);
+		capture_free(stderr_capture);
+	}
+	else{
+		group = calloc(1, sizeof(struct FoldGroup));
+		assert(group != NULL);
+		
+		group->status = strdup(status);
+		assert(group->status != NULL);
+		
+		group->stdout_capture = *stdout_capture;
+		group->stderr_capture = *stderr_capture;
+		
+		/* The host's own spill files stop counting against the open file
+		 * limit once moved into the table's.
+		*/
+		group->stdout_offset = fold_table_store(table, &(group->stdout_capture));
+		group->stderr_offset = fold_table_store(table, &(group->stderr_capture));
+		
+		group->next = table->groups;
+		table->groups = group;
+		
+		++(table->num_groups);
+	}
+	
+	capture_init(stdout_capture);
+	capture_init(stderr_capture);
+	
+	if(group->num_hosts == group->hosts_size)
+	{
+		group->hosts_size = group->hosts_size > 0 ? (group->hosts_size * 2) : 8;
+		
+		group->hosts = realloc(group->hosts, (group->hosts_size * sizeof(*(group->hosts))));
+		assert(group->hosts != NULL);
+	}
+	
+	group->hosts[group->num_hosts++] = host_idx;
+	
+	pthread_mutex_unlock(&(table->lock));
+}
+
+void fold_table_print(struct FoldTable *table, FILE *output, char *const *host_names)
+{
+	if(table->num_groups == 0)
+	{
+		return;
+	}
+	
+	/* Hosts are added as they finish, which varies between runs, so sort
+	 * everything by host index to print the same report for the same results.
+	*/
+	
+	struct FoldGroup **groups = malloc(table->num_groups * sizeof(*groups));
+	assert(groups != NULL);
+	
+	size_t num_groups = 0;
+	
+	for(struct FoldGroup *group = table->groups; group != NULL; group = group->next)
+	{
+		qsort(group->hosts, group->num_hosts, sizeof(*(group->hosts)), &compare_host_idx);
+		groups[num_groups++] = group;
+	}
+	
+	qsort(groups, num_groups, sizeof(*groups), &compare_groups);
+	
+	for(size_t g = 0; g < num_groups; ++g)
+	{
+		struct FoldGroup *group = groups[g];
+		
+		fprintf(output, "==== %zu host%s, %s:", group->num_hosts, (group->num_hosts == 1 ? "" : "s"), group->status);
+		
+		for(size_t i = 0; i < group->num_hosts; ++i)
+		{
+			fprintf(output, " %s", host_names[group->hosts[i]]);
+		}
+		
+		fprintf(output, "\n");
+		
+		capture_print(table, &(group->stdout_capture), group->stdout_offset, output);
+		
+		if(group->stderr_capture.length > 0)
+		{
+			fprintf(output, "---- stderr\n");
+			capture_print(table, &(group->stderr_capture), group->stderr_offset, output);
+		}
+	}
+	
+	fflush(output);
+	
+	free(groups);
+}
+
+void fold_table_free(struct FoldTable *table)
+{
+	while(table->groups != NULL)
+	{
+		struct FoldGroup *group = table->groups;
+		table->groups = group->next;
+		
+		capture_free(&(group->stderr_capture));
+		capture_free(&(group->stdout_capture));
+		
+		free(group->hosts);
+		free(group->status);
+		free(group);
+	}
+	
+	if(table->spill != NULL)
+	{
+		fclose(table->spill);
+	}
+	
+	pthread_mutex_destroy(&(table->lock));
+	free(table);
+}
+
+/* Moves captured output from memory into a temporary file. */
+static bool capture_spill(struct Capture *capture)
+{
+	static atomic_flag warned = ATOMIC_FLAG_INIT;
+	
+	capture->spill = tmpfile();
+	
+	if(capture->spill == NULL || (capture->length > 0 && fwrite(capture->data, capture->length, 1, capture->spill) != 1))
+	{
+		if(!atomic_flag_test_and_set(&warned))
+		{
+			fprintf(stderr, "Warning: Unable to create temporary file, keeping output in memory: %s\n", strerror(errno));
+		}
+		
+		if(capture->spill != NULL)
+		{
+			fclose(capture->spill);
+			capture->spill = NULL;
+		}
+		
+		return false;
+	}
+	
+	free(capture->data);
+	capture->data = NULL;
+	capture->data_size = 0;
+	
+	return true;
+}
+
+static bool capture_equal(const struct Capture *a, const struct Capture *b)
+{
+	return a->length == b->length && a->hash == b->hash;
+}
+
+/* Copies a spilled capture to the end of the table's spill file and closes its
+ * own. Returns the offset it was copied to, or -1 if the capture was left as
+ * it was. Must be called with the table locked.
+*/
+static off_t fold_table_store(struct FoldTable *table, struct Capture *capture)
+{
+	if(capture->spill == NULL)
+	{
+		return -1;
+	}
+	
+	if(table->spill == NULL && (table->spill = tmpfile()) == NULL)
+	{
+		return -1;
+	}
+	
+	if(fseeko(table->spill, 0, SEEK_END) != 0)
+	{
+		return -1;
+	}
+	
+	off_t offset = ftello(table->spill);
+	if(offset < 0)
+	{
+		return -1;
+	}
+	
+	rewind(capture->spill);
+	
+	char buf[8192];
+	size_t r;
+	
+	while((r = fread(buf, 1, sizeof(buf), capture->spill)) > 0)
+	{
+		if(fwrite(buf, r, 1, table->spill) != 1)
+		{
+			return -1;
+		}
+	}
+	
+	if(ferror(capture->spill) || fflush(table->spill) != 0)
+	{
+		return -1;
+	}
+	
+	fclose(capture->spill);
+	capture->spill = NULL;
+	
+	return offset;
+}
+
+/* Prints captured output, followed by a newline if it doesn't end with one. */
+static void capture_print(struct FoldTable *table, const struct Capture *capture, off_t offset, FILE *output)
+{
+	int last = -1;
+	
+	if(offset >= 0)
+	{
+		fseeko(table->spill, offset, SEEK_SET);
+		
+		char buf[8192];
+		uint64_t remain = capture->length;
+		size_t r;
+		
+		while(remain > 0 && (r = fread(buf, 1, (remain < sizeof(buf) ? remain : sizeof(buf)), table->spill)) > 0)
+		{
+			fwrite(buf, r, 1, output);
+			last = (unsigned char)(buf[r - 1]);
+			remain -= r;
+		}
+	}
+	else if(capture->spill != NULL)
+	{
+		rewind(capture->spill);
+		
+		char buf[8192];
+		size_t r;
+		
+		while((r = fread(buf, 1, sizeof(buf), capture->spill)) > 0)
+		{
+			fwrite(buf, r, 1, output);
+			last = (unsigned char)(buf[r - 1]);
+		}
+	}
+	else if(capture->length > 0)
+	{
+		fwrite(capture->data, capture->length, 1, output);
+		last = capture->data[capture->length - 1];
+	}
+	
+	if(last >= 0 && last != '\n')
+	{
+		fputc('\n', output);
+	}
+}
+
+static int compare_host_idx(const void *a, const void *b)
+{
+	size_t ia = *(const size_t*)(a);
+	size_t ib = *(const size_t*)(b);
+	
+	return (ia > ib) - (ia < ib);
+}
+
+/* Orders groups by their first host, hosts must already be sorted. */
+static int compare_groups(const void *a, const void *b)
+{
+	const struct FoldGroup *ga = *(const struct FoldGroup* const*)(a);
+	const struct FoldGroup *gb = *(const struct FoldGroup* const*)(b);
+	
+	return compare_host_idx(&(ga->hosts[0]), &(gb->hosts[0]));
+}
@@ -0,0 +1,78 @@
+/* ice9r - Client to remotely run a command on a Windows 9x computer
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef ICE9_FOLD_H
+#define ICE9_FOLD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Folding of identical output from many hosts, so each distinct output is
+ * only printed once along with the hosts which produced it.
+*/
+
+/* Output captured from one stream of a host.
+ *
+ * A running hash is kept as data arrives, so outputs can be matched without
+ * comparing them. Data is held in memory up to a limit, beyond which it is
+ * spilled to an anonymous temporary file. Each spilled capture holds a file
+ * open until it is added to a FoldTable.
+*/
+struct Capture
+{
+	uint64_t hash;
+	uint64_t length;
+	
+	unsigned char *data;
+	size_t data_size;
+	
+	FILE *spill;
+};
+
+struct FoldTable;
+
+void capture_init(struct Capture *capture);
+void capture_append(struct Capture *capture, const void *data, size_t length);
+void capture_free(struct Capture *capture);
+
+struct FoldTable *fold_table_new(void);
+
+/* Adds the output of a host to the table, taking ownership of the captures.
+ * Hosts are grouped by status (e.g. "exit 0") and output. May be called from
+ * any thread.
+*/
+void fold_table_add(struct FoldTable *table, size_t host_idx, const char *status, struct Capture *stdout_capture, struct Capture *stderr_capture);
+
+/* Prints each group once, ordered by the lowest host index in each. */
+void fold_table_print(struct FoldTable *table, FILE *output, char *const *host_names);
+
+void fold_table_free(struct FoldTable *table);
+
+#endif /* !ICE9_FOLD_H */
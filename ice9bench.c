@@ -0,0 +1,907 @@
+/* ice9bench - Benchmark suite for ice9r and ice9d
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE /* pipe2() */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 15424
+
+/* How long to wait for a server we started to start listening. */
+#define SERVER_START_MS 5000
+
+/* Payload written to ice9:echo and timed coming back. */
+#define ECHO_MESSAGE_SIZE 64
+
+#define TINY_FRAME_SIZE 16
+
+/* An ice9r being driven, with pipes to whichever standard handles we want. */
+struct Child
+{
+	pid_t pid;
+	
+	int stdin_fd;
+	int stdout_fd;
+	int stderr_fd;
+	
+	uint64_t started_us;
+	uint64_t finished_us;
+	
+	unsigned long long stdout_bytes;
+	
+	/* The start of stdout, for checking what ice9:sink says it got. */
+	char stdout_head[64];
+	
+	/* Collected from stderr when asked for, for --stats. */
+	char stderr_buf[4096];
+	size_t stderr_used;
+};
+
+struct Options
+{
+	const char *ice9r;
+	const char *ice9d;
+	const char *host;
+	int port;
+	
+	int runs;
+	unsigned long long bytes;
+	int sessions;
+	int iterations;
+	const char *exec;
+};
+
+static struct Options options = {
+	.ice9r      = "./ice9r",
+	.ice9d      = "./ice9d",
+	.host       = NULL,
+	.port       = DEFAULT_PORT,
+	.runs       = 3,
+	.bytes      = 256ULL * 1024 * 1024,
+	.sessions   = 8,
+	.iterations = 200,
+	.exec       = "true",
+};
+
+static uint64_t monotonic_us(void);
+static pid_t server_start(void);
+static bool server_wait(pid_t server, uint64_t deadline_us);
+static bool child_start(struct Child *child, const char *const *args, bool want_stdin, bool want_stderr);
+static bool child_pump(struct Child *child, int timeout_ms);
+static int child_finish(struct Child *child);
+static double run_seconds(const struct Child *child);
+static int compare_doubles(const void *a, const void *b);
+static double percentile(double *samples, size_t num_samples, double p);
+static double median(double *samples, size_t num_samples);
+static bool bench_bulk_stdout(void);
+static bool bench_bulk_stdin(void);
+static bool bench_tiny_frames(void);
+static bool bench_echo_latency(void);
+static bool bench_concurrent(void);
+static bool bench_connect_exec_exit(void);
+static void report(const char *scenario, const char *metric, double value);
+static void report_count(const char *scenario, const char *metric, unsigned long long value);
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return ((uint64_t)(now.tv_sec) * 1000000) + (now.tv_nsec / 1000);
+}
+
+/* Starts a native ice9d on our port, with only errors logged so the server's
+ * console doesn't get in the way of the numbers.
+*/
+static pid_t server_start(void)
+{
+	char port[16];
+	snprintf(port, sizeof(port), "%d", options.port);
+	
+	/* Our server can't bind the port if another is already listening on it,
+	 * and that one would be measured instead.
+	*/
+	
+	if(server_wait(-1, 0))
+	{
+		fprintf(stderr, "Port %d is already in use by another server\n", options.port);
+		return -1;
+	}
+	
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		perror("fork");
+		return -1;
+	}
+	else if(pid == 0)
+	{
+		execl(options.ice9d, options.ice9d, "--port", port, "--log-level", "error", (char*)(NULL));
+		
+		fprintf(stderr, "Unable to execute %s: %s\n", options.ice9d, strerror(errno));
+		_exit(127);
+	}
+	
+	if(!server_wait(pid, monotonic_us() + (SERVER_START_MS * 1000)))
+	{
+		fprintf(stderr, "%s didn't start listening on port %d\n", options.ice9d, options.port);
+		
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		
+		return -1;
+	}
+	
+	return pid;
+}
+
+/* Waits for the server to accept connections, giving up early if the server
+ * process (if any) exits. An exited server is left to be reaped by the caller.
+*/
+static bool server_wait(pid_t server, uint64_t deadline_us)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(options.port);
+	
+	if(inet_pton(AF_INET, options.host, &(addr.sin_addr)) != 1)
+	{
+		fprintf(stderr, "Invalid host address '%s'\n", options.host);
+		return false;
+	}
+	
+	while(true)
+	{
+		siginfo_t info;
+		info.si_pid = 0;
+		
+		if(server > 0 && waitid(P_PID, server, &info, (WEXITED | WNOHANG | WNOWAIT)) == 0 && info.si_pid == server)
+		{
+			fprintf(stderr, "%s exited before accepting connections\n", options.ice9d);
+			return false;
+		}
+		
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if(sock < 0)
+		{
+			perror("socket");
+			return false;
+		}
+		
+		int r = connect(sock, (struct sockaddr*)(&addr), sizeof(addr));
+		close(sock);
+		
+		if(r == 0)
+		{
+			return true;
+		}
+		
+		if(monotonic_us() >= deadline_us)
+		{
+			return false;
+		}
+		
+		usleep(20000);
+	}
+}
+
+/* Runs ice9r against the server with the given arguments following the host
+ * and port. Stdin and stderr are only piped back to us if asked for, stdout
+ * always is.
+*/
+static bool child_start(struct Child *child, const char *const *args, bool want_stdin, bool want_stderr)
+{
+	memset(child, 0, sizeof(*child));
+	
+	child->stdin_fd = -1;
+	child->stdout_fd = -1;
+	child->stderr_fd = -1;
+	
+	char port[16];
+	snprintf(port, sizeof(port), "%d", options.port);
+	
+	const char *argv[32] = { options.ice9r, options.host, "-p", port };
+	size_t argc = 4;
+	
+	for(size_t i = 0; args[i] != NULL && argc < (sizeof(argv) / sizeof(*argv)) - 1; ++i)
+	{
+		argv[argc++] = args[i];
+	}
+	
+	argv[argc] = NULL;
+	
+	int stdin_pipe[2] = { -1, -1 }, stdout_pipe[2] = { -1, -1 }, stderr_pipe[2] = { -1, -1 };
+	
+	if((want_stdin && pipe2(stdin_pipe, O_CLOEXEC) != 0)
+		|| pipe2(stdout_pipe, O_CLOEXEC) != 0
+		|| (want_stderr && pipe2(stderr_pipe, O_CLOEXEC) != 0))
+	{
+		perror("pipe");
+		return false;
+	}
+	
+	child->started_us = monotonic_us();
+	
+	child->pid = fork();
+	if(child->pid < 0)
+	{
+		perror("fork");
+		return false;
+	}
+	else if(child->pid == 0)
+	{
+		int null_fd = open("/dev/null", O_RDWR);
+		
+		dup2((want_stdin ? stdin_pipe[0] : null_fd), STDIN_FILENO);
+		dup2(stdout_pipe[1], STDOUT_FILENO);
+		
+		if(want_stderr)
+		{
+			dup2(stderr_pipe[1], STDERR_FILENO);
+		}
+		
+		execv(options.ice9r, (char**)(argv));
+		
+		fprintf(stderr, "Unable to execute %s: %s\n", options.ice9r, strerror(errno));
+		_exit(127);
+	}
+	
+	if(want_stdin)
+	{
+		close(stdin_pipe[0]);
+		child->stdin_fd = stdin_pipe[1];
+	}
+	
+	close(stdout_pipe[1]);
+	child->stdout_fd = stdout_pipe[0];
+	
+	if(want_stderr)
+	{
+		close(stderr_pipe[1]);
+		child->stderr_fd = stderr_pipe[0];
+	}
+	
+	return true;
+}
+
+/* Reads whatever is waiting on the child's stdout and stderr, counting and
+ * discarding stdout. Returns false once both have reached end of file.
+*/
+static bool child_pump(struct Child *child, int timeout_ms)
+{
+	struct pollfd pfds[2];
+	nfds_t num_pfds = 0;
+	
+	if(child->stdout_fd >= 0)
+	{
+		pfds[num_pfds++] = (struct pollfd){ child->stdout_fd, POLLIN, 0 };
+	}
+	
+	if(child->stderr_fd >= 0)
+	{
+		pfds[num_pfds++] = (struct pollfd){ child->stderr_fd, POLLIN, 0 };
+	}
+	
+	if(num_pfds == 0)
+	{
+		return false;
+	}
+	
+	if(poll(pfds, num_pfds, timeout_ms) < 0 && errno != EINTR)
+	{
+		perror("poll");
+		exit(EX_OSERR);
+	}
+	
+	for(nfds_t i = 0; i < num_pfds; ++i)
+	{
+		if(pfds[i].revents == 0)
+		{
+			continue;
+		}
+		
+		static char buf[65536];
+		ssize_t r;
+		
+		if(pfds[i].fd == child->stderr_fd && child->stderr_used < (sizeof(child->stderr_buf) - 1))
+		{
+			r = read(child->stderr_fd, (child->stderr_buf + child->stderr_used), (sizeof(child->stderr_buf) - 1 - child->stderr_used));
+			
+			if(r > 0)
+			{
+				child->stderr_used += r;
+				child->stderr_buf[child->stderr_used] = '\0';
+			}
+		}
+		else if(pfds[i].fd == child->stderr_fd)
+		{
+			/* Out of room, throw the rest away. */
+			r = read(child->stderr_fd, buf, sizeof(buf));
+		}
+		else{
+			r = read(child->stdout_fd, buf, sizeof(buf));
+			
+			if(r > 0)
+			{
+				if(child->stdout_bytes < (sizeof(child->stdout_head) - 1))
+				{
+					size_t head = (sizeof(child->stdout_head) - 1) - child->stdout_bytes;
+					memcpy((child->stdout_head + child->stdout_bytes), buf, ((size_t)(r) < head ? (size_t)(r) : head));
+				}
+				
+				child->stdout_bytes += r;
+			}
+		}
+		
+		if(r == 0 || (r < 0 && errno != EINTR && errno != EAGAIN))
+		{
+			if(pfds[i].fd == child->stdout_fd)
+			{
+				close(child->stdout_fd);
+				child->stdout_fd = -1;
+			}
+			else{
+				close(child->stderr_fd);
+				child->stderr_fd = -1;
+			}
+		}
+	}
+	
+	return child->stdout_fd >= 0 || child->stderr_fd >= 0;
+}
+
+/* Reads the child's output to the end and waits for it to exit. Returns its
+ * exit status, or -1 if it didn't exit normally.
+*/
+static int child_finish(struct Child *child)
+{
+	if(child->stdin_fd >= 0)
+	{
+		close(child->stdin_fd);
+		child->stdin_fd = -1;
+	}
+	
+	while(child_pump(child, -1)) {}
+	
+	int status;
+	while(waitpid(child->pid, &status, 0) < 0 && errno == EINTR) {}
+	
+	child->finished_us = monotonic_us();
+	
+	if(!WIFEXITED(status))
+	{
+		return -1;
+	}
+	
+	if(WEXITSTATUS(status) != 0 && child->stderr_used > 0)
+	{
+		fprintf(stderr, "%s", child->stderr_buf);
+	}
+	
+	return WEXITSTATUS(status);
+}
+
+static double run_seconds(const struct Child *child)
+{
+	return (double)(child->finished_us - child->started_us) / 1000000.0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double da = *(const double*)(a), db = *(const double*)(b);
+	return (da > db) - (da < db);
+}
+
+/* Nearest-rank percentile, sorts the samples. */
+static double percentile(double *samples, size_t num_samples, double p)
+{
+	qsort(samples, num_samples, sizeof(*samples), &compare_doubles);
+	
+	size_t rank = (size_t)((p / 100.0) * num_samples + 0.999999);
+	if(rank < 1)
+	{
+		rank = 1;
+	}
+	
+	return samples[rank - 1];
+}
+
+static double median(double *samples, size_t num_samples)
+{
+	return percentile(samples, num_samples, 50.0);
+}
+
+/* Output from ice9:generate, read as fast as we can. */
+static bool bench_bulk_stdout(void)
+{
+	char bytes[32];
+	snprintf(bytes, sizeof(bytes), "%llu", options.bytes);
+	
+	const char *args[] = { "ice9:generate", bytes, NULL };
+	
+	double rates[options.runs];
+	
+	for(int run = 0; run < options.runs; ++run)
+	{
+		struct Child child;
+		
+		if(!child_start(&child, args, false, true))
+		{
+			return false;
+		}
+		
+		if(child_finish(&child) != 0 || child.stdout_bytes != options.bytes)
+		{
+			fprintf(stderr, "bulk_stdout: got %llu of %llu bytes\n", child.stdout_bytes, options.bytes);
+			return false;
+		}
+		
+		rates[run] = (options.bytes / 1000000.0) / run_seconds(&child);
+	}
+	
+	report_count("bulk_stdout", "bytes", options.bytes);
+	report("bulk_stdout", "mb_per_second", median(rates, options.runs));
+	
+	return true;
+}
+
+/* Input written to ice9:sink, which reports how much it got at the end. */
+static bool bench_bulk_stdin(void)
+{
+	const char *args[] = { "ice9:sink", NULL };
+	
+	static char buf[65536];
+	double rates[options.runs];
+	
+	for(int run = 0; run < options.runs; ++run)
+	{
+		struct Child child;
+		
+		if(!child_start(&child, args, true, true))
+		{
+			return false;
+		}
+		
+		for(unsigned long long written = 0; written < options.bytes;)
+		{
+			size_t chunk = (options.bytes - written) < sizeof(buf) ? (options.bytes - written) : sizeof(buf);
+			
+			ssize_t w = write(child.stdin_fd, buf, chunk);
+			if(w < 0 && errno != EINTR)
+			{
+				perror("bulk_stdin: write");
+				return false;
+			}
+			else if(w > 0)
+			{
+				written += w;
+			}
+		}
+		
+		if(child_finish(&child) != 0)
+		{
+			fprintf(stderr, "bulk_stdin: ice9r failed\n");
+			return false;
+		}
+		
+		unsigned long long consumed = strtoull(child.stdout_head, NULL, 10);
+		if(consumed != options.bytes)
+		{
+			fprintf(stderr, "bulk_stdin: ice9:sink got %llu of %llu bytes\n", consumed, options.bytes);
+			return false;
+		}
+		
+		rates[run] = (options.bytes / 1000000.0) / run_seconds(&child);
+	}
+	
+	report_count("bulk_stdin", "bytes", options.bytes);
+	report("bulk_stdin", "mb_per_second", median(rates, options.runs));
+	
+	return true;
+}
+
+/* Small writes from ice9:generate, each sent in its own message since
+ * interactive connections aren't coalesced. The message count comes from
+ * the server's stats.
+*/
+static bool bench_tiny_frames(void)
+{
+	unsigned long long frames = options.bytes / 1024;
+	
+	char bytes[32], chunk[16];
+	snprintf(bytes, sizeof(bytes), "%llu", (frames * TINY_FRAME_SIZE));
+	snprintf(chunk, sizeof(chunk), "%d", TINY_FRAME_SIZE);
+	
+	const char *args[] = { "-t", "--stats", "ice9:generate", bytes, chunk, NULL };
+	
+	double rates[options.runs];
+	unsigned messages = 0;
+	
+	for(int run = 0; run < options.runs; ++run)
+	{
+		struct Child child;
+		
+		if(!child_start(&child, args, false, true))
+		{
+			return false;
+		}
+		
+		if(child_finish(&child) != 0)
+		{
+			fprintf(stderr, "tiny_frames: ice9r failed\n");
+			return false;
+		}
+		
+		const char *line = strstr(child.stderr_buf, "stdout: ");
+		unsigned long long stdout_bytes;
+		
+		if(line == NULL || sscanf(line, "stdout: %llu bytes in %u messages", &stdout_bytes, &messages) != 2)
+		{
+			fprintf(stderr, "tiny_frames: no stats from ice9r\n");
+			return false;
+		}
+		
+		rates[run] = messages / run_seconds(&child);
+	}
+	
+	report_count("tiny_frames", "frames", messages);
+	report("tiny_frames", "frames_per_second", median(rates, options.runs));
+	
+	return true;
+}
+
+/* Round trips through ice9:echo, one message in flight at a time. */
+static bool bench_echo_latency(void)
+{
+	const char *args[] = { "-t", "ice9:echo", NULL };
+	
+	int iterations = options.iterations * 10;
+	
+	double *samples = malloc(iterations * sizeof(double));
+	if(samples == NULL)
+	{
+		fprintf(stderr, "Memory allocation failed\n");
+		return false;
+	}
+	
+	struct Child child;
+	
+	if(!child_start(&child, args, true, true))
+	{
+		free(samples);
+		return false;
+	}
+	
+	char message[ECHO_MESSAGE_SIZE];
+	memset(message, 'x', sizeof(message));
+	
+	uint64_t total_us = 0;
+	
+	for(int i = 0; i < iterations; ++i)
+	{
+		uint64_t sent_us = monotonic_us();
+		unsigned long long expect = child.stdout_bytes + sizeof(message);
+		
+		if(write(child.stdin_fd, message, sizeof(message)) != sizeof(message))
+		{
+			perror("echo_latency: write");
+			
+			free(samples);
+			return false;
+		}
+		
+		while(child.stdout_bytes < expect)
+		{
+			if(!child_pump(&child, -1))
+			{
+				fprintf(stderr, "echo_latency: ice9r exited early\n");
+				
+				free(samples);
+				return false;
+			}
+		}
+		
+		uint64_t round_trip_us = monotonic_us() - sent_us;
+		
+		samples[i] = round_trip_us;
+		total_us += round_trip_us;
+	}
+	
+	if(child_finish(&child) != 0)
+	{
+		fprintf(stderr, "echo_latency: ice9r failed\n");
+		
+		free(samples);
+		return false;
+	}
+	
+	report_count("echo_latency", "round_trips", iterations);
+	report("echo_latency", "round_trips_per_second", (iterations / (total_us / 1000000.0)));
+	report("echo_latency", "p50_us", percentile(samples, iterations, 50.0));
+	report("echo_latency", "p99_us", percentile(samples, iterations, 99.0));
+	
+	free(samples);
+	
+	return true;
+}
+
+/* Several sessions pulling output at once, sharing the server's event loop. */
+static bool bench_concurrent(void)
+{
+	unsigned long long per_session = options.bytes / options.sessions;
+	
+	char bytes[32];
+	snprintf(bytes, sizeof(bytes), "%llu", per_session);
+	
+	const char *args[] = { "ice9:generate", bytes, NULL };
+	
+	struct Child *children = calloc(options.sessions, sizeof(struct Child));
+	double *samples = calloc(options.sessions, sizeof(double));
+	
+	if(children == NULL || samples == NULL)
+	{
+		fprintf(stderr, "Memory allocation failed\n");
+		
+		free(samples);
+		free(children);
+		
+		return false;
+	}
+	
+	bool ok = true;
+	int started = 0;
+	
+	uint64_t begin_us = monotonic_us();
+	
+	for(; started < options.sessions; ++started)
+	{
+		if(!child_start(&(children[started]), args, false, true))
+		{
+			ok = false;
+			break;
+		}
+	}
+	
+	/* Read from whichever sessions have output, noting when each finishes. */
+	
+	for(int running = started; running > 0;)
+	{
+		struct pollfd pfds[started * 2];
+		
+		for(int i = 0; i < started; ++i)
+		{
+			pfds[(i * 2)]     = (struct pollfd){ children[i].stdout_fd, POLLIN, 0 };
+			pfds[(i * 2) + 1] = (struct pollfd){ children[i].stderr_fd, POLLIN, 0 };
+		}
+		
+		if(poll(pfds, (started * 2), -1) < 0 && errno != EINTR)
+		{
+			perror("poll");
+			exit(EX_OSERR);
+		}
+		
+		for(int i = 0; i < started; ++i)
+		{
+			if((pfds[(i * 2)].revents != 0 || pfds[(i * 2) + 1].revents != 0) && !child_pump(&(children[i]), 0))
+			{
+				if(child_finish(&(children[i])) != 0 || children[i].stdout_bytes != per_session)
+				{
+					fprintf(stderr, "concurrent: session %d got %llu of %llu bytes\n", i, children[i].stdout_bytes, per_session);
+					ok = false;
+				}
+				
+				samples[i] = run_seconds(&(children[i])) * 1000.0;
+				--running;
+			}
+		}
+	}
+	
+	double elapsed = (monotonic_us() - begin_us) / 1000000.0;
+	
+	if(ok)
+	{
+		report_count("concurrent", "sessions", options.sessions);
+		report_count("concurrent", "bytes", (per_session * options.sessions));
+		report("concurrent", "mb_per_second", (((double)(per_session) * options.sessions / 1000000.0) / elapsed));
+		report("concurrent", "p50_ms", percentile(samples, options.sessions, 50.0));
+		report("concurrent", "p99_ms", percentile(samples, options.sessions, 99.0));
+	}
+	
+	free(samples);
+	free(children);
+	
+	return ok;
+}
+
+/* Whole runs of a real program one after another: connecting, starting the
+ * process, waiting for it to exit and tearing down.
+*/
+static bool bench_connect_exec_exit(void)
+{
+	const char *args[] = { options.exec, NULL };
+	
+	double *samples = malloc(options.iterations * sizeof(double));
+	if(samples == NULL)
+	{
+		fprintf(stderr, "Memory allocation failed\n");
+		return false;
+	}
+	
+	uint64_t begin_us = monotonic_us();
+	
+	for(int i = 0; i < options.iterations; ++i)
+	{
+		struct Child child;
+		
+		if(!child_start(&child, args, false, true))
+		{
+			free(samples);
+			return false;
+		}
+		
+		if(child_finish(&child) != 0)
+		{
+			fprintf(stderr, "connect_exec_exit: %s failed\n", options.exec);
+			
+			free(samples);
+			return false;
+		}
+		
+		samples[i] = run_seconds(&child) * 1000.0;
+	}
+	
+	double elapsed = (monotonic_us() - begin_us) / 1000000.0;
+	
+	report_count("connect_exec_exit", "runs", options.iterations);
+	report("connect_exec_exit", "runs_per_second", (options.iterations / elapsed));
+	report("connect_exec_exit", "p50_ms", percentile(samples, options.iterations, 50.0));
+	report("connect_exec_exit", "p99_ms", percentile(samples, options.iterations, 99.0));
+	
+	free(samples);
+	
+	return true;
+}
+
+static void report(const char *scenario, const char *metric, double value)
+{
+	printf("ice9bench_%s_%s %.3f\n", scenario, metric, value);
+	fflush(stdout);
+}
+
+static void report_count(const char *scenario, const char *metric, unsigned long long value)
+{
+	printf("ice9bench_%s_%s %llu\n", scenario, metric, value);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "--ice9r") == 0 && (i + 1) < argc)
+		{
+			options.ice9r = argv[++i];
+		}
+		else if(strcmp(argv[i], "--ice9d") == 0 && (i + 1) < argc)
+		{
+			options.ice9d = argv[++i];
+		}
+		else if(strcmp(argv[i], "--host") == 0 && (i + 1) < argc)
+		{
+			options.host = argv[++i];
+		}
+		else if(strcmp(argv[i], "--port") == 0 && (i + 1) < argc)
+		{
+			options.port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--runs") == 0 && (i + 1) < argc)
+		{
+			options.runs = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--bytes") == 0 && (i + 1) < argc)
+		{
+			options.bytes = strtoull(argv[++i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "--sessions") == 0 && (i + 1) < argc)
+		{
+			options.sessions = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--iterations") == 0 && (i + 1) < argc)
+		{
+			options.iterations = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--exec") == 0 && (i + 1) < argc)
+		{
+			options.exec = argv[++i];
+		}
+		else{
+			options.runs = 0;
+			break;
+		}
+	}
+	
+	if(options.runs < 1 || options.bytes < 1024 || options.sessions < 1 || options.iterations < 1)
+	{
+		fprintf(stderr, "Usage: %s [--host <address> [--port <port>] | --ice9d <path>] [--ice9r <path>]\n", argv[0]);
+		fprintf(stderr, "       %*s [--runs <count>] [--bytes <bytes>] [--sessions <count>]\n", (int)(strlen(argv[0])), "");
+		fprintf(stderr, "       %*s [--iterations <count>] [--exec <program>]\n", (int)(strlen(argv[0])), "");
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Runs ice9r through a set of scenarios and prints the results one per line as\n");
+		fprintf(stderr, "\"ice9bench_<scenario>_<metric> <value>\". Unless --host is given, a native\n");
+		fprintf(stderr, "ice9d is started on port %d to run them against.\n", DEFAULT_PORT);
+		
+		return EX_USAGE;
+	}
+	
+	pid_t server = -1;
+	
+	if(options.host == NULL)
+	{
+		options.host = "127.0.0.1";
+		
+		server = server_start();
+		if(server < 0)
+		{
+			return EX_UNAVAILABLE;
+		}
+	}
+	
+	bool ok = bench_bulk_stdout()
+		&& bench_bulk_stdin()
+		&& bench_tiny_frames()
+		&& bench_echo_latency()
+		&& bench_concurrent()
+		&& bench_connect_exec_exit();
+	
+	if(server >= 0)
+	{
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+	
+	return ok ? 0 : EX_SOFTWARE;
+}
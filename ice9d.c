@@ -28,38 +28,357 @@
  * POSSIBILITY OF SUCH DAMAGE.
 */
 
+/* Use MinGW's own printf/scanf, msvcrt on Windows 9x doesn't understand %llu. */
+#define __USE_MINGW_ANSI_STDIO 1
+
 #include <assert.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef _WIN32
 #include <winsock2.h>
 #include <windows.h>
 
 #include "pipe9x/pipe9x.h"
 
+#define PATH_LIST_SEPARATOR ";"
+#define DIR_SEPARATOR '\\'
+#else
+/* Native build for testing and benchmarking, see posix/win32.h */
+#include "posix/win32.h"
+
+#define PATH_LIST_SEPARATOR ":"
+#define DIR_SEPARATOR '/'
+#endif
+
 #define PORT 5424
 #define MAX_CONNECTIONS 16
+#define MAX_PIPELINE_STAGES 8
 
 #define PIPE_READ_SIZE 32768
 
 #define RECVBUF_SIZE (72 * 1024)
 #define SENDBUF_SIZE (128 * 1024)
 
+/* Space reserved in the send buffer beyond a full pipe read for the small
+ * messages which may be generated alongside it.
+*/
+#define SENDBUF_HEADROOM 256
+
+/* Largest window which may be held back by a tail output policy. */
+#define TAIL_MAX PIPE_READ_SIZE
+
+/* Default time small output may be held for so that it can be merged with
+ * whatever is read next, and how much may be held before it is sent anyway.
+*/
+#define COALESCE_MS 5
+#define COALESCE_BYTES 4096
+
+/* Pipe read sizes are counted in buckets of up to 64, 512, 4K, 16K and 32K. */
+#define STATS_READ_BUCKETS 5
+
+/* Server-wide histograms have power of two buckets, the last one also counting
+ * anything too large for the others.
+*/
+#define HISTOGRAM_BUCKETS 24
+
+/* Largest server status report. */
+#define STATUS_REPORT_SIZE 8192
+
+/* Trace records are buffered in memory and written out when this many have
+ * built up, or after a while if the server has gone quiet.
+*/
+#define TRACE_BUFFER_RECORDS 4096
+#define TRACE_FLUSH_MS 2000
+
+/* Application paths starting with this run a pseudo-program inside the server
+ * rather than a process, see synthetic_start().
+*/
+#define SYNTHETIC_PREFIX "ice9:"
+
+/* Log messages queued for the writer thread, and the longest message. */
+#define LOG_QUEUE_SLOTS 256
+#define LOG_MESSAGE_MAX 256
+
 /* Client to server messages:
  *
  * A - Set application_path
  * C - Set command_line
+ * | - Finish a pipeline stage, following A/C messages describe the next stage
+ * Q - Queue the command described so far for a batch, E runs the whole batch
  * W - Set working_directory
+ * P - Set output policy for stdout or stderr (see OutputPolicyMessage)
+ * R - Redirect stdin, stdout or stderr to a file (see RedirectMessage)
+ * F - Set option flags (uint32_t, see ConnectionFlags)
  * E - Execute process
+ * S - Start a persistent session, using the process as a command interpreter
+ * K - Queue a command for the session interpreter (empty to end the session)
+ * U - Upload: create the named file, following I messages are written to it
+ *     rather than a process and the empty I message finishes it
+ * G - Get server status: the server's counters are sent back as stdout, in
+ *     place of running a process
  * I - Write bytes to stdin
  *
  * Server to client messages:
  *
  * O - Data read from stdout
  * E - Data read from stderr
- * X - Exit status (followed by close)
+ * R - Result of a session or batch command (see CommandResult), output
+ *     preceding it belongs to that command. A batch command which couldn't
+ *     be started has the Windows error code as its exit status.
+ * T - Counters for the connection (see ConnectionStats), sent just before X
+ *     if CF_STATS is set
+ * M - Timestamps of each phase of running the command (see PhaseTimes), sent
+ *     just before X if CF_TIMING is set
+ * X - Exit status of each process in the pipeline, of the last command run
+ *     by a batch, or of an upload (zero, or the Windows error code)
+ *     (followed by close)
+*/
+
+enum ConnectionFlags
+{
+	CF_STOP_ON_FAILURE = (1 << 0),  /* Run no further batch/session commands after one fails. */
+	CF_INTERACTIVE     = (1 << 1),  /* Someone is typing at the other end, favour latency. */
+	CF_STATS           = (1 << 2),  /* Send a T message before X. */
+	CF_TIMING          = (1 << 3),  /* Send an M message before X. */
+};
+
+/* Output policies, applied to data read from the child before it is queued
+ * for sending to the client.
+*/
+
+enum OutputPolicyMode
+{
+	OP_ALL     = 'A',  /* Forward everything (default). */
+	OP_DISCARD = 'D',  /* Forward nothing except end of file. */
+	OP_HEAD    = 'H',  /* Forward the first limit bytes, discard the rest. */
+	OP_TAIL    = 'T',  /* Forward the last limit bytes once end of file is reached. */
+	OP_CAP     = 'C',  /* Forward the first limit bytes, terminate the process if it writes more. */
+};
+
+struct OutputPolicy
+{
+	unsigned char mode;
+	uint32_t limit;
+	
+	uint32_t forwarded;
+	bool tripped;  /* OP_CAP limit exceeded, discard until the next command. */
+	
+	unsigned char *ring;
+	uint32_t ring_start;
+	uint32_t ring_used;
+};
+
+/* Modes for redirecting the child's standard handles to files. */
+
+enum RedirectMode
+{
+	RM_READ   = 'R',  /* stdin: Read from an existing file. */
+	RM_WRITE  = 'W',  /* stdout/stderr: Create or truncate a file. */
+	RM_APPEND = 'A',  /* stdout/stderr: Append to a file, creating it if necessary. */
+	RM_STDOUT = 'O',  /* stderr: Share whatever stdout is connected to. */
+};
+
+struct Redirect
+{
+	unsigned char mode;  /* enum RedirectMode, zero if not redirected */
+	char *path;
+};
+
+struct PipelineStage
+{
+	char *application_path;
+	char *command_line;
+};
+
+struct QueuedCommand
+{
+	struct QueuedCommand *next;
+	
+	char *application_path;
+	char *command_line;
+};
+
+struct CommandQueue
+{
+	struct QueuedCommand *head;
+	struct QueuedCommand *tail;
+};
+
+enum SessionState
+{
+	SS_STARTING,  /* Waiting for first sentinel from the interpreter. */
+	SS_IDLE,      /* Waiting for a command to be queued. */
+	SS_RUNNING,   /* Waiting for the sentinel following a command. */
+	SS_EXITING,   /* Told the interpreter to exit. */
+};
+
+struct Session
+{
+	bool active;
+	enum SessionState state;
+	
+	char *batch_path;
+	char *write_buf;
+	
+	char token[16];
+	size_t token_length;
+	size_t token_matched;
+	
+	bool in_status;
+	int32_t status;
+	int32_t last_status;
+	
+	uint32_t next_index;
+	bool input_closed;
+};
+
+/* Counters kept for each connection, times are in milliseconds. */
+struct ConnectionStats
+{
+	uint64_t stdin_bytes;
+	uint64_t stdout_bytes;
+	uint64_t stderr_bytes;
+	
+	uint32_t stdin_frames;
+	uint32_t stdout_frames;
+	uint32_t stderr_frames;
+	
+	/* Time output was left unread because the send buffer was too full. */
+	uint32_t sendbuf_full_ms;
+	
+	/* Times stdin from the client was held up waiting for the previous write
+	 * to the child to complete, and for how long in total.
+	*/
+	uint32_t stdin_stalls;
+	uint32_t stdin_stall_ms;
+	
+	/* Time from the connection being accepted to the first output (zero if
+	 * there was none) and to the end.
+	*/
+	uint32_t first_output_ms;
+	uint32_t total_ms;
+	
+	uint32_t read_sizes[STATS_READ_BUCKETS];
+} __attribute__((packed));
+
+/* When each phase of running a command was reached, in microseconds since the
+ * first bytes of the request were received (zero if it never was), along with
+ * how long was spent searching PATH and in CreateProcess() while spawning.
+*/
+struct PhaseTimes
+{
+	uint64_t execute_us;
+	uint64_t spawned_us;
+	uint64_t first_output_us;
+	uint64_t exited_us;
+	uint64_t exit_sent_us;
+	
+	uint32_t path_search_us;
+	uint32_t create_process_us;
+} __attribute__((packed));
+
+struct Histogram
+{
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t sum;
+	uint32_t count;
+};
+
+/* Counters covering every connection since the server was started. */
+struct ServerStats
+{
+	DWORD started_tick;
+	
+	uint32_t connections_accepted;
+	uint32_t connections_rejected;
+	
+	uint32_t processes_spawned;
+	uint32_t spawn_failures;
+	uint32_t uploads;
+	
+	/* Pipe ends abandoned by connection_close(), see there. */
+	uint32_t pipes_leaked;
+	
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+	
+	struct Histogram spawn_us;
+	struct Histogram connection_ms;
+};
+
+/* Binary event trace, see --trace. The file starts with a TraceHeader and is
+ * followed by TraceRecords, which ice9trace decodes.
 */
+struct TraceHeader
+{
+	char magic[8];  /* "ICE9TRAC" */
+	uint32_t version;
+	uint32_t record_size;
+} __attribute__((packed));
+
+struct TraceRecord
+{
+	uint64_t timestamp_us;
+	uint32_t connection_id;  /* Zero for events not tied to a connection. */
+	uint32_t bytes;          /* Meaning depends on the event. */
+	uint16_t wait_handles;   /* Size of the wait array when the event happened. */
+	uint8_t event;           /* TraceEvent */
+	uint8_t reserved;
+} __attribute__((packed));
+
+enum TraceEvent
+{
+	TE_WAKE = 1,     /* WaitForMultipleObjects() returned, bytes = index woken (0xFFFFFFFF on timeout) */
+	TE_ACCEPT,       /* New connection */
+	TE_REJECT,       /* Connection dropped at MAX_CONNECTIONS */
+	TE_RECV,         /* bytes = Read from socket */
+	TE_SEND,         /* bytes = Written to socket */
+	TE_STDOUT_READ,  /* bytes = Read from stdout pipe (0 = end of file) */
+	TE_STDERR_READ,  /* bytes = Read from stderr pipe (0 = end of file) */
+	TE_STDIN_WRITE,  /* bytes = Written to stdin pipe */
+	TE_SPAWN,        /* bytes = Microseconds taken to start a process */
+	TE_EXIT,         /* bytes = Exit code of a process */
+	TE_CLOSE,        /* Connection closed */
+};
+
+enum SyntheticKind
+{
+	SK_NONE = 0,
+	SK_GENERATE,  /* Writes a number of bytes to stdout, optionally at a fixed rate. */
+	SK_SINK,      /* Reads stdin and writes how many bytes it got at end of file. */
+	SK_ECHO,      /* Copies stdin to stdout. */
+};
+
+struct Synthetic
+{
+	enum SyntheticKind kind;
+	
+	/* SK_GENERATE */
+	uint64_t remaining;
+	uint32_t chunk;
+	uint32_t rate;  /* Bytes per second, zero for as fast as possible. */
+	uint64_t produced;
+	DWORD started_tick;
+	
+	/* SK_SINK */
+	uint64_t consumed;
+	
+	/* SK_ECHO: Input is held in the receive buffer until there is room in the
+	 * send buffer to echo it.
+	*/
+	bool stalled;
+};
+
+enum LogLevel
+{
+	LOG_ERROR,    /* Something failed on our end. */
+	LOG_WARNING,  /* A client asked for something we can't do. */
+	LOG_INFO,     /* Connections and processes coming and going. */
+	LOG_DEBUG,    /* Everything else. */
+};
 
 enum ConnectionState
 {
@@ -81,14 +400,80 @@ struct Connection
 	unsigned char sendbuf[SENDBUF_SIZE];
 	int sendbuf_used;
 	
+	/* Set while small output is being held back in sendbuf, until the tick
+	 * count reaches hold_until.
+	*/
+	bool holding;
+	DWORD hold_until;
+	
+	/* Offset in sendbuf of the last O/E message, if it is still unsent and at
+	 * the end of the buffer so more output for the same stream can be added to
+	 * it, otherwise -1.
+	*/
+	int merge_offset;
+	
 	char *application_path;
 	char *command_line;
 	char *working_directory;
 	
-	HANDLE process;
+	/* Earlier stages of a pipeline, application_path/command_line describe
+	 * the final stage.
+	*/
+	struct PipelineStage pipeline[MAX_PIPELINE_STAGES - 1];
+	int pipeline_length;
+	
+	/* Processes started for each stage, which are waited for in order. */
+	HANDLE processes[MAX_PIPELINE_STAGES];
+	int32_t exit_codes[MAX_PIPELINE_STAGES];
+	int num_processes;
+	int num_exited;
+	
 	PipeWriteHandle stdin_pipe;
 	PipeReadHandle stdout_pipe;
 	PipeReadHandle stderr_pipe;
+	
+	struct OutputPolicy stdout_policy;
+	struct OutputPolicy stderr_policy;
+	
+	struct Redirect stdin_redirect;
+	struct Redirect stdout_redirect;
+	struct Redirect stderr_redirect;
+	
+	uint32_t flags;
+	
+	struct Session session;
+	struct CommandQueue commands;
+	
+	/* Running a batch, commands holds those still to be run. */
+	bool batch;
+	uint32_t batch_index;
+	
+	/* Windows error code for why connection_execute() last failed. */
+	DWORD execute_error;
+	
+	/* File being written by an upload. */
+	HANDLE upload_file;
+	char *upload_path;
+	
+	/* Upload failed, the rest of the file is discarded until the client's end
+	 * of file so closing doesn't reset the connection before X is read.
+	*/
+	bool upload_draining;
+	
+	/* Pseudo-program being run in place of a process. */
+	struct Synthetic synthetic;
+	
+	struct ConnectionStats stats;
+	DWORD accepted_tick;
+	
+	struct PhaseTimes phases;
+	uint64_t request_us;
+	
+	/* Set while the condition being timed for stats holds. */
+	bool sendbuf_full;
+	DWORD sendbuf_full_since;
+	bool stdin_stalled;
+	DWORD stdin_stalled_since;
 };
 
 struct MessageHeader
@@ -97,98 +482,533 @@ struct MessageHeader
 	uint16_t payload_length;
 } __attribute__((packed));
 
+struct OutputPolicyMessage
+{
+	unsigned char stream;  /* 'O' or 'E' */
+	unsigned char mode;    /* enum OutputPolicyMode */
+	uint32_t limit;
+} __attribute__((packed));
+
+struct RedirectMessage
+{
+	unsigned char stream;  /* 'I', 'O' or 'E' */
+	unsigned char mode;    /* enum RedirectMode */
+	
+	/* Followed by path (not terminated), empty for RM_STDOUT. */
+} __attribute__((packed));
+
+struct CommandResult
+{
+	uint32_t index;
+	int32_t exit_code;
+} __attribute__((packed));
+
 static int next_connection_id = 1;
+
+static struct ServerStats server_stats;
+
+/* Log messages are formatted by the event loop into a ring of slots which the
+ * writer thread drains, so a slow console or disk never holds up the loop.
+ *
+ * The event loop is the only producer and only advances log_tail, the writer
+ * is the only consumer and only advances log_head, so no lock is needed. Both
+ * only ever increase (wrapping), their difference is the number of slots in
+ * use. If the queue is full, the message is dropped and counted instead.
+*/
+static enum LogLevel log_level = LOG_INFO;
+static HANDLE log_output = NULL;
+static HANDLE log_event = NULL;
+static char log_slots[LOG_QUEUE_SLOTS][LOG_MESSAGE_MAX];
+static volatile LONG log_head = 0;
+static volatile LONG log_tail = 0;
+static unsigned log_dropped = 0;
+
+static HANDLE trace_file = NULL;
+static struct TraceRecord trace_buffer[TRACE_BUFFER_RECORDS];
+static size_t trace_used = 0;
+static DWORD trace_flushed_tick;
+
+/* Size of the wait array, recorded against each trace event. */
+static size_t trace_wait_handles = 0;
+
+/* Performance counter ticks per microsecond, zero if there is no counter. */
+static double perf_ticks_per_us = -1.0;
+
+static DWORD coalesce_ms = COALESCE_MS;
+static int coalesce_bytes = COALESCE_BYTES;
 static struct Connection connections[MAX_CONNECTIONS];
 static size_t num_connections = 0;
 
 static void connection_init(int newsock);
+static bool log_start(const char *path);
+static void log_printf(enum LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static char *log_reserve(void);
+static void log_commit(char *slot);
+static DWORD WINAPI log_writer(LPVOID param);
+static uint64_t timestamp_us(void);
+static bool trace_open(const char *path);
+static void trace_event(int connection_id, enum TraceEvent event, uint32_t bytes);
+static void trace_flush(void);
+static uint64_t phase_elapsed(const struct Connection *connection);
 static bool store_string(char **dst, const char *src, size_t length);
 static bool connection_read(int connection_idx);
+static bool connection_dispatch(int connection_idx);
+static bool redirect_set(struct Connection *connection, const void *payload, size_t payload_length);
+static HANDLE redirect_open(struct Connection *connection, const struct Redirect *redirect, unsigned char stream);
+static void redirect_free(struct Redirect *redirect);
+static bool pipeline_push(struct Connection *connection);
+static bool connection_execute(int connection_idx);
+static HANDLE process_spawn(struct Connection *connection, const char *application_path, char *command_line, HANDLE stdin_handle, HANDLE stdout_handle, HANDLE stderr_handle);
+static HANDLE connection_process(const struct Connection *connection);
+static void connection_terminate(struct Connection *connection);
+static bool command_queue_push(struct CommandQueue *queue, const char *application_path, size_t application_path_length, const char *command_line, size_t command_line_length);
+static struct QueuedCommand *command_queue_pop(struct CommandQueue *queue);
+static void command_queue_free(struct CommandQueue *queue);
+static void command_free(struct QueuedCommand *command);
+static bool batch_push(struct Connection *connection);
+static bool batch_start(int connection_idx);
+static bool batch_next(int connection_idx);
+static bool batch_command_done(int connection_idx);
+static bool batch_result(int connection_idx, int32_t exit_code);
+static bool batch_end(int connection_idx, int32_t exit_code);
+static bool upload_start(int connection_idx, const char *path, size_t path_length);
+static bool upload_write(int connection_idx, const void *data, size_t length);
+static bool upload_finish(int connection_idx, DWORD error);
+static bool session_start(int connection_idx);
+static bool session_write(int connection_idx, const char *line, bool sentinel);
+static bool session_feed(int connection_idx);
+static bool session_output(int connection_idx, const unsigned char *data, size_t data_size);
+static bool session_forward(int connection_idx, const unsigned char *data, size_t data_size);
+static bool session_command_done(int connection_idx);
+static void session_free(struct Session *session);
 static bool connection_write(int connection_idx, unsigned char cmd, const void *payload, int payload_length);
+static bool connection_exit(int connection_idx, const void *exit_codes, int exit_codes_length);
+static void stats_output(struct Connection *connection, unsigned char cmd, int payload_length, bool new_frame);
+static void stats_read_size(struct Connection *connection, size_t data_size);
+static void histogram_add(struct Histogram *histogram, uint64_t value);
+static int command_line_next(const char **command_line, char *buf, size_t buf_size);
+static void command_line_put(char *buf, size_t buf_size, size_t *length, char c);
+static bool synthetic_start(int connection_idx);
+static bool synthetic_input(int connection_idx, const void *data, size_t length);
+static bool synthetic_generate(int connection_idx);
+static DWORD synthetic_timeout(const struct Connection *connection, DWORD now);
+static bool synthetic_finish(int connection_idx, DWORD exit_code);
+static void synthetics_run(void);
+static bool server_status(int connection_idx);
+static int status_histogram(char *buf, int buf_size, const char *name, const struct Histogram *histogram);
 static bool connection_flush(int connection_idx);
+static bool connection_coalesce(int connection_idx, unsigned char cmd, const void *payload, int payload_length);
+static void connections_flush_held(void);
 static void connection_close(int connection_idx);
 static char *path_search(const char *program_name);
-static void pipe_read(int connection_idx, PipeReadHandle *pipe9x_handle, unsigned char command);
+static bool output_policy_set(struct Connection *connection, const void *payload, size_t payload_length);
+static size_t output_policy_filter(int connection_idx, struct OutputPolicy *policy, unsigned char command, const void *data, size_t data_size);
+static bool output_policy_finish(int connection_idx, struct OutputPolicy *policy, unsigned char command);
+static void output_policy_rearm(struct OutputPolicy *policy);
+static void output_policy_free(struct OutputPolicy *policy);
+static void memrotate(unsigned char *buf, size_t size, size_t offset);
+static void memreverse(unsigned char *buf, size_t size);
+static void pipe_read(int connection_idx, PipeReadHandle *pipe9x_handle, struct OutputPolicy *policy, unsigned char command);
 static void process_exit(int connection_idx);
 
-static void connection_init(int newsock)
+/* Opens the log (stderr if path is NULL) and starts the thread writing it. */
+static bool log_start(const char *path)
 {
-	if(num_connections == MAX_CONNECTIONS)
+	if(path != NULL)
 	{
-		fprintf(stderr, "Too many open connections, dropping connection\n");
-		closesocket(newsock);
+		log_output = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(log_output == INVALID_HANDLE_VALUE)
+		{
+			fprintf(stderr, "Unable to open %s: %u\n", path, (unsigned)(GetLastError()));
+			return false;
+		}
 		
+		SetFilePointer(log_output, 0, NULL, FILE_END);
+	}
+	else{
+		log_output = GetStdHandle(STD_ERROR_HANDLE);
+	}
+	
+	log_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(log_event == NULL)
+	{
+		fprintf(stderr, "CreateEvent: %u\n", (unsigned)(GetLastError()));
+		return false;
+	}
+	
+	DWORD thread_id;
+	HANDLE thread = CreateThread(NULL, 0, &log_writer, NULL, 0, &thread_id);
+	if(thread == NULL)
+	{
+		fprintf(stderr, "CreateThread: %u\n", (unsigned)(GetLastError()));
+		return false;
+	}
+	
+	CloseHandle(thread);
+	
+	return true;
+}
+
+/* Queues a message for the log if it is at or above the configured level.
+ * Never blocks.
+*/
+static void log_printf(enum LogLevel level, const char *fmt, ...)
+{
+	if(level > log_level)
+	{
 		return;
 	}
 	
-	struct Connection *connection = &(connections[num_connections++]);
+	char *slot;
 	
-	connection->id = next_connection_id++;
-	connection->state = CS_SETUP;
+	if(log_dropped > 0)
+	{
+		/* Report the gap as soon as there is room again. */
+		
+		if((slot = log_reserve()) == NULL)
+		{
+			++log_dropped;
+			return;
+		}
+		
+		snprintf(slot, (LOG_MESSAGE_MAX - 1), "(%u log messages dropped)\n", log_dropped);
+		log_commit(slot);
+		
+		log_dropped = 0;
+	}
 	
-	connection->sock = newsock;
+	if((slot = log_reserve()) == NULL)
+	{
+		++log_dropped;
+		return;
+	}
 	
-	connection->recvbuf_used = 0;
-	connection->sendbuf_used = 0;
+	va_list argv;
+	va_start(argv, fmt);
 	
-	connection->application_path  = NULL;
-	connection->command_line      = NULL;
-	connection->working_directory = NULL;
+	vsnprintf(slot, (LOG_MESSAGE_MAX - 1), fmt, argv);
 	
-	connection->process     = NULL;
-	connection->stdin_pipe  = NULL;
-	connection->stdout_pipe = NULL;
-	connection->stderr_pipe = NULL;
+	va_end(argv);
 	
-	printf("[%d] New connection established\n", connection->id);
+	log_commit(slot);
 }
 
-static bool connection_read(int connection_idx)
+/* Returns the next free slot in the log queue, or NULL if it is full. Messages
+ * written to it must leave room for a '\r' to be inserted.
+*/
+static char *log_reserve(void)
 {
-	struct Connection *connection = &(connections[connection_idx]);
+	DWORD tail = log_tail;
 	
-	if(connection->recvbuf_used == RECVBUF_SIZE)
+	if((tail - (DWORD)(log_head)) == LOG_QUEUE_SLOTS)
 	{
-		return true;
+		return NULL;
 	}
 	
-	int read_bytes = recv(connection->sock, (char*)(connection->recvbuf + connection->recvbuf_used), (RECVBUF_SIZE - connection->recvbuf_used), 0);
+	return log_slots[tail % LOG_QUEUE_SLOTS];
+}
+
+/* Hands the slot returned by log_reserve() over to the writer thread. */
+static void log_commit(char *slot)
+{
+	size_t length = strlen(slot);
 	
-	if(read_bytes <= 0)
+	if(length > 0 && slot[length - 1] == '\n')
 	{
-		if(read_bytes == 0)
+		/* Nothing converts line endings for us on the way out. */
+		
+		slot[length - 1] = '\r';
+		slot[length] = '\n';
+		slot[length + 1] = '\0';
+	}
+	
+	/* The slot must be complete before the writer can see it. */
+	InterlockedExchange(&log_tail, (log_tail + 1));
+	SetEvent(log_event);
+}
+
+static DWORD WINAPI log_writer(LPVOID param)
+{
+	while(TRUE)
+	{
+		WaitForSingleObject(log_event, INFINITE);
+		
+		DWORD head = log_head;
+		
+		while(head != (DWORD)(log_tail))
 		{
-			fprintf(stderr, "[%d] Connection closed (end of file)\n", connection->id);
-		}
-		else{
-			DWORD error = WSAGetLastError();
+			const char *slot = log_slots[head % LOG_QUEUE_SLOTS];
 			
-			if(error == WSAEWOULDBLOCK)
-			{
-				return true;
-			}
-			else{
-				fprintf(stderr, "[%d] Connection read error %u\n", connection->id, (unsigned)(error));
-			}
+			DWORD written;
+			WriteFile(log_output, slot, strlen(slot), &written, NULL);
+			
+			/* Hand the slot back only once we're done with it. */
+			InterlockedExchange(&log_head, ++head);
 		}
+	}
+	
+	return 0;
+}
+
+/* Returns a high resolution timestamp in microseconds. */
+static uint64_t timestamp_us(void)
+{
+	if(perf_ticks_per_us < 0.0)
+	{
+		LARGE_INTEGER frequency;
 		
-		connection_close(connection_idx);
+		perf_ticks_per_us = QueryPerformanceFrequency(&frequency)
+			? ((double)(frequency.QuadPart) / 1000000.0)
+			: 0.0;
+	}
+	
+	LARGE_INTEGER counter;
+	
+	if(perf_ticks_per_us > 0.0 && QueryPerformanceCounter(&counter))
+	{
+		return (uint64_t)((double)(counter.QuadPart) / perf_ticks_per_us);
+	}
+	else{
+		return (uint64_t)(GetTickCount()) * 1000;
+	}
+}
+
+static bool trace_open(const char *path)
+{
+	trace_file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(trace_file == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Unable to create %s: %u\n", path, (unsigned)(GetLastError()));
+		
+		trace_file = NULL;
 		return false;
 	}
 	
-	connection->recvbuf_used += read_bytes;
+	struct TraceHeader header;
+	memcpy(header.magic, "ICE9TRAC", sizeof(header.magic));
+	header.version = 1;
+	header.record_size = sizeof(struct TraceRecord);
 	
-	while(connection->recvbuf_used >= sizeof(struct MessageHeader))
+	DWORD written;
+	if(!WriteFile(trace_file, &header, sizeof(header), &written, NULL) || written != sizeof(header))
 	{
-		struct MessageHeader *header = (struct MessageHeader*)(connection->recvbuf);
+		fprintf(stderr, "Unable to write %s: %u\n", path, (unsigned)(GetLastError()));
 		
-		const void *payload = header + 1;
-		int payload_length = header->payload_length;
+		CloseHandle(trace_file);
+		trace_file = NULL;
 		
-		if(connection->recvbuf_used >= (sizeof(struct MessageHeader) + payload_length))
-		{
-			/* Got a complete message. */
-			
+		return false;
+	}
+	
+	trace_flushed_tick = GetTickCount();
+	
+	return true;
+}
+
+/* Appends a record to the trace buffer, writing the buffer out if it fills. */
+static void trace_event(int connection_id, enum TraceEvent event, uint32_t bytes)
+{
+	if(trace_file == NULL)
+	{
+		return;
+	}
+	
+	struct TraceRecord *record = &(trace_buffer[trace_used++]);
+	
+	record->timestamp_us  = timestamp_us();
+	record->connection_id = connection_id;
+	record->bytes         = bytes;
+	record->wait_handles  = trace_wait_handles;
+	record->event         = event;
+	record->reserved      = 0;
+	
+	if(trace_used == TRACE_BUFFER_RECORDS)
+	{
+		trace_flush();
+	}
+}
+
+static void trace_flush(void)
+{
+	if(trace_file == NULL || trace_used == 0)
+	{
+		return;
+	}
+	
+	DWORD length = trace_used * sizeof(*trace_buffer);
+	DWORD written;
+	
+	if(!WriteFile(trace_file, trace_buffer, length, &written, NULL) || written != length)
+	{
+		/* Carrying on without the trace beats taking the server down. */
+		
+		log_printf(LOG_ERROR, "Unable to write trace, tracing stopped: %u\n", (unsigned)(GetLastError()));
+		
+		CloseHandle(trace_file);
+		trace_file = NULL;
+	}
+	
+	trace_used = 0;
+	trace_flushed_tick = GetTickCount();
+}
+
+/* Returns the time since the request started arriving, for recording against
+ * a phase. Never returns zero, since that means the phase wasn't reached.
+*/
+static uint64_t phase_elapsed(const struct Connection *connection)
+{
+	uint64_t elapsed = timestamp_us() - connection->request_us;
+	return elapsed > 0 ? elapsed : 1;
+}
+
+static void connection_init(int newsock)
+{
+	if(num_connections == MAX_CONNECTIONS)
+	{
+		log_printf(LOG_WARNING, "Too many open connections, dropping connection\n");
+		closesocket(newsock);
+		
+		++(server_stats.connections_rejected);
+		trace_event(0, TE_REJECT, 0);
+		
+		return;
+	}
+	
+	struct Connection *connection = &(connections[num_connections++]);
+	
+	++(server_stats.connections_accepted);
+	
+	connection->id = next_connection_id++;
+	connection->state = CS_SETUP;
+	
+	connection->sock = newsock;
+	
+	connection->recvbuf_used = 0;
+	connection->sendbuf_used = 0;
+	
+	connection->holding = false;
+	connection->merge_offset = -1;
+	
+	connection->application_path  = NULL;
+	connection->command_line      = NULL;
+	connection->working_directory = NULL;
+	
+	connection->pipeline_length = 0;
+	
+	connection->num_processes = 0;
+	connection->num_exited    = 0;
+	
+	connection->stdin_pipe  = NULL;
+	connection->stdout_pipe = NULL;
+	connection->stderr_pipe = NULL;
+	
+	memset(&(connection->stdout_policy), 0, sizeof(connection->stdout_policy));
+	connection->stdout_policy.mode = OP_ALL;
+	
+	memset(&(connection->stderr_policy), 0, sizeof(connection->stderr_policy));
+	connection->stderr_policy.mode = OP_ALL;
+	
+	memset(&(connection->stdin_redirect), 0, sizeof(connection->stdin_redirect));
+	memset(&(connection->stdout_redirect), 0, sizeof(connection->stdout_redirect));
+	memset(&(connection->stderr_redirect), 0, sizeof(connection->stderr_redirect));
+	
+	connection->flags = 0;
+	
+	memset(&(connection->session), 0, sizeof(connection->session));
+	memset(&(connection->commands), 0, sizeof(connection->commands));
+	
+	connection->batch = false;
+	connection->batch_index = 0;
+	connection->execute_error = ERROR_SUCCESS;
+	
+	connection->upload_file = NULL;
+	connection->upload_path = NULL;
+	connection->upload_draining = false;
+	
+	memset(&(connection->synthetic), 0, sizeof(connection->synthetic));
+	
+	memset(&(connection->stats), 0, sizeof(connection->stats));
+	connection->accepted_tick = GetTickCount();
+	
+	memset(&(connection->phases), 0, sizeof(connection->phases));
+	connection->request_us = 0;
+	
+	connection->sendbuf_full = false;
+	connection->stdin_stalled = false;
+	
+	trace_event(connection->id, TE_ACCEPT, 0);
+	
+	log_printf(LOG_INFO, "[%d] New connection established\n", connection->id);
+}
+
+static bool connection_read(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	if(connection->recvbuf_used == RECVBUF_SIZE)
+	{
+		return true;
+	}
+	
+	int read_bytes = recv(connection->sock, (char*)(connection->recvbuf + connection->recvbuf_used), (RECVBUF_SIZE - connection->recvbuf_used), 0);
+	
+	if(read_bytes <= 0)
+	{
+		if(read_bytes == 0)
+		{
+			log_printf(LOG_DEBUG, "[%d] Connection closed (end of file)\n", connection->id);
+		}
+		else{
+			DWORD error = WSAGetLastError();
+			
+			if(error == WSAEWOULDBLOCK)
+			{
+				return true;
+			}
+			else{
+				log_printf(LOG_WARNING, "[%d] Connection read error %u\n", connection->id, (unsigned)(error));
+			}
+		}
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	connection->recvbuf_used += read_bytes;
+	server_stats.bytes_received += read_bytes;
+	
+	/* Phases are timed from here rather than from accepting the connection,
+	 * which may have been held open by a master long before being used.
+	*/
+	
+	if(connection->request_us == 0)
+	{
+		connection->request_us = timestamp_us();
+	}
+	
+	trace_event(connection->id, TE_RECV, read_bytes);
+	
+	return connection_dispatch(connection_idx);
+}
+
+/* Processes each complete message in the receive buffer, stopping early if
+ * stdin can't be accepted yet.
+*/
+static bool connection_dispatch(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	while(connection->recvbuf_used >= sizeof(struct MessageHeader))
+	{
+		struct MessageHeader *header = (struct MessageHeader*)(connection->recvbuf);
+		
+		const void *payload = header + 1;
+		int payload_length = header->payload_length;
+		
+		if(connection->recvbuf_used >= (sizeof(struct MessageHeader) + payload_length))
+		{
+			/* Got a complete message. */
+			
 			switch(header->command)
 			{
 				case 'A':
@@ -224,243 +1044,2279 @@ static bool connection_read(int connection_idx)
 					break;
 				}
 				
-				case 'E':
+				case 'P':
 				{
-					PipeReadHandle stdin_read, stdout_read, stderr_read;
-					PipeWriteHandle stdin_write, stdout_write, stderr_write;
+					if(!output_policy_set(connection, payload, header->payload_length))
+					{
+						connection_close(connection_idx);
+						return false;
+					}
 					
-					DWORD pipe_error = pipe9x_create(&stdin_read, PIPE_READ_SIZE, TRUE, &stdin_write, PIPE_READ_SIZE, FALSE);
-					if(pipe_error != ERROR_SUCCESS)
+					break;
+				}
+				
+				case '|':
+				{
+					if(!pipeline_push(connection))
 					{
-						fprintf(stderr, "pipe9x_create: %u\n", (unsigned)(pipe_error));
-						
 						connection_close(connection_idx);
 						return false;
 					}
 					
-					pipe_error = pipe9x_create(&stdout_read, PIPE_READ_SIZE, FALSE, &stdout_write, PIPE_READ_SIZE, TRUE);
-					if(pipe_error != ERROR_SUCCESS)
+					break;
+				}
+				
+				case 'Q':
+				{
+					if(!batch_push(connection))
 					{
-						fprintf(stderr, "pipe9x_create: %u\n", (unsigned)(pipe_error));
-						
-						pipe9x_write_close(stdin_write);
-						pipe9x_read_close(stdin_read);
-						
 						connection_close(connection_idx);
 						return false;
 					}
 					
-					pipe_error = pipe9x_create(&stderr_read, PIPE_READ_SIZE, FALSE, &stderr_write, PIPE_READ_SIZE, TRUE);
-					if(pipe_error != ERROR_SUCCESS)
+					break;
+				}
+				
+				case 'F':
+				{
+					if(header->payload_length != sizeof(uint32_t))
 					{
-						fprintf(stderr, "pipe9x_create: %u\n", (unsigned)(pipe_error));
-						
-						pipe9x_write_close(stdout_write);
-						pipe9x_read_close(stdout_read);
-
-						pipe9x_write_close(stdin_write);
-						pipe9x_read_close(stdin_read);
+						log_printf(LOG_WARNING, "[%d] Malformed flags message\n", connection->id);
 						
 						connection_close(connection_idx);
 						return false;
 					}
 					
-					STARTUPINFO si;
-					memset(&si, 0, sizeof(si));
-					
-					si.cb         = sizeof(si);
-					si.dwFlags    = STARTF_USESTDHANDLES;
-					si.hStdInput  = pipe9x_read_pipe(stdin_read);
-					si.hStdOutput = pipe9x_write_pipe(stdout_write);
-					si.hStdError  = pipe9x_write_pipe(stderr_write);
+					memcpy(&(connection->flags), payload, sizeof(uint32_t));
 					
-					PROCESS_INFORMATION pi;
-					
-					fprintf(stderr, "application_path = %s\n", connection->application_path);
-					fprintf(stderr, "command_line = %s\n", connection->command_line);
-					
-					const char *application_path = connection->application_path;
-					char *application_path_buf = NULL;
-					
-					if(
-						strchr(application_path, '\\') == NULL
-						&& GetFileAttributes(application_path) == INVALID_FILE_ATTRIBUTES)
+					if(connection->flags & CF_INTERACTIVE)
 					{
-						/* application_path doesn't contain any slashes and doesn't appear
-						 * to exist in the working directory, search PATH for it.
+						/* Send each echoed keystroke as soon as it is written rather
+						 * than waiting for the previous one to be acknowledged.
 						*/
 						
-						fprintf(stderr, "[%d] %s not found, searching PATH...\n", connection->id, connection->application_path);
-						
-						application_path_buf = path_search(connection->application_path);
-						if(application_path_buf != NULL)
-						{
-							fprintf(stderr, "[%d] Found %s\n", connection->id, application_path_buf);
-							application_path = application_path_buf;
-						}
+						BOOL nodelay = TRUE;
+						setsockopt(connection->sock, IPPROTO_TCP, TCP_NODELAY, (const char*)(&nodelay), sizeof(nodelay));
 					}
 					
-					if(CreateProcess(
-						application_path,               /* lpApplicationName */
-						connection->command_line,       /* lpCommandLine */
-						NULL,                           /* lpProcessAttributes */
-						NULL,                           /* lpThreadAttributes */
-						TRUE,                           /* bInheritHandles */
-						DETACHED_PROCESS,               /* dwCreationFlags */
-						NULL,                           /* lpEnvironment */
-						connection->working_directory,  /* lpCurrentDirectory */
-						&si,                            /* lpStartupInfo */
-						&pi))                           /* lpProcessInformation */
+					break;
+				}
+				
+				case 'R':
+				{
+					if(!redirect_set(connection, payload, header->payload_length))
 					{
-						pipe9x_read_close(stdin_read);
-						pipe9x_write_close(stdout_write);
-						pipe9x_write_close(stderr_write);
-						
-						CloseHandle(pi.hThread);
-						
-						connection->process     = pi.hProcess;
-						connection->stdin_pipe  = stdin_write;
-						connection->stdout_pipe = stdout_read;
-						connection->stderr_pipe = stderr_read;
-						
-						if(pipe9x_read_initiate(stdout_read) != ERROR_IO_PENDING)
+						connection_close(connection_idx);
+						return false;
+					}
+					
+					break;
+				}
+				
+				case 'E':
+				{
+					if(connection->phases.execute_us == 0)
+					{
+						connection->phases.execute_us = phase_elapsed(connection);
+					}
+					
+					if(connection->commands.head != NULL)
+					{
+						if(!batch_start(connection_idx))
 						{
-							abort();
+							return false;
 						}
-						
-						if(pipe9x_read_initiate(stderr_read) != ERROR_IO_PENDING)
+					}
+					else if(connection->application_path != NULL
+						&& strncmp(connection->application_path, SYNTHETIC_PREFIX, strlen(SYNTHETIC_PREFIX)) == 0)
+					{
+						if(!synthetic_start(connection_idx))
 						{
-							abort();
+							return false;
 						}
 					}
-					else{
-						fprintf(stderr, "CreateProcess: %u\n", (unsigned)(GetLastError()));
-						
-						free(application_path_buf);
-						
-						/*
-						pipe9x_write_close(stderr_write);
-						pipe9x_read_close(stderr_read);
-						pipe9x_write_close(stdout_write);
-						pipe9x_read_close(stdout_read);
-						pipe9x_write_close(stdin_write);
-						pipe9x_read_close(stdin_read);
-						*/
-						
-						connection_close(connection_idx);
+					else if(!connection_execute(connection_idx))
+					{
 						return false;
 					}
 					
-					free(application_path_buf);
+					break;
+				}
+				
+				case 'S':
+				{
+					if(!session_start(connection_idx))
+					{
+						return false;
+					}
 					
 					break;
 				}
 				
-				case 'I':
+				case 'K':
 				{
+					if(!connection->session.active)
+					{
+						log_printf(LOG_WARNING, "[%d] Received command without a session\n", connection->id);
+						
+						connection_close(connection_idx);
+						return false;
+					}
+					
 					if(header->payload_length == 0)
 					{
-						pipe9x_write_close(connection->stdin_pipe);
-						connection->stdin_pipe = NULL;
+						connection->session.input_closed = true;
 					}
-					else if(connection->stdin_pipe != NULL)
+					else if(connection->session.input_closed)
 					{
-						if(pipe9x_write_pending(connection->stdin_pipe))
-						{
-							/* Stall until current write on stdin pipe completes. */
-							return true;
-						}
-						
-						// fprintf(stderr, "[%d] Writing %u bytes to child stdin\n", connection->id, (unsigned)(header->payload_length));
-						
-						DWORD error = pipe9x_write_initiate(connection->stdin_pipe, payload, header->payload_length);
-						if(error != ERROR_IO_PENDING)
-						{
-							fprintf(stderr, "[%d] Write error %u on child stdin\n", connection->id, (unsigned)(error));
-							
-							connection_close(connection_idx);
-							return false;
-						}
+						/* Stopped after a failed command, ignore the rest. */
+					}
+					else if(!command_queue_push(&(connection->commands), NULL, 0, (const char*)(payload), header->payload_length))
+					{
+						connection_close(connection_idx);
+						return false;
+					}
+					
+					if(!session_feed(connection_idx))
+					{
+						return false;
 					}
 					
 					break;
 				}
 				
-				default:
+				case 'G':
 				{
-					fprintf(stderr, "Received unrecognised command: %c\n", header->command);
-					connection_close(connection_idx);
+					if(!server_status(connection_idx))
+					{
+						return false;
+					}
 					
-					return false;
+					break;
 				}
-			}
-			
-			int total_length = sizeof(struct MessageHeader) + payload_length;
-			
-			memmove(connection->recvbuf, (connection->recvbuf + total_length), (connection->recvbuf_used - total_length));
-			connection->recvbuf_used -= total_length;
-		}
-		else{
-			break;
-		}
-	}
-	
-	return true;
+				
+				case 'U':
+				{
+					if(!upload_start(connection_idx, (const char*)(payload), header->payload_length))
+					{
+						return false;
+					}
+					
+					break;
+				}
+				
+				case 'I':
+				{
+					if(connection->upload_file != NULL)
+					{
+						++(connection->stats.stdin_frames);
+						connection->stats.stdin_bytes += header->payload_length;
+						
+						if(!upload_write(connection_idx, payload, header->payload_length))
+						{
+							return false;
+						}
+					}
+					else if(connection->upload_draining)
+					{
+						if(header->payload_length == 0)
+						{
+							connection->upload_draining = false;
+							
+							if(!connection_flush(connection_idx))
+							{
+								return false;
+							}
+						}
+					}
+					else if(connection->session.active)
+					{
+						/* The interpreter's stdin belongs to the session. */
+					}
+					else if(connection->synthetic.kind != SK_NONE)
+					{
+						if(connection->synthetic.kind == SK_ECHO
+							&& (SENDBUF_SIZE - connection->sendbuf_used) < (sizeof(struct MessageHeader) + header->payload_length + SENDBUF_HEADROOM))
+						{
+							/* Stall until the client has taken some output, as a
+							 * real child would be stuck writing it.
+							*/
+							
+							if(!connection->synthetic.stalled)
+							{
+								connection->synthetic.stalled = true;
+								++(connection->stats.stdin_stalls);
+							}
+							
+							return true;
+						}
+						
+						connection->synthetic.stalled = false;
+						
+						if(!synthetic_input(connection_idx, payload, header->payload_length))
+						{
+							return false;
+						}
+					}
+					else if(header->payload_length == 0)
+					{
+						if(connection->stdin_pipe != NULL)
+						{
+							pipe9x_write_close(connection->stdin_pipe);
+							connection->stdin_pipe = NULL;
+						}
+					}
+					else if(connection->stdin_pipe != NULL)
+					{
+						if(pipe9x_write_pending(connection->stdin_pipe))
+						{
+							/* Stall until current write on stdin pipe completes. */
+							
+							if(!connection->stdin_stalled)
+							{
+								connection->stdin_stalled = true;
+								connection->stdin_stalled_since = GetTickCount();
+								
+								++(connection->stats.stdin_stalls);
+							}
+							
+							return true;
+						}
+						
+						if(connection->stdin_stalled)
+						{
+							connection->stdin_stalled = false;
+							connection->stats.stdin_stall_ms += GetTickCount() - connection->stdin_stalled_since;
+						}
+						
+						++(connection->stats.stdin_frames);
+						connection->stats.stdin_bytes += header->payload_length;
+						
+						// fprintf(stderr, "[%d] Writing %u bytes to child stdin\n", connection->id, (unsigned)(header->payload_length));
+						
+						DWORD error = pipe9x_write_initiate(connection->stdin_pipe, payload, header->payload_length);
+						if(error != ERROR_IO_PENDING)
+						{
+							log_printf(LOG_ERROR, "[%d] Write error %u on child stdin\n", connection->id, (unsigned)(error));
+							
+							connection_close(connection_idx);
+							return false;
+						}
+					}
+					
+					break;
+				}
+				
+				default:
+				{
+					log_printf(LOG_WARNING, "Received unrecognised command: %c\n", header->command);
+					connection_close(connection_idx);
+					
+					return false;
+				}
+			}
+			
+			int total_length = sizeof(struct MessageHeader) + payload_length;
+			
+			memmove(connection->recvbuf, (connection->recvbuf + total_length), (connection->recvbuf_used - total_length));
+			connection->recvbuf_used -= total_length;
+		}
+		else{
+			break;
+		}
+	}
+	
+	return true;
+}
+
+static bool store_string(char **dst, const char *src, size_t length)
+{
+	free(*dst);
+	*dst = malloc(length + 1);
+	
+	if(*dst == NULL)
+	{
+		log_printf(LOG_ERROR, "Memory allocation failed\n");
+		return false;
+	}
+	
+	memcpy(*dst, src, length);
+	(*dst)[length] = '\0';
+	
+	return true;
+}
+
+/* Moves the application_path/command_line set so far into a new pipeline
+ * stage, ready for the next stage to be described.
+*/
+static bool pipeline_push(struct Connection *connection)
+{
+	if(connection->application_path == NULL)
+	{
+		log_printf(LOG_WARNING, "[%d] Pipeline stage has no application path\n", connection->id);
+		return false;
+	}
+	
+	if(connection->pipeline_length == (MAX_PIPELINE_STAGES - 1))
+	{
+		log_printf(LOG_WARNING, "[%d] Too many pipeline stages\n", connection->id);
+		return false;
+	}
+	
+	struct PipelineStage *stage = &(connection->pipeline[connection->pipeline_length++]);
+	
+	stage->application_path = connection->application_path;
+	stage->command_line = connection->command_line;
+	
+	connection->application_path = NULL;
+	connection->command_line = NULL;
+	
+	return true;
+}
+
+static bool redirect_set(struct Connection *connection, const void *payload, size_t payload_length)
+{
+	if(payload_length < sizeof(struct RedirectMessage))
+	{
+		log_printf(LOG_WARNING, "[%d] Malformed redirect message\n", connection->id);
+		return false;
+	}
+	
+	const struct RedirectMessage *msg = (const struct RedirectMessage*)(payload);
+	
+	const char *path = (const char*)(msg + 1);
+	size_t path_length = payload_length - sizeof(struct RedirectMessage);
+	
+	struct Redirect *redirect;
+	
+	switch(msg->stream)
+	{
+		case 'I':
+			redirect = &(connection->stdin_redirect);
+			
+			if(msg->mode != RM_READ)
+			{
+				log_printf(LOG_WARNING, "[%d] Unsupported redirect mode for stdin: %c\n", connection->id, msg->mode);
+				return false;
+			}
+			
+			break;
+			
+		case 'O':
+			redirect = &(connection->stdout_redirect);
+			
+			if(msg->mode != RM_WRITE && msg->mode != RM_APPEND)
+			{
+				log_printf(LOG_WARNING, "[%d] Unsupported redirect mode for stdout: %c\n", connection->id, msg->mode);
+				return false;
+			}
+			
+			break;
+			
+		case 'E':
+			redirect = &(connection->stderr_redirect);
+			
+			if(msg->mode != RM_WRITE && msg->mode != RM_APPEND && msg->mode != RM_STDOUT)
+			{
+				log_printf(LOG_WARNING, "[%d] Unsupported redirect mode for stderr: %c\n", connection->id, msg->mode);
+				return false;
+			}
+			
+			break;
+			
+		default:
+			log_printf(LOG_WARNING, "[%d] Redirect for unknown stream: %c\n", connection->id, msg->stream);
+			return false;
+	}
+	
+	if(msg->mode != RM_STDOUT && path_length == 0)
+	{
+		log_printf(LOG_WARNING, "[%d] Redirect for %c has no path\n", connection->id, msg->stream);
+		return false;
+	}
+	
+	if(!store_string(&(redirect->path), path, path_length))
+	{
+		return false;
+	}
+	
+	redirect->mode = msg->mode;
+	
+	return true;
+}
+
+/* Opens an inheritable handle to the file a standard handle is redirected to.
+ * Returns NULL on failure.
+*/
+static HANDLE redirect_open(struct Connection *connection, const struct Redirect *redirect, unsigned char stream)
+{
+	SECURITY_ATTRIBUTES sa;
+	sa.nLength = sizeof(sa);
+	sa.lpSecurityDescriptor = NULL;
+	sa.bInheritHandle = TRUE;
+	
+	HANDLE file;
+	
+	if(redirect->mode == RM_READ)
+	{
+		file = CreateFile(redirect->path, GENERIC_READ, (FILE_SHARE_READ | FILE_SHARE_WRITE), &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	}
+	else{
+		file = CreateFile(redirect->path, GENERIC_WRITE, FILE_SHARE_READ, &sa,
+			(redirect->mode == RM_APPEND ? OPEN_ALWAYS : CREATE_ALWAYS), FILE_ATTRIBUTE_NORMAL, NULL);
+	}
+	
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		connection->execute_error = GetLastError();
+		
+		log_printf(LOG_ERROR, "[%d] Unable to open %s for %c: %u\n", connection->id, redirect->path, stream, (unsigned)(connection->execute_error));
+		return NULL;
+	}
+	
+	if(redirect->mode == RM_APPEND)
+	{
+		SetFilePointer(file, 0, NULL, FILE_END);
+	}
+	
+	return file;
+}
+
+static void redirect_free(struct Redirect *redirect)
+{
+	free(redirect->path);
+	redirect->path = NULL;
+	
+	redirect->mode = 0;
+}
+
+static bool connection_execute(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	PipeReadHandle stdin_read = NULL, stdout_read = NULL, stderr_read = NULL;
+	PipeWriteHandle stdin_write = NULL, stdout_write = NULL, stderr_write = NULL;
+	
+	HANDLE stdin_file = NULL, stdout_file = NULL, stderr_file = NULL;
+	
+	HANDLE stdin_handle, stdout_handle, stderr_handle = NULL;
+	
+	bool close_pipes = true;
+	DWORD pipe_error;
+	
+	if(connection->application_path == NULL)
+	{
+		log_printf(LOG_WARNING, "[%d] Execute requested without an application path\n", connection->id);
+		
+		connection->execute_error = ERROR_INVALID_PARAMETER;
+		goto FAIL;
+	}
+	
+	/* Standard handles redirected to files are opened here and passed directly
+	 * to the child, anything else gets a pipe back to us.
+	*/
+	
+	if(connection->stdin_redirect.mode != 0)
+	{
+		stdin_file = redirect_open(connection, &(connection->stdin_redirect), 'I');
+		if(stdin_file == NULL)
+		{
+			goto FAIL;
+		}
+		
+		stdin_handle = stdin_file;
+	}
+	else{
+		pipe_error = pipe9x_create(&stdin_read, PIPE_READ_SIZE, TRUE, &stdin_write, PIPE_READ_SIZE, FALSE);
+		if(pipe_error != ERROR_SUCCESS)
+		{
+			log_printf(LOG_ERROR, "pipe9x_create: %u\n", (unsigned)(pipe_error));
+			
+			connection->execute_error = pipe_error;
+			goto FAIL;
+		}
+		
+		stdin_handle = pipe9x_read_pipe(stdin_read);
+	}
+	
+	if(connection->stdout_redirect.mode != 0)
+	{
+		stdout_file = redirect_open(connection, &(connection->stdout_redirect), 'O');
+		if(stdout_file == NULL)
+		{
+			goto FAIL;
+		}
+		
+		stdout_handle = stdout_file;
+	}
+	else{
+		pipe_error = pipe9x_create(&stdout_read, PIPE_READ_SIZE, FALSE, &stdout_write, PIPE_READ_SIZE, TRUE);
+		if(pipe_error != ERROR_SUCCESS)
+		{
+			log_printf(LOG_ERROR, "pipe9x_create: %u\n", (unsigned)(pipe_error));
+			
+			connection->execute_error = pipe_error;
+			goto FAIL;
+		}
+		
+		stdout_handle = pipe9x_write_pipe(stdout_write);
+	}
+	
+	if(connection->stderr_redirect.mode == RM_STDOUT)
+	{
+		/* Left NULL, each process gets its own stdout as stderr. */
+	}
+	else if(connection->stderr_redirect.mode != 0)
+	{
+		stderr_file = redirect_open(connection, &(connection->stderr_redirect), 'E');
+		if(stderr_file == NULL)
+		{
+			goto FAIL;
+		}
+		
+		stderr_handle = stderr_file;
+	}
+	else{
+		pipe_error = pipe9x_create(&stderr_read, PIPE_READ_SIZE, FALSE, &stderr_write, PIPE_READ_SIZE, TRUE);
+		if(pipe_error != ERROR_SUCCESS)
+		{
+			log_printf(LOG_ERROR, "pipe9x_create: %u\n", (unsigned)(pipe_error));
+			
+			connection->execute_error = pipe_error;
+			goto FAIL;
+		}
+		
+		stderr_handle = pipe9x_write_pipe(stderr_write);
+	}
+	
+	/* Start each stage of the pipeline, connecting the stdout of each one to
+	 * the stdin of the next through an anonymous pipe which never touches us.
+	 *
+	 * The pipes are created non-inheritable and each child is only given an
+	 * inheritable duplicate of the ends it uses, otherwise every stage would
+	 * hold every pipe open and none of them would ever see end of file.
+	*/
+	
+	close_pipes = false;
+	
+	int num_stages = connection->pipeline_length + 1;
+	HANDLE stage_stdin = NULL;
+	
+	for(int i = 0; i < num_stages; ++i)
+	{
+		const char *application_path = connection->application_path;
+		char *command_line = connection->command_line;
+		
+		if(i < connection->pipeline_length)
+		{
+			application_path = connection->pipeline[i].application_path;
+			command_line = connection->pipeline[i].command_line;
+		}
+		
+		HANDLE child_stdin = stdin_handle;
+		HANDLE child_stdout = stdout_handle;
+		
+		HANDLE inherit_stdin = NULL, inherit_stdout = NULL;
+		HANDLE next_stdin = NULL, pipe_write = NULL;
+		
+		HANDLE process = NULL;
+		bool pipes_ok = true;
+		
+		if(i > 0)
+		{
+			pipes_ok = DuplicateHandle(GetCurrentProcess(), stage_stdin, GetCurrentProcess(), &inherit_stdin, 0, TRUE, DUPLICATE_SAME_ACCESS);
+			child_stdin = inherit_stdin;
+		}
+		
+		if(pipes_ok && (i + 1) < num_stages)
+		{
+			pipes_ok = CreatePipe(&next_stdin, &pipe_write, NULL, PIPE_READ_SIZE)
+				&& DuplicateHandle(GetCurrentProcess(), pipe_write, GetCurrentProcess(), &inherit_stdout, 0, TRUE, DUPLICATE_SAME_ACCESS);
+			
+			child_stdout = inherit_stdout;
+		}
+		
+		if(pipes_ok)
+		{
+			process = process_spawn(connection, application_path, command_line,
+				child_stdin, child_stdout, (stderr_handle != NULL ? stderr_handle : child_stdout));
+		}
+		else{
+			connection->execute_error = GetLastError();
+			log_printf(LOG_ERROR, "[%d] Unable to create pipeline pipe: %u\n", connection->id, (unsigned)(connection->execute_error));
+		}
+		
+		if(inherit_stdin != NULL)
+		{
+			CloseHandle(inherit_stdin);
+		}
+		
+		if(inherit_stdout != NULL)
+		{
+			CloseHandle(inherit_stdout);
+		}
+		
+		if(pipe_write != NULL)
+		{
+			CloseHandle(pipe_write);
+		}
+		
+		if(stage_stdin != NULL)
+		{
+			CloseHandle(stage_stdin);
+		}
+		
+		stage_stdin = next_stdin;
+		
+		if(process == NULL)
+		{
+			/* Any stages already started are terminated by connection_close(). */
+			
+			if(stage_stdin != NULL)
+			{
+				CloseHandle(stage_stdin);
+			}
+			
+			/* No child has inherited the pipes if this was the first stage. */
+			close_pipes = (connection->num_processes == 0);
+			
+			goto FAIL;
+		}
+		
+		connection->processes[connection->num_processes++] = process;
+	}
+	
+	if(connection->phases.spawned_us == 0)
+	{
+		connection->phases.spawned_us = phase_elapsed(connection);
+	}
+	
+	/* Close our copies of the handles now owned by the children. */
+	
+	if(stdin_read != NULL)
+	{
+		pipe9x_read_close(stdin_read);
+	}
+	
+	if(stdout_write != NULL)
+	{
+		pipe9x_write_close(stdout_write);
+	}
+	
+	if(stderr_write != NULL)
+	{
+		pipe9x_write_close(stderr_write);
+	}
+	
+	if(stdin_file != NULL)
+	{
+		CloseHandle(stdin_file);
+	}
+	
+	if(stdout_file != NULL)
+	{
+		CloseHandle(stdout_file);
+	}
+	
+	if(stderr_file != NULL)
+	{
+		CloseHandle(stderr_file);
+	}
+	
+	connection->stdin_pipe  = stdin_write;
+	connection->stdout_pipe = stdout_read;
+	connection->stderr_pipe = stderr_read;
+	
+	if(stdout_read != NULL && pipe9x_read_initiate(stdout_read) != ERROR_IO_PENDING)
+	{
+		abort();
+	}
+	
+	if(stderr_read != NULL && pipe9x_read_initiate(stderr_read) != ERROR_IO_PENDING)
+	{
+		abort();
+	}
+	
+	/* Redirected output streams will never see any data from us, so tell the
+	 * client they are already at end of file. A batch does this once at the end.
+	*/
+	
+	if(!connection->batch && stdout_read == NULL && !connection_write(connection_idx, 'O', "", 0))
+	{
+		return false;
+	}
+	
+	if(!connection->batch && stderr_read == NULL && !connection_write(connection_idx, 'E', "", 0))
+	{
+		return false;
+	}
+	
+	return true;
+	
+	FAIL:
+	
+	/* Pipes which a child may have inherited are leaked, as in
+	 * connection_close().
+	*/
+	
+	if(close_pipes)
+	{
+		if(stderr_read != NULL)
+		{
+			pipe9x_write_close(stderr_write);
+			pipe9x_read_close(stderr_read);
+		}
+		
+		if(stdout_read != NULL)
+		{
+			pipe9x_write_close(stdout_write);
+			pipe9x_read_close(stdout_read);
+		}
+		
+		if(stdin_read != NULL)
+		{
+			pipe9x_write_close(stdin_write);
+			pipe9x_read_close(stdin_read);
+		}
+	}
+	
+	if(stderr_file != NULL)
+	{
+		CloseHandle(stderr_file);
+	}
+	
+	if(stdout_file != NULL)
+	{
+		CloseHandle(stdout_file);
+	}
+	
+	if(stdin_file != NULL)
+	{
+		CloseHandle(stdin_file);
+	}
+	
+	if(connection->batch)
+	{
+		/* Nothing was started, batch_next() reports the command as failed and
+		 * carries on with the batch.
+		*/
+		
+		return true;
+	}
+	
+	connection_close(connection_idx);
+	return false;
+}
+
+/* Starts a process with the given standard handles, searching PATH for the
+ * application if necessary. Returns the process handle, or NULL on failure.
+*/
+static HANDLE process_spawn(struct Connection *connection, const char *application_path, char *command_line, HANDLE stdin_handle, HANDLE stdout_handle, HANDLE stderr_handle)
+{
+	STARTUPINFO si;
+	memset(&si, 0, sizeof(si));
+	
+	si.cb         = sizeof(si);
+	si.dwFlags    = STARTF_USESTDHANDLES;
+	si.hStdInput  = stdin_handle;
+	si.hStdOutput = stdout_handle;
+	si.hStdError  = stderr_handle;
+	
+	PROCESS_INFORMATION pi;
+	
+	log_printf(LOG_DEBUG, "application_path = %s\n", application_path);
+	log_printf(LOG_DEBUG, "command_line = %s\n", command_line);
+	
+	char *application_path_buf = NULL;
+	
+	uint64_t spawn_begin = timestamp_us();
+	
+	if(
+		strchr(application_path, DIR_SEPARATOR) == NULL
+		&& GetFileAttributes(application_path) == INVALID_FILE_ATTRIBUTES)
+	{
+		/* application_path doesn't contain any slashes and doesn't appear
+		 * to exist in the working directory, search PATH for it.
+		*/
+		
+		log_printf(LOG_DEBUG, "[%d] %s not found, searching PATH...\n", connection->id, application_path);
+		
+		uint64_t search_begin = timestamp_us();
+		
+		application_path_buf = path_search(application_path);
+		
+		connection->phases.path_search_us += timestamp_us() - search_begin;
+		
+		if(application_path_buf != NULL)
+		{
+			log_printf(LOG_DEBUG, "[%d] Found %s\n", connection->id, application_path_buf);
+			application_path = application_path_buf;
+		}
+	}
+	
+	uint64_t create_begin = timestamp_us();
+	
+	BOOL created = CreateProcess(
+		application_path,               /* lpApplicationName */
+		command_line,                   /* lpCommandLine */
+		NULL,                           /* lpProcessAttributes */
+		NULL,                           /* lpThreadAttributes */
+		TRUE,                           /* bInheritHandles */
+		DETACHED_PROCESS,               /* dwCreationFlags */
+		NULL,                           /* lpEnvironment */
+		connection->working_directory,  /* lpCurrentDirectory */
+		&si,                            /* lpStartupInfo */
+		&pi);                           /* lpProcessInformation */
+	
+	connection->phases.create_process_us += timestamp_us() - create_begin;
+	
+	if(!created)
+	{
+		connection->execute_error = GetLastError();
+		
+		log_printf(LOG_ERROR, "CreateProcess: %u\n", (unsigned)(connection->execute_error));
+		
+		++(server_stats.spawn_failures);
+		
+		free(application_path_buf);
+		return NULL;
+	}
+	
+	free(application_path_buf);
+	
+	uint64_t spawn_us = timestamp_us() - spawn_begin;
+	
+	++(server_stats.processes_spawned);
+	histogram_add(&(server_stats.spawn_us), spawn_us);
+	
+	trace_event(connection->id, TE_SPAWN, spawn_us);
+	
+	CloseHandle(pi.hThread);
+	
+	return pi.hProcess;
+}
+
+/* Returns the process which must exit next, or NULL if none are running. */
+static HANDLE connection_process(const struct Connection *connection)
+{
+	if(connection->num_exited < connection->num_processes)
+	{
+		return connection->processes[connection->num_exited];
+	}
+	else{
+		return NULL;
+	}
+}
+
+/* Terminates any processes still running on the connection. */
+static void connection_terminate(struct Connection *connection)
+{
+	for(int i = connection->num_exited; i < connection->num_processes; ++i)
+	{
+		if(!TerminateProcess(connection->processes[i], -1))
+		{
+			log_printf(LOG_ERROR, "TerminateProcess %u\n", (unsigned)(GetLastError()));
+		}
+	}
+}
+
+static bool command_queue_push(struct CommandQueue *queue, const char *application_path, size_t application_path_length, const char *command_line, size_t command_line_length)
+{
+	struct QueuedCommand *command = malloc(sizeof(struct QueuedCommand));
+	if(command == NULL)
+	{
+		log_printf(LOG_ERROR, "Memory allocation failed\n");
+		return false;
+	}
+	
+	command->next = NULL;
+	command->application_path = NULL;
+	command->command_line = NULL;
+	
+	if((application_path != NULL && !store_string(&(command->application_path), application_path, application_path_length))
+		|| !store_string(&(command->command_line), command_line, command_line_length))
+	{
+		command_free(command);
+		return false;
+	}
+	
+	if(queue->tail != NULL)
+	{
+		queue->tail->next = command;
+	}
+	else{
+		queue->head = command;
+	}
+	
+	queue->tail = command;
+	
+	return true;
+}
+
+static struct QueuedCommand *command_queue_pop(struct CommandQueue *queue)
+{
+	struct QueuedCommand *command = queue->head;
+	
+	if(command != NULL)
+	{
+		queue->head = command->next;
+		
+		if(queue->head == NULL)
+		{
+			queue->tail = NULL;
+		}
+	}
+	
+	return command;
+}
+
+static void command_queue_free(struct CommandQueue *queue)
+{
+	struct QueuedCommand *command;
+	
+	while((command = command_queue_pop(queue)) != NULL)
+	{
+		command_free(command);
+	}
+}
+
+static void command_free(struct QueuedCommand *command)
+{
+	free(command->command_line);
+	free(command->application_path);
+	free(command);
+}
+
+/* Moves the application_path/command_line set so far onto the end of the
+ * batch, ready for the next command to be described.
+*/
+static bool batch_push(struct Connection *connection)
+{
+	if(connection->application_path == NULL || connection->command_line == NULL)
+	{
+		log_printf(LOG_WARNING, "[%d] Batch command has no application path or command line\n", connection->id);
+		return false;
+	}
+	
+	if(connection->pipeline_length > 0)
+	{
+		log_printf(LOG_WARNING, "[%d] Batch commands cannot be pipelines\n", connection->id);
+		return false;
+	}
+	
+	if(!command_queue_push(&(connection->commands),
+		connection->application_path, strlen(connection->application_path),
+		connection->command_line, strlen(connection->command_line)))
+	{
+		return false;
+	}
+	
+	free(connection->application_path);
+	connection->application_path = NULL;
+	
+	free(connection->command_line);
+	connection->command_line = NULL;
+	
+	return true;
+}
+
+/* Starts running the queued batch of commands.
+ *
+ * The commands are run one after another, each followed by a CommandResult.
+ * End of file on stdout/stderr isn't sent until the last command has finished
+ * and the batch is ended by an X message giving the exit status of the last
+ * command which ran.
+*/
+static bool batch_start(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	/* A command described after the last Q message finishes the batch. */
+	
+	if(connection->application_path != NULL && !batch_push(connection))
+	{
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	if(connection->pipeline_length > 0)
+	{
+		log_printf(LOG_WARNING, "[%d] Batch commands cannot be pipelines\n", connection->id);
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	/* Nothing can be written to stdin of a batch command, so give them all an
+	 * empty one unless the client has redirected it.
+	*/
+	
+	if(connection->stdin_redirect.mode == 0)
+	{
+		if(!store_string(&(connection->stdin_redirect.path), "NUL", 3))
+		{
+			connection_close(connection_idx);
+			return false;
+		}
+		
+		connection->stdin_redirect.mode = RM_READ;
+	}
+	
+	connection->batch = true;
+	connection->batch_index = 0;
+	
+	return batch_next(connection_idx);
+}
+
+/* Starts the next command from the batch. Commands which can't be started
+ * are reported as failing with the Windows error code as their exit status.
+*/
+static bool batch_next(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	while(true)
+	{
+		struct QueuedCommand *command = command_queue_pop(&(connection->commands));
+		assert(command != NULL);
+		
+		free(connection->application_path);
+		connection->application_path = command->application_path;
+		
+		free(connection->command_line);
+		connection->command_line = command->command_line;
+		
+		free(command);
+		
+		connection->num_processes = 0;
+		connection->num_exited = 0;
+		
+		output_policy_rearm(&(connection->stdout_policy));
+		output_policy_rearm(&(connection->stderr_policy));
+		
+		log_printf(LOG_DEBUG, "[%d] Running batch command %u\n", connection->id, (unsigned)(connection->batch_index));
+		
+		if(!connection_execute(connection_idx))
+		{
+			return false;
+		}
+		
+		/* Output redirected to a file is created by the first command, the
+		 * rest add to it rather than replacing what came before.
+		*/
+		
+		if(connection->stdout_redirect.mode == RM_WRITE)
+		{
+			connection->stdout_redirect.mode = RM_APPEND;
+		}
+		
+		if(connection->stderr_redirect.mode == RM_WRITE)
+		{
+			connection->stderr_redirect.mode = RM_APPEND;
+		}
+		
+		if(connection->num_processes > 0)
+		{
+			return true;
+		}
+		
+		int32_t exit_code = connection->execute_error;
+		
+		if(!batch_result(connection_idx, exit_code))
+		{
+			return false;
+		}
+		
+		if(connection->commands.head == NULL)
+		{
+			return batch_end(connection_idx, exit_code);
+		}
+	}
+}
+
+/* Reports the result of the batch command which just finished and starts the
+ * next one, or ends the batch.
+*/
+static bool batch_command_done(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	int32_t exit_code = connection->exit_codes[connection->num_processes - 1];
+	
+	if(!batch_result(connection_idx, exit_code))
+	{
+		return false;
+	}
+	
+	if(connection->commands.head != NULL)
+	{
+		return batch_next(connection_idx);
+	}
+	
+	return batch_end(connection_idx, exit_code);
+}
+
+/* Sends the result of a batch command, dropping the rest of the batch if it
+ * failed and CF_STOP_ON_FAILURE is set.
+*/
+static bool batch_result(int connection_idx, int32_t exit_code)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	struct CommandResult result = { connection->batch_index++, exit_code };
+	
+	if(!connection_write(connection_idx, 'R', &result, sizeof(result)))
+	{
+		return false;
+	}
+	
+	if(exit_code != 0 && (connection->flags & CF_STOP_ON_FAILURE))
+	{
+		log_printf(LOG_WARNING, "[%d] Batch command %u failed, skipping the rest of the batch\n", connection->id, (unsigned)(result.index));
+		command_queue_free(&(connection->commands));
+	}
+	
+	return true;
+}
+
+/* Ends the batch with the exit status of the last command run. */
+static bool batch_end(int connection_idx, int32_t exit_code)
+{
+	if(!connection_write(connection_idx, 'O', "", 0) || !connection_write(connection_idx, 'E', "", 0))
+	{
+		return false;
+	}
+	
+	return connection_exit(connection_idx, &exit_code, sizeof(exit_code));
+}
+
+/* Creates the file for an upload, replacing any existing file. */
+static bool upload_start(int connection_idx, const char *path, size_t path_length)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	if(connection->num_processes > 0 || connection->upload_path != NULL)
+	{
+		log_printf(LOG_WARNING, "[%d] Upload requested after execution or another upload\n", connection->id);
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	if(!store_string(&(connection->upload_path), path, path_length))
+	{
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	connection->upload_file = CreateFile(connection->upload_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(connection->upload_file == INVALID_HANDLE_VALUE)
+	{
+		DWORD error = GetLastError();
+		
+		log_printf(LOG_ERROR, "[%d] Unable to create %s: %u\n", connection->id, connection->upload_path, (unsigned)(error));
+		
+		connection->upload_file = NULL;
+		return upload_finish(connection_idx, error);
+	}
+	
+	log_printf(LOG_INFO, "[%d] Receiving upload to %s\n", connection->id, connection->upload_path);
+	
+	++(server_stats.uploads);
+	
+	return true;
+}
+
+/* Writes data received for an upload, or finishes it at end of file. */
+static bool upload_write(int connection_idx, const void *data, size_t length)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	if(length == 0)
+	{
+		CloseHandle(connection->upload_file);
+		connection->upload_file = NULL;
+		
+		log_printf(LOG_INFO, "[%d] Upload to %s complete\n", connection->id, connection->upload_path);
+		
+		return upload_finish(connection_idx, ERROR_SUCCESS);
+	}
+	
+	DWORD written;
+	
+	if(!WriteFile(connection->upload_file, data, length, &written, NULL) || written != length)
+	{
+		DWORD error = GetLastError();
+		
+		log_printf(LOG_ERROR, "[%d] Unable to write %s: %u\n", connection->id, connection->upload_path, (unsigned)(error));
+		
+		CloseHandle(connection->upload_file);
+		connection->upload_file = NULL;
+		
+		DeleteFile(connection->upload_path);
+		
+		return upload_finish(connection_idx, (error != ERROR_SUCCESS ? error : ERROR_WRITE_FAULT));
+	}
+	
+	return true;
+}
+
+/* Reports the outcome of an upload and closes the connection. After an error
+ * the connection stays open until the client has sent the rest of the file.
+*/
+static bool upload_finish(int connection_idx, DWORD error)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	connection->upload_draining = (error != ERROR_SUCCESS);
+	
+	int32_t exit_code = error;
+	
+	return connection_exit(connection_idx, &exit_code, sizeof(exit_code));
+}
+
+/* Starts the interpreter for a persistent session.
+ *
+ * Commands are fed to the interpreter's stdin, each one followed by a CALL to
+ * a helper batch file which echoes a sentinel token and the errorlevel left
+ * behind by the command. The interpreter's stdout is scanned for the token
+ * so output can be split between commands and the exit status extracted.
+ *
+ * The errorlevel has to be decoded with IF ERRORLEVEL since COMMAND.COM has
+ * no %ERRORLEVEL% variable and doesn't expand variables outside of batch
+ * files at all.
+*/
+static bool session_start(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Session *session = &(connection->session);
+	
+	if(connection->pipeline_length > 0 || connection->commands.head != NULL || connection->stdin_redirect.mode != 0 || connection->stdout_redirect.mode != 0)
+	{
+		log_printf(LOG_WARNING, "[%d] Sessions cannot use pipelines, batches or redirect stdin/stdout\n", connection->id);
+		
+		connection_close(connection_idx);
+		return false;
+	}
+
+#ifndef _WIN32
+	/* The sentinel batch file needs COMMAND.COM. */
+	
+	log_printf(LOG_WARNING, "[%d] Sessions are only supported on Windows\n", connection->id);
+	
+	connection_close(connection_idx);
+	return false;
+#endif
+	
+	char temp_dir[MAX_PATH];
+	
+	DWORD temp_dir_len = GetTempPath(sizeof(temp_dir), temp_dir);
+	if(temp_dir_len == 0 || temp_dir_len >= sizeof(temp_dir))
+	{
+		log_printf(LOG_ERROR, "GetTempPath: %u\n", (unsigned)(GetLastError()));
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	session->batch_path = malloc(temp_dir_len + 16);
+	if(session->batch_path == NULL)
+	{
+		log_printf(LOG_ERROR, "Memory allocation failed\n");
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	snprintf(session->batch_path, (temp_dir_len + 16), "%sICE9%04X.BAT", temp_dir, (unsigned)(connection->id & 0xFFFF));
+	
+	HANDLE batch = CreateFile(session->batch_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(batch == INVALID_HANDLE_VALUE)
+	{
+		log_printf(LOG_ERROR, "[%d] Unable to create %s: %u\n", connection->id, session->batch_path, (unsigned)(GetLastError()));
+		
+		free(session->batch_path);
+		session->batch_path = NULL;
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	static const char SENTINEL_BATCH[] =
+		"@ECHO OFF\r\n"
+		"SET ICE9A=0\r\n"
+		"SET ICE9B=0\r\n"
+		"SET ICE9C=0\r\n"
+		"FOR %%A IN (1 2) DO IF ERRORLEVEL %%A00 SET ICE9A=%%A\r\n"
+		"FOR %%B IN (1 2 3 4 5 6 7 8 9) DO IF ERRORLEVEL %ICE9A%%%B0 SET ICE9B=%%B\r\n"
+		"FOR %%C IN (1 2 3 4 5 6 7 8 9) DO IF ERRORLEVEL %ICE9A%%ICE9B%%%C SET ICE9C=%%C\r\n"
+		"ECHO %1 %ICE9A%%ICE9B%%ICE9C%\r\n"
+		"SET ICE9A=\r\n"
+		"SET ICE9B=\r\n"
+		"SET ICE9C=\r\n";
+	
+	DWORD written;
+	BOOL write_ok = WriteFile(batch, SENTINEL_BATCH, (sizeof(SENTINEL_BATCH) - 1), &written, NULL);
+	
+	CloseHandle(batch);
+	
+	if(!write_ok || written != (sizeof(SENTINEL_BATCH) - 1))
+	{
+		log_printf(LOG_ERROR, "[%d] Unable to write %s: %u\n", connection->id, session->batch_path, (unsigned)(GetLastError()));
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	/* The token starts with a character which appears nowhere else in it, so
+	 * a failed partial match can always be restarted at the current byte.
+	*/
+	
+	snprintf(session->token, sizeof(session->token), "#ICE9-%08X-", (unsigned)(GetTickCount() ^ ((DWORD)(connection->id) << 16)));
+	session->token_length = strlen(session->token);
+	
+	session->active = true;
+	session->state = SS_STARTING;
+	
+	if(!connection_execute(connection_idx))
+	{
+		return false;
+	}
+	
+	/* Turning echo off also suppresses the prompt. The interpreter's banner and
+	 * anything else written before the first sentinel is discarded.
+	*/
+	
+	return session_write(connection_idx, "ECHO OFF", true);
+}
+
+/* Writes a line to the interpreter's stdin, optionally followed by a call to
+ * the sentinel batch file.
+*/
+static bool session_write(int connection_idx, const char *line, bool sentinel)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Session *session = &(connection->session);
+	
+	size_t buf_size = strlen(line) + strlen(session->batch_path) + session->token_length + 16;
+	
+	free(session->write_buf);
+	
+	session->write_buf = malloc(buf_size);
+	if(session->write_buf == NULL)
+	{
+		log_printf(LOG_ERROR, "Memory allocation failed\n");
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	int length;
+	
+	if(sentinel)
+	{
+		length = snprintf(session->write_buf, buf_size, "%s\r\nCALL %s %s\r\n", line, session->batch_path, session->token);
+	}
+	else{
+		length = snprintf(session->write_buf, buf_size, "%s\r\n", line);
+	}
+	
+	DWORD error = pipe9x_write_initiate(connection->stdin_pipe, session->write_buf, length);
+	if(error != ERROR_IO_PENDING)
+	{
+		log_printf(LOG_ERROR, "[%d] Write error %u on interpreter stdin\n", connection->id, (unsigned)(error));
+		
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	return true;
+}
+
+/* Feeds the next queued command to the interpreter if it is ready for one, or
+ * asks it to exit if the client has no more commands to send.
+*/
+static bool session_feed(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Session *session = &(connection->session);
+	
+	if(session->state != SS_IDLE || connection->stdin_pipe == NULL || pipe9x_write_pending(connection->stdin_pipe))
+	{
+		return true;
+	}
+	
+	struct QueuedCommand *command = command_queue_pop(&(connection->commands));
+	
+	if(command == NULL)
+	{
+		if(session->input_closed)
+		{
+			session->state = SS_EXITING;
+			return session_write(connection_idx, "EXIT", false);
+		}
+		
+		return true;
+	}
+	
+	session->state = SS_RUNNING;
+	++(session->next_index);
+	
+	bool ok = session_write(connection_idx, command->command_line, true);
+	
+	command_free(command);
+	
+	return ok;
+}
+
+/* Processes output read from the interpreter's stdout, forwarding anything
+ * which isn't part of a sentinel and reporting the exit status of each
+ * command as its sentinel is seen.
+ *
+ * Returns false if the connection was closed.
+*/
+static bool session_output(int connection_idx, const unsigned char *data, size_t data_size)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Session *session = &(connection->session);
+	
+	size_t forward_begin = 0;
+	
+	for(size_t i = 0; i < data_size; ++i)
+	{
+		unsigned char c = data[i];
+		
+		if(session->in_status)
+		{
+			/* Reading the errorlevel following a token, up to end of line. */
+			
+			if(c >= '0' && c <= '9')
+			{
+				session->status = (session->status * 10) + (c - '0');
+			}
+			else if(c == '\n')
+			{
+				session->in_status = false;
+				forward_begin = i + 1;
+				
+				if(!session_command_done(connection_idx))
+				{
+					return false;
+				}
+			}
+			
+			continue;
+		}
+		
+		if(c == (unsigned char)(session->token[session->token_matched]))
+		{
+			if(session->token_matched == 0 && i > forward_begin)
+			{
+				if(!session_forward(connection_idx, (data + forward_begin), (i - forward_begin)))
+				{
+					return false;
+				}
+			}
+			
+			if(++(session->token_matched) == session->token_length)
+			{
+				session->token_matched = 0;
+				session->in_status = true;
+				session->status = 0;
+			}
+			
+			forward_begin = i + 1;
+		}
+		else if(session->token_matched > 0)
+		{
+			/* Not a sentinel after all, release the bytes held back. */
+			
+			size_t matched = session->token_matched;
+			session->token_matched = 0;
+			
+			if(!session_forward(connection_idx, (const unsigned char*)(session->token), matched))
+			{
+				return false;
+			}
+			
+			/* The byte which broke the match may begin another token. */
+			
+			if(c == (unsigned char)(session->token[0]))
+			{
+				session->token_matched = 1;
+				forward_begin = i + 1;
+			}
+			else{
+				forward_begin = i;
+			}
+		}
+	}
+	
+	if(!session->in_status && session->token_matched == 0 && forward_begin < data_size)
+	{
+		return session_forward(connection_idx, (data + forward_begin), (data_size - forward_begin));
+	}
+	
+	return true;
+}
+
+/* Forwards interpreter output belonging to the current command. */
+static bool session_forward(int connection_idx, const unsigned char *data, size_t data_size)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	if(connection->session.state != SS_RUNNING)
+	{
+		/* Banner, or output from after the last command. */
+		return true;
+	}
+	
+	data_size = output_policy_filter(connection_idx, &(connection->stdout_policy), 'O', data, data_size);
+	
+	if(data_size == 0)
+	{
+		return true;
+	}
+	
+	return connection_write(connection_idx, 'O', data, data_size);
+}
+
+static bool session_command_done(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Session *session = &(connection->session);
+	
+	if(session->state == SS_RUNNING)
+	{
+		struct CommandResult result = { (session->next_index - 1), session->status };
+		
+		session->last_status = session->status;
+		
+		if(!connection_write(connection_idx, 'R', &result, sizeof(result)))
+		{
+			return false;
+		}
+		
+		if(session->status != 0 && (connection->flags & CF_STOP_ON_FAILURE))
+		{
+			log_printf(LOG_WARNING, "[%d] Session command %u failed, ending session\n", connection->id, (unsigned)(result.index));
+			
+			command_queue_free(&(connection->commands));
+			session->input_closed = true;
+		}
+	}
+	
+	session->state = SS_IDLE;
+	
+	return session_feed(connection_idx);
+}
+
+static void session_free(struct Session *session)
+{
+	if(session->batch_path != NULL)
+	{
+		DeleteFile(session->batch_path);
+		
+		free(session->batch_path);
+		session->batch_path = NULL;
+	}
+	
+	free(session->write_buf);
+	session->write_buf = NULL;
+	
+	session->active = false;
+}
+
+static bool connection_write(int connection_idx, unsigned char cmd, const void *payload, int payload_length)
+{
+	assert(payload_length <= 65535);
+	
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	if((cmd == 'O' || cmd == 'E') && payload_length > 0
+		&& coalesce_ms > 0 && !(connection->flags & CF_INTERACTIVE))
+	{
+		return connection_coalesce(connection_idx, cmd, payload, payload_length);
+	}
+	
+	stats_output(connection, cmd, payload_length, true);
+	
+	int sendbuf_available = SENDBUF_SIZE - connection->sendbuf_used;
+	
+	if(sendbuf_available < (sizeof(struct MessageHeader) + payload_length))
+	{
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	struct MessageHeader *header = (struct MessageHeader*)(connection->sendbuf + connection->sendbuf_used);
+	
+	header->command = cmd;
+	header->payload_length = payload_length;
+	
+	memcpy((header + 1), payload, payload_length);
+	
+	connection->sendbuf_used += sizeof(struct MessageHeader);
+	connection->sendbuf_used += payload_length;
+	
+	/* Anything else goes straight out, along with any output held before it. */
+	connection->holding = false;
+	connection->merge_offset = -1;
+	
+	return connection_flush(connection_idx);
+}
+
+/* Queues output, merging it into the previous message if that was output for
+ * the same stream which hasn't been sent yet. Small amounts of output are held
+ * for up to coalesce_ms in case more follows, so a program writing a line at a
+ * time doesn't cost a message and a send() for every line.
+*/
+static bool connection_coalesce(int connection_idx, unsigned char cmd, const void *payload, int payload_length)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	struct MessageHeader *header = NULL;
+	
+	if(connection->merge_offset >= 0)
+	{
+		header = (struct MessageHeader*)(connection->sendbuf + connection->merge_offset);
+		
+		if(header->command != cmd || (header->payload_length + payload_length) > 65535)
+		{
+			header = NULL;
+		}
+	}
+	
+	int needed = payload_length + (header == NULL ? sizeof(struct MessageHeader) : 0);
+	
+	if((SENDBUF_SIZE - connection->sendbuf_used) < needed)
+	{
+		connection_close(connection_idx);
+		return false;
+	}
+	
+	stats_output(connection, cmd, payload_length, (header == NULL));
+	
+	if(header == NULL)
+	{
+		connection->merge_offset = connection->sendbuf_used;
+		
+		header = (struct MessageHeader*)(connection->sendbuf + connection->sendbuf_used);
+		
+		header->command = cmd;
+		header->payload_length = 0;
+		
+		connection->sendbuf_used += sizeof(struct MessageHeader);
+	}
+	
+	memcpy((connection->sendbuf + connection->sendbuf_used), payload, payload_length);
+	
+	header->payload_length += payload_length;
+	connection->sendbuf_used += payload_length;
+	
+	if(connection->sendbuf_used >= coalesce_bytes)
+	{
+		connection->holding = false;
+	}
+	else if(!connection->holding)
+	{
+		connection->holding = true;
+		connection->hold_until = GetTickCount() + coalesce_ms;
+	}
+	
+	return connection_flush(connection_idx);
+}
+
+/* Sends the stats and phase timestamps if they were asked for, followed by the
+ * final exit status, then closes the connection once everything has been sent.
+*/
+static bool connection_exit(int connection_idx, const void *exit_codes, int exit_codes_length)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	if(connection->flags & CF_STATS)
+	{
+		connection->stats.total_ms = GetTickCount() - connection->accepted_tick;
+		
+		if(!connection_write(connection_idx, 'T', &(connection->stats), sizeof(connection->stats)))
+		{
+			return false;
+		}
+	}
+	
+	if(connection->flags & CF_TIMING)
+	{
+		connection->phases.exit_sent_us = phase_elapsed(connection);
+		
+		if(!connection_write(connection_idx, 'M', &(connection->phases), sizeof(connection->phases)))
+		{
+			return false;
+		}
+	}
+	
+	/* Only now, or the connection would be closed as soon as the messages above
+	 * had been sent.
+	*/
+	
+	connection->state = CS_CLOSING;
+	
+	return connection_write(connection_idx, 'X', exit_codes, exit_codes_length);
+}
+
+/* Counts output being queued for the client. */
+static void stats_output(struct Connection *connection, unsigned char cmd, int payload_length, bool new_frame)
+{
+	if(cmd == 'O')
+	{
+		connection->stats.stdout_bytes += payload_length;
+		connection->stats.stdout_frames += new_frame;
+	}
+	else if(cmd == 'E')
+	{
+		connection->stats.stderr_bytes += payload_length;
+		connection->stats.stderr_frames += new_frame;
+	}
+	else{
+		return;
+	}
+	
+	if(payload_length > 0 && connection->phases.first_output_us == 0)
+	{
+		connection->phases.first_output_us = phase_elapsed(connection);
+	}
+	
+	if(payload_length > 0 && connection->stats.first_output_ms == 0)
+	{
+		/* Output within the first tick still counts as having been seen. */
+		
+		DWORD elapsed = GetTickCount() - connection->accepted_tick;
+		connection->stats.first_output_ms = elapsed > 0 ? elapsed : 1;
+	}
 }
 
-static bool store_string(char **dst, const char *src, size_t length)
+static void stats_read_size(struct Connection *connection, size_t data_size)
 {
-	free(*dst);
-	*dst = malloc(length + 1);
+	static const size_t BUCKET_LIMITS[STATS_READ_BUCKETS] = { 64, 512, 4096, 16384, PIPE_READ_SIZE };
 	
-	if(*dst == NULL)
+	for(int i = 0; i < STATS_READ_BUCKETS; ++i)
+	{
+		if(data_size <= BUCKET_LIMITS[i] || (i + 1) == STATS_READ_BUCKETS)
+		{
+			++(connection->stats.read_sizes[i]);
+			break;
+		}
+	}
+}
+
+static void histogram_add(struct Histogram *histogram, uint64_t value)
+{
+	int bucket = 0;
+	
+	while(bucket < (HISTOGRAM_BUCKETS - 1) && value > ((uint64_t)(1) << bucket))
+	{
+		++bucket;
+	}
+	
+	++(histogram->buckets[bucket]);
+	histogram->sum += value;
+	++(histogram->count);
+}
+
+/* Sends the server's counters back in place of running a process, as one
+ * "name value" pair per line. Histograms are written as cumulative buckets
+ * labelled with their upper bound, like a Prometheus scrape.
+*/
+static bool server_status(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	if(connection->num_processes > 0 || connection->upload_path != NULL || connection->session.active)
 	{
-		fprintf(stderr, "Memory allocation failed\n");
+		log_printf(LOG_WARNING, "[%d] Status requested after execution or an upload\n", connection->id);
+		
+		connection_close(connection_idx);
 		return false;
 	}
 	
-	memcpy(*dst, src, length);
-	(*dst)[length] = '\0';
+	MEMORYSTATUS memory;
+	memory.dwLength = sizeof(memory);
 	
-	return true;
+	GlobalMemoryStatus(&memory);
+	
+	static char report[STATUS_REPORT_SIZE];
+	int length = snprintf(report, sizeof(report),
+		"ice9d_uptime_seconds %u\n"
+		"ice9d_connections_accepted %u\n"
+		"ice9d_connections_rejected %u\n"
+		"ice9d_connections_open %u\n"
+		"ice9d_processes_spawned %u\n"
+		"ice9d_spawn_failures %u\n"
+		"ice9d_uploads %u\n"
+		"ice9d_pipes_leaked %u\n"
+		"ice9d_bytes_received %llu\n"
+		"ice9d_bytes_sent %llu\n"
+		"ice9d_memory_load_percent %u\n"
+		"ice9d_memory_virtual_used_bytes %lu\n"
+		"ice9d_memory_physical_available_bytes %lu\n",
+		(unsigned)((GetTickCount() - server_stats.started_tick) / 1000),
+		(unsigned)(server_stats.connections_accepted),
+		(unsigned)(server_stats.connections_rejected),
+		(unsigned)(num_connections),
+		(unsigned)(server_stats.processes_spawned),
+		(unsigned)(server_stats.spawn_failures),
+		(unsigned)(server_stats.uploads),
+		(unsigned)(server_stats.pipes_leaked),
+		(unsigned long long)(server_stats.bytes_received),
+		(unsigned long long)(server_stats.bytes_sent),
+		(unsigned)(memory.dwMemoryLoad),
+		(unsigned long)(memory.dwTotalVirtual - memory.dwAvailVirtual),
+		(unsigned long)(memory.dwAvailPhys));
+	
+	length += status_histogram((report + length), (sizeof(report) - length), "ice9d_spawn_us", &(server_stats.spawn_us));
+	length += status_histogram((report + length), (sizeof(report) - length), "ice9d_connection_ms", &(server_stats.connection_ms));
+	
+	log_printf(LOG_DEBUG, "[%d] Sending server status\n", connection->id);
+	
+	/* Looks like a program which wrote the report and exited successfully. */
+	
+	int32_t exit_code = 0;
+	
+	return connection_write(connection_idx, 'O', report, length)
+		&& connection_write(connection_idx, 'O', "", 0)
+		&& connection_write(connection_idx, 'E', "", 0)
+		&& connection_exit(connection_idx, &exit_code, sizeof(exit_code));
 }
 
-static bool connection_write(int connection_idx, unsigned char cmd, const void *payload, int payload_length)
+static int status_histogram(char *buf, int buf_size, const char *name, const struct Histogram *histogram)
 {
-	assert(payload_length <= 65535);
+	int length = 0;
+	uint32_t cumulative = 0;
+	
+	for(int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		cumulative += histogram->buckets[i];
+		
+		if((i + 1) < HISTOGRAM_BUCKETS)
+		{
+			length += snprintf((buf + length), (buf_size - length), "%s_bucket{le=\"%lu\"} %u\n", name, (1UL << i), (unsigned)(cumulative));
+		}
+		else{
+			length += snprintf((buf + length), (buf_size - length), "%s_bucket{le=\"+Inf\"} %u\n", name, (unsigned)(cumulative));
+		}
+	}
+	
+	length += snprintf((buf + length), (buf_size - length), "%s_sum %llu\n%s_count %u\n",
+		name, (unsigned long long)(histogram->sum), name, (unsigned)(histogram->count));
+	
+	return length;
+}
+
+/* Extracts the next argument from a command line into buf, splitting it the
+ * way the Microsoft C runtime does, which is how ice9r quotes arguments:
+ *
+ *   - Arguments are separated by unquoted spaces or tabs.
+ *   - Double quotes toggle quoting and are removed.
+ *   - 2n backslashes followed by a quote produce n backslashes, 2n+1 produce
+ *     n backslashes and a literal quote. Other backslashes are literal.
+ *
+ * Advances *command_line past the argument and returns its full length, which
+ * is truncated in buf if it is buf_size or more. Returns -1 once there are no
+ * arguments left.
+*/
+static int command_line_next(const char **command_line, char *buf, size_t buf_size)
+{
+	const char *p = *command_line;
+	
+	while(*p == ' ' || *p == '\t')
+	{
+		++p;
+	}
+	
+	if(*p == '\0')
+	{
+		*command_line = p;
+		return -1;
+	}
+	
+	size_t length = 0;
+	bool quoted = false;
+	
+	while(*p != '\0' && (quoted || (*p != ' ' && *p != '\t')))
+	{
+		if(*p == '\\')
+		{
+			size_t backslashes = 0;
+			
+			while(*p == '\\')
+			{
+				++backslashes;
+				++p;
+			}
+			
+			if(*p == '"')
+			{
+				for(size_t i = 0; i < (backslashes / 2); ++i)
+				{
+					command_line_put(buf, buf_size, &length, '\\');
+				}
+				
+				if(backslashes % 2)
+				{
+					command_line_put(buf, buf_size, &length, '"');
+					++p;
+				}
+			}
+			else{
+				for(size_t i = 0; i < backslashes; ++i)
+				{
+					command_line_put(buf, buf_size, &length, '\\');
+				}
+			}
+		}
+		else if(*p == '"')
+		{
+			quoted = !quoted;
+			++p;
+		}
+		else{
+			command_line_put(buf, buf_size, &length, *p);
+			++p;
+		}
+	}
+	
+	if(buf_size > 0)
+	{
+		buf[(length < buf_size ? length : (buf_size - 1))] = '\0';
+	}
+	
+	*command_line = p;
+	return length;
+}
+
+/* Appends a character to an argument being extracted by command_line_next(). */
+static void command_line_put(char *buf, size_t buf_size, size_t *length, char c)
+{
+	if((*length + 1) < buf_size)
+	{
+		buf[*length] = c;
+	}
 	
+	++(*length);
+}
+
+/* Starts a pseudo-program named by the application path in place of a process,
+ * for measuring the protocol and event loop without CreateProcess() or a real
+ * program getting in the way. Output goes through the same output policies and
+ * framing as a child's would.
+ *
+ * ice9:generate <bytes> [<chunk size> [<bytes per second>]]
+ *   Writes bytes to stdout in chunks of up to 32K (default), optionally
+ *   limited to the given rate. Stdin is discarded.
+ *
+ * ice9:sink
+ *   Reads stdin until end of file, then writes the number of bytes read.
+ *
+ * ice9:echo
+ *   Copies stdin to stdout until end of file.
+*/
+static bool synthetic_start(int connection_idx)
+{
 	struct Connection *connection = &(connections[connection_idx]);
+	struct Synthetic *synthetic = &(connection->synthetic);
 	
-	int sendbuf_available = SENDBUF_SIZE - connection->sendbuf_used;
+	const char *name = connection->application_path + strlen(SYNTHETIC_PREFIX);
 	
-	if(sendbuf_available < (sizeof(struct MessageHeader) + payload_length))
+	if(connection->pipeline_length > 0 || connection->session.active
+		|| connection->stdin_redirect.mode != 0 || connection->stdout_redirect.mode != 0 || connection->stderr_redirect.mode != 0)
 	{
+		log_printf(LOG_WARNING, "[%d] Pseudo-programs cannot use pipelines, sessions or redirection\n", connection->id);
+		
 		connection_close(connection_idx);
 		return false;
 	}
 	
-	struct MessageHeader *header = (struct MessageHeader*)(connection->sendbuf + connection->sendbuf_used);
+	memset(synthetic, 0, sizeof(*synthetic));
 	
-	header->command = cmd;
-	header->payload_length = payload_length;
+	if(strcmp(name, "generate") == 0)
+	{
+		/* Arguments follow the program name on the command line. */
+		
+		const char *args = connection->command_line != NULL ? connection->command_line : "";
+		command_line_next(&args, NULL, 0);
+		
+		unsigned long long values[3] = { 0, PIPE_READ_SIZE, 0 };
+		int num_values = 0;
+		bool args_ok = true;
+		
+		char arg[24];
+		int arg_length;
+		
+		while(args_ok && (arg_length = command_line_next(&args, arg, sizeof(arg))) >= 0)
+		{
+			char *end;
+			
+			if(num_values == 3 || arg_length >= (int)(sizeof(arg)) || arg[0] < '0' || arg[0] > '9')
+			{
+				args_ok = false;
+			}
+			else{
+				values[num_values++] = strtoull(arg, &end, 10);
+				args_ok = (*end == '\0');
+			}
+		}
+		
+		unsigned long long bytes = values[0];
+		unsigned long long chunk = values[1], rate = values[2];
+		
+		if(!args_ok || num_values < 1 || chunk == 0 || rate > UINT32_MAX)
+		{
+			log_printf(LOG_WARNING, "[%d] Usage: ice9:generate <bytes> [<chunk size> [<bytes per second>]]\n", connection->id);
+			
+			connection_close(connection_idx);
+			return false;
+		}
+		
+		synthetic->kind = SK_GENERATE;
+		synthetic->remaining = bytes;
+		synthetic->chunk = chunk < PIPE_READ_SIZE ? chunk : PIPE_READ_SIZE;
+		synthetic->rate = rate;
+		synthetic->started_tick = GetTickCount();
+	}
+	else if(strcmp(name, "sink") == 0)
+	{
+		synthetic->kind = SK_SINK;
+	}
+	else if(strcmp(name, "echo") == 0)
+	{
+		synthetic->kind = SK_ECHO;
+	}
+	else{
+		log_printf(LOG_WARNING, "[%d] Unknown pseudo-program %s\n", connection->id, connection->application_path);
+		
+		connection_close(connection_idx);
+		return false;
+	}
 	
-	memcpy((header + 1), payload, payload_length);
+	log_printf(LOG_INFO, "[%d] Running pseudo-program %s\n", connection->id, connection->application_path);
 	
-	connection->sendbuf_used += sizeof(struct MessageHeader);
-	connection->sendbuf_used += payload_length;
+	if(connection->phases.spawned_us == 0)
+	{
+		connection->phases.spawned_us = phase_elapsed(connection);
+	}
 	
-	return connection_flush(connection_idx);
+	/* Output is produced from the main loop as the send buffer allows. */
+	return true;
+}
+
+/* Handles data written to the stdin of a pseudo-program, or end of file. The
+ * caller has already checked an echo has room for it.
+*/
+static bool synthetic_input(int connection_idx, const void *data, size_t length)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Synthetic *synthetic = &(connection->synthetic);
+	
+	++(connection->stats.stdin_frames);
+	connection->stats.stdin_bytes += length;
+	
+	if(synthetic->kind == SK_SINK)
+	{
+		if(length == 0)
+		{
+			char result[32];
+			int result_length = snprintf(result, sizeof(result), "%llu\r\n", (unsigned long long)(synthetic->consumed));
+			
+			size_t out_length = output_policy_filter(connection_idx, &(connection->stdout_policy), 'O', result, result_length);
+			
+			if(out_length > 0 && !connection_write(connection_idx, 'O', result, out_length))
+			{
+				return false;
+			}
+			
+			return synthetic_finish(connection_idx, 0);
+		}
+		
+		synthetic->consumed += length;
+	}
+	else if(synthetic->kind == SK_ECHO)
+	{
+		if(length == 0)
+		{
+			return synthetic_finish(connection_idx, 0);
+		}
+		
+		stats_read_size(connection, length);
+		
+		length = output_policy_filter(connection_idx, &(connection->stdout_policy), 'O', data, length);
+		
+		if(length > 0 && !connection_write(connection_idx, 'O', data, length))
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+/* Writes as much generated output as the send buffer and rate limit allow. */
+static bool synthetic_generate(int connection_idx)
+{
+	static unsigned char pattern[PIPE_READ_SIZE];
+	
+	if(pattern[0] == 0)
+	{
+		/* Lines of printable text, so the output can be looked at if need be. */
+		
+		for(size_t i = 0; i < sizeof(pattern); ++i)
+		{
+			pattern[i] = (i % 64) == 63 ? '\n' : ('a' + (i % 26));
+		}
+	}
+	
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Synthetic *synthetic = &(connection->synthetic);
+	
+	while(synthetic->remaining > 0 && synthetic_timeout(connection, GetTickCount()) == 0)
+	{
+		uint32_t length = synthetic->remaining < synthetic->chunk ? synthetic->remaining : synthetic->chunk;
+		
+		stats_read_size(connection, length);
+		
+		size_t out_length = output_policy_filter(connection_idx, &(connection->stdout_policy), 'O', pattern, length);
+		
+		if(out_length > 0 && !connection_write(connection_idx, 'O', pattern, out_length))
+		{
+			return false;
+		}
+		
+		synthetic->produced += length;
+		synthetic->remaining -= length;
+		
+		if(connection->stdout_policy.tripped)
+		{
+			/* Terminated for exceeding a cap, like a real process would be. */
+			return synthetic_finish(connection_idx, -1);
+		}
+	}
+	
+	if(synthetic->remaining == 0)
+	{
+		return synthetic_finish(connection_idx, 0);
+	}
+	
+	return true;
+}
+
+/* Returns how long until a generator can write its next chunk, or INFINITE if
+ * it is waiting for room in the send buffer (or isn't a generator at all).
+*/
+static DWORD synthetic_timeout(const struct Connection *connection, DWORD now)
+{
+	const struct Synthetic *synthetic = &(connection->synthetic);
+	
+	if(synthetic->kind != SK_GENERATE
+		|| (SENDBUF_SIZE - connection->sendbuf_used) < (sizeof(struct MessageHeader) + synthetic->chunk + SENDBUF_HEADROOM))
+	{
+		return INFINITE;
+	}
+	
+	if(synthetic->rate == 0)
+	{
+		return 0;
+	}
+	
+	/* The next chunk is due once the average rate since starting allows it. */
+	
+	uint64_t due_ms = ((synthetic->produced + synthetic->chunk) * 1000) / synthetic->rate;
+	DWORD elapsed_ms = now - synthetic->started_tick;
+	
+	return due_ms > elapsed_ms ? (DWORD)(due_ms - elapsed_ms) : 0;
+}
+
+/* Ends a pseudo-program as if the process had exited. */
+static bool synthetic_finish(int connection_idx, DWORD exit_code)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	connection->synthetic.kind = SK_NONE;
+	
+	if(!output_policy_finish(connection_idx, &(connection->stdout_policy), 'O')
+		|| !connection_write(connection_idx, 'O', "", 0)
+		|| !connection_write(connection_idx, 'E', "", 0))
+	{
+		return false;
+	}
+	
+	if(connection->phases.exited_us == 0)
+	{
+		connection->phases.exited_us = phase_elapsed(connection);
+	}
+	
+	log_printf(LOG_INFO, "[%d] Pseudo-program exited with code %u\n", connection->id, (unsigned)(exit_code));
+	
+	return connection_exit(connection_idx, &exit_code, sizeof(exit_code));
+}
+
+/* Lets pseudo-programs make progress: generators write whatever they can, and
+ * echoes pick up input they stalled on if there is room for it now.
+*/
+static void synthetics_run(void)
+{
+	for(int i = 0; i < num_connections;)
+	{
+		struct Connection *connection = &(connections[i]);
+		
+		if(connection->synthetic.kind == SK_GENERATE && !synthetic_generate(i))
+		{
+			continue;
+		}
+		
+		if(connection->synthetic.kind == SK_ECHO && connection->synthetic.stalled && !connection_dispatch(i))
+		{
+			continue;
+		}
+		
+		++i;
+	}
+}
+
+/* Sends any held output which has waited long enough. */
+static void connections_flush_held(void)
+{
+	DWORD now = GetTickCount();
+	
+	for(int i = 0; i < num_connections;)
+	{
+		if(connections[i].holding && (int32_t)(now - connections[i].hold_until) >= 0)
+		{
+			connections[i].holding = false;
+			
+			if(!connection_flush(i))
+			{
+				/* Closed, next connection has moved into this slot. */
+				continue;
+			}
+		}
+		
+		++i;
+	}
 }
 
 static bool connection_flush(int connection_idx)
 {
 	struct Connection *connection = &(connections[connection_idx]);
 	
-	if(connection->sendbuf_used > 0)
+	if(connection->sendbuf_used > 0 && !connection->holding)
 	{
+		/* Whatever is sent, the rest of the buffer moves. */
+		connection->merge_offset = -1;
+		
 		int write_result = send(connection->sock, (const char*)(connection->sendbuf), connection->sendbuf_used, 0);
 		if(write_result >= 0)
 		{
+			server_stats.bytes_sent += write_result;
+			trace_event(connection->id, TE_SEND, write_result);
+			
 			memmove(connection->sendbuf, (connection->sendbuf + write_result), (connection->sendbuf_used - write_result));
 			connection->sendbuf_used -= write_result;
 		}
@@ -469,7 +3325,7 @@ static bool connection_flush(int connection_idx)
 			
 			if(error != WSAEWOULDBLOCK)
 			{
-				fprintf(stderr, "Connection write error %u\n", (unsigned)(error));
+				log_printf(LOG_WARNING, "Connection write error %u\n", (unsigned)(error));
 				
 				connection_close(connection_idx);
 				return false;
@@ -477,7 +3333,7 @@ static bool connection_flush(int connection_idx)
 		}
 	}
 	
-	if(connection->sendbuf_used == 0 && connection->state == CS_CLOSING)
+	if(connection->sendbuf_used == 0 && connection->state == CS_CLOSING && !connection->upload_draining)
 	{
 		connection_close(connection_idx);
 		return false;
@@ -493,22 +3349,42 @@ static void connection_close(int connection_idx)
 	closesocket(connection->sock);
 	connection->sock = INVALID_SOCKET;
 	
-	if(connection->process != NULL)
-	{
-		if(!TerminateProcess(connection->process, -1))
-		{
-			fprintf(stderr, "TerminateProcess %u\n", (unsigned)(GetLastError()));
-		}
-		
-		CloseHandle(connection->process);
-		connection->process = NULL;
+	connection_terminate(connection);
+	
+	for(int i = connection->num_exited; i < connection->num_processes; ++i)
+	{
+		CloseHandle(connection->processes[i]);
 	}
 	
+	connection->num_processes = 0;
+	connection->num_exited = 0;
+
+#ifdef _WIN32
 	/* We should close the pipes here, but due to a bug in Windows 98, the
 	 * reads may block forever and make us hang... so we just forget about
 	 * them and leave the handles/threads to block forever (#1).
 	*/
 	
+	server_stats.pipes_leaked += (connection->stdin_pipe != NULL) + (connection->stdout_pipe != NULL) + (connection->stderr_pipe != NULL);
+#else
+	/* No such problem elsewhere, and leaking descriptors would soon run us out. */
+	
+	if(connection->stdin_pipe != NULL)
+	{
+		pipe9x_write_close(connection->stdin_pipe);
+	}
+	
+	if(connection->stderr_pipe != NULL)
+	{
+		pipe9x_read_close(connection->stderr_pipe);
+	}
+	
+	if(connection->stdout_pipe != NULL)
+	{
+		pipe9x_read_close(connection->stdout_pipe);
+	}
+#endif
+	
 	// pipe9x_write_close(connection->stdin_pipe);
 	connection->stdin_pipe = NULL;
 	
@@ -527,7 +3403,41 @@ static void connection_close(int connection_idx)
 	free(connection->application_path);
 	connection->application_path = NULL;
 	
-	fprintf(stderr, "[%d] Connection closed\n", connection->id);
+	for(int i = 0; i < connection->pipeline_length; ++i)
+	{
+		free(connection->pipeline[i].command_line);
+		free(connection->pipeline[i].application_path);
+	}
+	
+	connection->pipeline_length = 0;
+	
+	output_policy_free(&(connection->stdout_policy));
+	output_policy_free(&(connection->stderr_policy));
+	
+	redirect_free(&(connection->stdin_redirect));
+	redirect_free(&(connection->stdout_redirect));
+	redirect_free(&(connection->stderr_redirect));
+	
+	if(connection->upload_file != NULL)
+	{
+		/* Don't leave a truncated file behind. */
+		
+		CloseHandle(connection->upload_file);
+		connection->upload_file = NULL;
+		
+		DeleteFile(connection->upload_path);
+	}
+	
+	free(connection->upload_path);
+	connection->upload_path = NULL;
+	
+	session_free(&(connection->session));
+	command_queue_free(&(connection->commands));
+	
+	log_printf(LOG_INFO, "[%d] Connection closed\n", connection->id);
+	
+	histogram_add(&(server_stats.connection_ms), (GetTickCount() - connection->accepted_tick));
+	trace_event(connection->id, TE_CLOSE, 0);
 	
 	memmove((connections + connection_idx), (connections + connection_idx + 1), ((num_connections - connection_idx - 1) * sizeof(*connections)));
 	--num_connections;
@@ -546,16 +3456,16 @@ static char *path_search(const char *program_name)
 	
 	for(size_t i = 0; i < PATH_LEN; ++i)
 	{
-		size_t elem_len = strcspn((PATH + i), ";");
+		size_t elem_len = strcspn((PATH + i), PATH_LIST_SEPARATOR);
 		
 		if(elem_len > 0)
 		{
-			/* directory '\\' program name ".exe" '\0' */
+			/* directory separator program name ".exe" '\0' */
 			char *path_buf = malloc(elem_len + 1 + pn_len + 5);
 			if(path_buf != NULL)
 			{
 				strncpy(path_buf, (PATH + i), elem_len);
-				path_buf[elem_len] = '\\';
+				path_buf[elem_len] = DIR_SEPARATOR;
 				path_buf[elem_len + 1] = '\0';
 				
 				strcat(path_buf, program_name);
@@ -584,7 +3494,228 @@ static char *path_search(const char *program_name)
 	return NULL;
 }
 
-static void pipe_read(int connection_idx, PipeReadHandle *pipe9x_handle, unsigned char command)
+static bool output_policy_set(struct Connection *connection, const void *payload, size_t payload_length)
+{
+	if(payload_length != sizeof(struct OutputPolicyMessage))
+	{
+		log_printf(LOG_WARNING, "[%d] Malformed output policy message\n", connection->id);
+		return false;
+	}
+	
+	const struct OutputPolicyMessage *msg = (const struct OutputPolicyMessage*)(payload);
+	
+	struct OutputPolicy *policy;
+	
+	if(msg->stream == 'O')
+	{
+		policy = &(connection->stdout_policy);
+	}
+	else if(msg->stream == 'E')
+	{
+		policy = &(connection->stderr_policy);
+	}
+	else{
+		log_printf(LOG_WARNING, "[%d] Output policy for unknown stream: %c\n", connection->id, msg->stream);
+		return false;
+	}
+	
+	switch(msg->mode)
+	{
+		case OP_ALL:
+		case OP_DISCARD:
+		case OP_HEAD:
+		case OP_CAP:
+			break;
+			
+		case OP_TAIL:
+			if(msg->limit > TAIL_MAX)
+			{
+				log_printf(LOG_WARNING, "[%d] Tail output policy limit %u exceeds maximum of %u\n",
+					connection->id, (unsigned)(msg->limit), (unsigned)(TAIL_MAX));
+				
+				return false;
+			}
+			
+			break;
+			
+		default:
+			log_printf(LOG_WARNING, "[%d] Unrecognised output policy: %c\n", connection->id, msg->mode);
+			return false;
+	}
+	
+	output_policy_free(policy);
+	
+	policy->mode = msg->mode;
+	policy->limit = msg->limit;
+	policy->forwarded = 0;
+	
+	if(policy->mode == OP_TAIL && policy->limit > 0)
+	{
+		policy->ring = malloc(policy->limit);
+		if(policy->ring == NULL)
+		{
+			log_printf(LOG_ERROR, "Memory allocation failed\n");
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+/* Applies an output policy to data read from the child.
+ *
+ * Returns the number of bytes at the start of data which should be forwarded
+ * to the client, which may be zero.
+*/
+static size_t output_policy_filter(int connection_idx, struct OutputPolicy *policy, unsigned char command, const void *data, size_t data_size)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	if(policy->tripped)
+	{
+		/* Discard anything further written before the process dies. */
+		return 0;
+	}
+	
+	switch(policy->mode)
+	{
+		case OP_DISCARD:
+			return 0;
+			
+		case OP_HEAD:
+		case OP_CAP:
+		{
+			size_t remaining = policy->limit - policy->forwarded;
+			
+			if(data_size > remaining)
+			{
+				if(policy->mode == OP_CAP)
+				{
+					log_printf(LOG_WARNING, "[%d] Output on %c exceeded cap of %u bytes, terminating process\n",
+						connection->id, command, (unsigned)(policy->limit));
+					
+					connection_terminate(connection);
+					policy->tripped = true;
+				}
+				
+				data_size = remaining;
+			}
+			
+			policy->forwarded += data_size;
+			return data_size;
+		}
+		
+		case OP_TAIL:
+		{
+			if(data_size >= policy->limit)
+			{
+				/* New data fills the whole window. */
+				
+				if(policy->limit > 0)
+				{
+					memcpy(policy->ring, ((const unsigned char*)(data) + data_size - policy->limit), policy->limit);
+				}
+				
+				policy->ring_start = 0;
+				policy->ring_used = policy->limit;
+			}
+			else{
+				const unsigned char *p = (const unsigned char*)(data);
+				
+				for(size_t i = 0; i < data_size;)
+				{
+					uint32_t ring_end = (policy->ring_start + policy->ring_used) % policy->limit;
+					size_t chunk = policy->limit - ring_end;
+					
+					if(chunk > (data_size - i))
+					{
+						chunk = data_size - i;
+					}
+					
+					memcpy((policy->ring + ring_end), (p + i), chunk);
+					i += chunk;
+					
+					policy->ring_used += chunk;
+					
+					if(policy->ring_used > policy->limit)
+					{
+						/* Overwrote the oldest data. */
+						policy->ring_start = (policy->ring_start + (policy->ring_used - policy->limit)) % policy->limit;
+						policy->ring_used = policy->limit;
+					}
+				}
+			}
+			
+			return 0;
+		}
+		
+		default:
+			return data_size;
+	}
+}
+
+/* Sends any data held back by an output policy once the stream has reached end
+ * of file. Returns false if the connection was closed.
+*/
+static bool output_policy_finish(int connection_idx, struct OutputPolicy *policy, unsigned char command)
+{
+	if(policy->mode != OP_TAIL || policy->ring_used == 0)
+	{
+		return true;
+	}
+	
+	/* Rotate the ring in place so the window starts at the beginning. */
+	
+	uint32_t used = policy->ring_used;
+	
+	if(policy->ring_start > 0)
+	{
+		memrotate(policy->ring, policy->limit, policy->ring_start);
+	}
+	
+	policy->ring_start = 0;
+	policy->ring_used = 0;
+	
+	return connection_write(connection_idx, command, policy->ring, used);
+}
+
+/* Resets an output policy so the limits apply afresh to the next command in a
+ * batch.
+*/
+static void output_policy_rearm(struct OutputPolicy *policy)
+{
+	policy->forwarded = 0;
+	policy->tripped = false;
+}
+
+static void output_policy_free(struct OutputPolicy *policy)
+{
+	free(policy->ring);
+	policy->ring = NULL;
+	
+	policy->ring_start = 0;
+	policy->ring_used = 0;
+}
+
+/* Rotates a buffer left so the byte at offset becomes the first. */
+static void memrotate(unsigned char *buf, size_t size, size_t offset)
+{
+	memreverse(buf, offset);
+	memreverse((buf + offset), (size - offset));
+	memreverse(buf, size);
+}
+
+static void memreverse(unsigned char *buf, size_t size)
+{
+	for(size_t i = 0; (i + 1) < (size - i); ++i)
+	{
+		unsigned char c = buf[i];
+		buf[i] = buf[size - i - 1];
+		buf[size - i - 1] = c;
+	}
+}
+
+static void pipe_read(int connection_idx, PipeReadHandle *pipe9x_handle, struct OutputPolicy *policy, unsigned char command)
 {
 	void *data;
 	size_t data_size;
@@ -593,10 +3724,33 @@ static void pipe_read(int connection_idx, PipeReadHandle *pipe9x_handle, unsigne
 	
 	if(error == ERROR_SUCCESS)
 	{
+		if(data_size > 0)
+		{
+			// printf("[%d] Read %u bytes from child on %c\n", connections[connection_idx].id, (unsigned)(data_size), command);
+			
+			trace_event(connections[connection_idx].id, (command == 'O' ? TE_STDOUT_READ : TE_STDERR_READ), data_size);
+			
+			stats_read_size(&(connections[connection_idx]), data_size);
+			
+			if(command == 'O' && connections[connection_idx].session.active)
+			{
+				if(!session_output(connection_idx, data, data_size))
+				{
+					return;
+				}
+				
+				data_size = 0;
+			}
+			else{
+				data_size = output_policy_filter(connection_idx, policy, command, data, data_size);
+			}
+		}
+		
 		if(data_size == 0)
 		{
 			/* Pipes on Windows can propagate zero-sized writes, but this doesn't map
-			 * to UNIX pipes, so discard them.
+			 * to UNIX pipes, so discard them along with anything swallowed by the
+			 * output policy or session.
 			 *
 			 * Read next data from pipe in the background.
 			*/
@@ -613,26 +3767,37 @@ static void pipe_read(int connection_idx, PipeReadHandle *pipe9x_handle, unsigne
 			
 			return;
 		}
-		
-		// printf("[%d] Read %u bytes from child on %c\n", connections[connection_idx].id, (unsigned)(data_size), command);
 	}
 	else if(error == ERROR_BROKEN_PIPE)
 	{
 		HANDLE_EOF:
-
+		
 		/* Write end closed - end of file.
 		 * We will send a zero-byte read to the client.
 		*/
 		
-		printf("[%d] Read EOF from child on %c\n", connections[connection_idx].id, command);
+		log_printf(LOG_DEBUG, "[%d] Read EOF from child on %c\n", connections[connection_idx].id, command);
+		
+		trace_event(connections[connection_idx].id, (command == 'O' ? TE_STDOUT_READ : TE_STDERR_READ), 0);
 		
 		pipe9x_read_close(*pipe9x_handle);
 		*pipe9x_handle = NULL;
 		
+		if(!output_policy_finish(connection_idx, policy, command))
+		{
+			return;
+		}
+		
+		if(connections[connection_idx].batch)
+		{
+			/* End of file is only passed on once the whole batch has finished. */
+			return;
+		}
+		
 		data_size = 0;
 	}
 	else{
-		printf("[%d] Read error %u from child on %c\n", connections[connection_idx].id, (unsigned)(error), command);
+		log_printf(LOG_ERROR, "[%d] Read error %u from child on %c\n", connections[connection_idx].id, (unsigned)(error), command);
 		connection_close(connection_idx);
 		
 		return;
@@ -658,22 +3823,100 @@ static void process_exit(int connection_idx)
 {
 	struct Connection *connection = &(connections[connection_idx]);
 	
+	HANDLE process = connection_process(connection);
+	
 	DWORD exit_code;
-	GetExitCodeProcess(connection->process, &exit_code);
+	GetExitCodeProcess(process, &exit_code);
 	
-	CloseHandle(connection->process);
-	connection->process = NULL;
+	CloseHandle(process);
 	
-	printf("[%d] Process exited with code %u\n", connections[connection_idx].id, (unsigned)(exit_code));
+	log_printf(LOG_INFO, "[%d] Process %d exited with code %u\n", connections[connection_idx].id, (connection->num_exited + 1), (unsigned)(exit_code));
 	
-	int32_t exit_code_i = exit_code;
+	connection->exit_codes[connection->num_exited++] = exit_code;
 	
-	connection->state = CS_CLOSING;
-	connection_write(connection_idx, 'X', &exit_code_i, sizeof(exit_code_i));
+	trace_event(connection->id, TE_EXIT, exit_code);
+	
+	if(connection->num_exited == connection->num_processes)
+	{
+		if(connection->batch)
+		{
+			batch_command_done(connection_idx);
+			return;
+		}
+		
+		if(connection->phases.exited_us == 0)
+		{
+			connection->phases.exited_us = phase_elapsed(connection);
+		}
+		
+		connection_exit(connection_idx, connection->exit_codes, (connection->num_processes * sizeof(*(connection->exit_codes))));
+	}
 }
 
-int main()
+int main(int argc, char **argv)
 {
+	const char *log_file = NULL;
+	int port = PORT;
+	
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "--port") == 0 && (i + 1) < argc)
+		{
+			port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--coalesce-ms") == 0 && (i + 1) < argc)
+		{
+			coalesce_ms = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--coalesce-bytes") == 0 && (i + 1) < argc)
+		{
+			coalesce_bytes = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--trace") == 0 && (i + 1) < argc)
+		{
+			if(!trace_open(argv[++i]))
+			{
+				return 1;
+			}
+		}
+		else if(strcmp(argv[i], "--log-file") == 0 && (i + 1) < argc)
+		{
+			log_file = argv[++i];
+		}
+		else if(strcmp(argv[i], "--log-level") == 0 && (i + 1) < argc)
+		{
+			static const char *LEVEL_NAMES[] = { "error", "warning", "info", "debug" };
+			
+			const char *name = argv[++i];
+			int level = LOG_ERROR;
+			
+			while(level <= LOG_DEBUG && strcmp(name, LEVEL_NAMES[level]) != 0)
+			{
+				++level;
+			}
+			
+			if(level > LOG_DEBUG)
+			{
+				fprintf(stderr, "Unknown log level '%s' (expected error, warning, info or debug)\n", name);
+				return 1;
+			}
+			
+			log_level = level;
+		}
+		else{
+			fprintf(stderr, "Usage: %s [--port <port>] [--coalesce-ms <ms>] [--coalesce-bytes <bytes>] [--trace <file>]\n", argv[0]);
+			fprintf(stderr, "       %*s [--log-level error|warning|info|debug] [--log-file <file>]\n", (int)(strlen(argv[0])), "");
+			return 1;
+		}
+	}
+	
+	if(!log_start(log_file))
+	{
+		return 1;
+	}
+	
+	server_stats.started_tick = GetTickCount();
+	
 	WSADATA wsdata;
 	int wserror = WSAStartup(MAKEWORD(2, 0), &wsdata);
 	if(wserror != 0)
@@ -700,7 +3943,7 @@ int main()
 	struct sockaddr_in bind_addr;
 	bind_addr.sin_family = AF_INET;
 	bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	bind_addr.sin_port = htons(PORT);
+	bind_addr.sin_port = htons(port);
 	
 	if(bind(listener, (struct sockaddr*)(&bind_addr), sizeof(bind_addr)) != 0)
 	{
@@ -718,9 +3961,57 @@ int main()
 	
 	while(TRUE)
 	{
+		synthetics_run();
+		connections_flush_held();
+		
 		HANDLE wait_handles[1 + MAX_CONNECTIONS * 3];
 		size_t num_wait_handles;
 		
+		/* Wake up in time to send the output held the longest. */
+		
+		DWORD timeout = INFINITE;
+		DWORD now = GetTickCount();
+		
+		/* Don't leave the tail of the trace sitting in memory while idle. */
+		
+		if(trace_used > 0)
+		{
+			int32_t remaining = (int32_t)((trace_flushed_tick + TRACE_FLUSH_MS) - now);
+			
+			if(remaining <= 0)
+			{
+				trace_flush();
+			}
+			else{
+				timeout = remaining;
+			}
+		}
+		
+		for(size_t i = 0; i < num_connections; ++i)
+		{
+			DWORD synthetic_wait = synthetic_timeout(&(connections[i]), now);
+			
+			if(synthetic_wait < timeout)
+			{
+				timeout = synthetic_wait;
+			}
+			
+			if(connections[i].holding)
+			{
+				int32_t remaining = (int32_t)(connections[i].hold_until - now);
+				
+				if(remaining < 0)
+				{
+					remaining = 0;
+				}
+				
+				if((DWORD)(remaining) < timeout)
+				{
+					timeout = remaining;
+				}
+			}
+		}
+		
 		wait_handles[0] = wsevent;
 		num_wait_handles = 1;
 		
@@ -731,10 +4022,26 @@ int main()
 			
 			/* Wait on the stdout/stderr handles only if there is enough space in the
 			 * connection's send buffer to queue the maximum potential read size to be
-			 * written to the connection.
+			 * written to the connection, plus any other messages processing it may
+			 * generate (end of file following data released by a tail output policy,
+			 * session command results).
 			*/
 			
-			if(sendbuf_available >= (sizeof(struct MessageHeader) + PIPE_READ_SIZE))
+			bool sendbuf_full = sendbuf_available < (sizeof(struct MessageHeader) + PIPE_READ_SIZE + SENDBUF_HEADROOM)
+				&& (connections[i].stdout_pipe != NULL || connections[i].stderr_pipe != NULL);
+			
+			if(sendbuf_full && !connections[i].sendbuf_full)
+			{
+				connections[i].sendbuf_full_since = now;
+			}
+			else if(!sendbuf_full && connections[i].sendbuf_full)
+			{
+				connections[i].stats.sendbuf_full_ms += now - connections[i].sendbuf_full_since;
+			}
+			
+			connections[i].sendbuf_full = sendbuf_full;
+			
+			if(sendbuf_available >= (sizeof(struct MessageHeader) + PIPE_READ_SIZE + SENDBUF_HEADROOM))
 			{
 				if(connections[i].stdout_pipe != NULL)
 				{
@@ -747,17 +4054,18 @@ int main()
 				}
 			}
 			
-			/* Wait on the process handle only if there is space in the send buffer and
-			 * both output pies have been read to end of file.
+			/* Wait on the next process handle only if there is space in the send
+			 * buffer for the exit statuses (and the end of a batch) and both output
+			 * pipes have been read to end of file.
 			*/
 			
-			if(sendbuf_available >= (sizeof(struct MessageHeader) + sizeof(int32_t)))
+			if(sendbuf_available >= (sizeof(struct MessageHeader) + sizeof(connections[i].exit_codes) + SENDBUF_HEADROOM))
 			{
 				if(connections[i].stdout_pipe == NULL
 					&& connections[i].stderr_pipe == NULL
-					&& connections[i].process != NULL)
+					&& connection_process(&(connections[i])) != NULL)
 				{
-					wait_handles[num_wait_handles++] = connections[i].process;
+					wait_handles[num_wait_handles++] = connection_process(&(connections[i]));
 				}
 			}
 			
@@ -780,7 +4088,7 @@ int main()
 				events |= FD_CLOSE;
 			}
 			
-			if(connections[i].sendbuf_used > 0)
+			if(connections[i].sendbuf_used > 0 && !connections[i].holding)
 			{
 				events |= FD_WRITE;
 			}
@@ -788,7 +4096,7 @@ int main()
 			WSAEventSelect(connections[i].sock, wsevent, events);
 		}
 		
-		DWORD wait_result = WaitForMultipleObjects(num_wait_handles, wait_handles, FALSE, INFINITE);
+		DWORD wait_result = WaitForMultipleObjects(num_wait_handles, wait_handles, FALSE, timeout);
 		
 		if(wait_result == WAIT_FAILED)
 		{
@@ -796,7 +4104,14 @@ int main()
 			return 1;
 		}
 		
-		if(wait_result == WAIT_OBJECT_0)
+		trace_wait_handles = num_wait_handles;
+		trace_event(0, TE_WAKE, (wait_result == WAIT_TIMEOUT ? 0xFFFFFFFF : (wait_result - WAIT_OBJECT_0)));
+		
+		if(wait_result == WAIT_TIMEOUT)
+		{
+			/* Held output and the trace are sent at the top of the loop. */
+		}
+		else if(wait_result == WAIT_OBJECT_0)
 		{
 			int newsock = accept(listener, NULL, NULL);
 			if(newsock != INVALID_SOCKET)
@@ -823,14 +4138,14 @@ int main()
 				if(connections[i].stdout_pipe != NULL
 					&& woke_handle == pipe9x_read_event(connections[i].stdout_pipe))
 				{
-					pipe_read(i, &(connections[i].stdout_pipe), 'O');
+					pipe_read(i, &(connections[i].stdout_pipe), &(connections[i].stdout_policy), 'O');
 					break;
 				}
 				
 				if(connections[i].stderr_pipe != NULL
 					&& woke_handle == pipe9x_read_event(connections[i].stderr_pipe))
 				{
-					pipe_read(i, &(connections[i].stderr_pipe), 'E');
+					pipe_read(i, &(connections[i].stderr_pipe), &(connections[i].stderr_policy), 'E');
 					break;
 				}
 				
@@ -842,17 +4157,32 @@ int main()
 					
 					if(error != ERROR_SUCCESS)
 					{
-						fprintf(stderr, "[%d] Write error %u on child stdin\n", connections[i].id, (unsigned)(error));
+						log_printf(LOG_ERROR, "[%d] Write error %u on child stdin\n", connections[i].id, (unsigned)(error));
 						connection_close(i);
 					}
 					else{
 						// fprintf(stderr, "[%d] Wrote %u bytes to child stdin\n", connections[i].id, (unsigned)(data_written));
+						
+						trace_event(connections[i].id, TE_STDIN_WRITE, data_written);
+						
+						if(connections[i].session.active)
+						{
+							session_feed(i);
+						}
+						else if(connections[i].stdin_stalled)
+						{
+							/* The rest of the input may already be sitting in the receive
+							 * buffer, in which case the socket won't wake us up for it.
+							*/
+							
+							connection_dispatch(i);
+						}
 					}
 					
 					break;
 				}
 				
-				if(woke_handle == connections[i].process)
+				if(woke_handle == connection_process(&(connections[i])))
 				{
 					process_exit(i);
 					break;
@@ -0,0 +1,811 @@
+/* ice9proxy - Network impairment proxy for testing ICE-9 over slow links
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Sits between ice9r and ice9d and makes a loopback connection behave like
+ * one of the lab's links. Everything read from one side is cut into
+ * segments, each of which is given a time at which it arrives at the other:
+ *
+ *   - Segments queue for the link, which sends --bandwidth bits per second.
+ *     The link is shared by every connection through the proxy, with each
+ *     direction having its own unless --half-duplex is given.
+ *   - Once sent, a segment takes --latency milliseconds to arrive, plus up to
+ *     --jitter more picked at random.
+ *   - --loss percent of segments are held for --loss-delay milliseconds on
+ *     top of that, standing in for a lost segment being retransmitted.
+ *
+ * Segments arrive in order, as they would over TCP, so one held back delays
+ * those behind it. They are written out one at a time, so --split also
+ * controls how the data is broken up when the receiver reads it.
+ *
+ * Only --buffer bytes are queued in each direction before the proxy stops
+ * reading, so the sender is slowed down by TCP flow control as it would be
+ * by a slow link, rather than by a deep queue in here.
+*/
+
+#define _GNU_SOURCE /* ppoll(), accept4() */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LISTEN_PORT 15425
+#define DEFAULT_SERVER_PORT 5424
+
+#define MAX_CONNECTIONS 64
+#define READ_SIZE 65536
+
+enum Direction
+{
+	TO_SERVER = 0,
+	TO_CLIENT = 1,
+};
+
+struct Segment
+{
+	struct Segment *next;
+	
+	uint64_t due_us;
+	
+	/* A zero length segment with eof set carries the end of the stream. */
+	bool eof;
+	
+	size_t length;
+	size_t offset;
+	
+	unsigned char data[];
+};
+
+struct Stream
+{
+	struct Segment *head;
+	struct Segment *tail;
+	
+	size_t queued;
+	
+	/* When the last queued segment arrives, nothing may arrive before it. */
+	uint64_t last_due_us;
+	
+	/* End of file has been read from the source. */
+	bool read_eof;
+	
+	/* End of file has been passed on to the destination. */
+	bool write_eof;
+};
+
+struct Connection
+{
+	int client_sock;
+	int server_sock;
+	
+	bool connecting;
+	
+	struct Stream streams[2];
+	
+	char name[32];
+};
+
+struct Options
+{
+	const char *server;
+	int listen_port;
+	
+	unsigned long long bandwidth;
+	unsigned latency_ms;
+	unsigned jitter_ms;
+	size_t split;
+	bool half_duplex;
+	double loss;
+	unsigned loss_delay_ms;
+	size_t buffer;
+	unsigned seed;
+};
+
+static struct Options options = {
+	.server        = NULL,
+	.listen_port   = DEFAULT_LISTEN_PORT,
+	.bandwidth     = 0,
+	.latency_ms    = 0,
+	.jitter_ms     = 0,
+	.split         = 0,
+	.half_duplex   = false,
+	.loss          = 0.0,
+	.loss_delay_ms = 200,
+	.buffer        = 65536,
+	.seed          = 1,
+};
+
+static struct sockaddr_in server_addr;
+
+static struct Connection connections[MAX_CONNECTIONS];
+static int num_connections = 0;
+
+/* When each link will have finished sending everything queued for it. Only
+ * the first is used with --half-duplex.
+*/
+static uint64_t link_free_us[2];
+
+static uint64_t random_state;
+
+static uint64_t monotonic_us(void);
+static uint64_t random_next(void);
+static double random_fraction(void);
+static bool parse_bandwidth(const char *s, unsigned long long *bandwidth);
+static bool resolve_server(const char *spec);
+static void connection_accept(int listener);
+static void connection_close(int connection_idx, const char *reason);
+static void connection_connected(int connection_idx);
+static bool stream_read(int connection_idx, enum Direction direction, uint64_t now_us);
+static bool stream_write(int connection_idx, enum Direction direction, uint64_t now_us);
+static void stream_queue(struct Stream *stream, enum Direction direction, const unsigned char *data, size_t length, uint64_t now_us);
+static void stream_free(struct Stream *stream);
+static int stream_source(const struct Connection *connection, enum Direction direction);
+static int stream_destination(const struct Connection *connection, enum Direction direction);
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return ((uint64_t)(now.tv_sec) * 1000000) + (now.tv_nsec / 1000);
+}
+
+/* xorshift64*, so a given --seed gives the same jitter and losses each run. */
+static uint64_t random_next(void)
+{
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	
+	return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_fraction(void)
+{
+	return (random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Parses a bit rate with an optional k, M or G suffix, e.g. "10M". */
+static bool parse_bandwidth(const char *s, unsigned long long *bandwidth)
+{
+	char *end;
+	double value = strtod(s, &end);
+	
+	if(end == s || value <= 0.0)
+	{
+		return false;
+	}
+	
+	if(*end == 'k' || *end == 'K')
+	{
+		value *= 1000.0;
+		++end;
+	}
+	else if(*end == 'M')
+	{
+		value *= 1000000.0;
+		++end;
+	}
+	else if(*end == 'G')
+	{
+		value *= 1000000000.0;
+		++end;
+	}
+	
+	if(*end != '\0')
+	{
+		return false;
+	}
+	
+	*bandwidth = (unsigned long long)(value);
+	return true;
+}
+
+/* Resolves "<host>[:<port>]" to where connections are forwarded to. */
+static bool resolve_server(const char *spec)
+{
+	char host[256];
+	int port = DEFAULT_SERVER_PORT;
+	
+	const char *colon = strchr(spec, ':');
+	size_t host_len = (colon != NULL ? (size_t)(colon - spec) : strlen(spec));
+	
+	if(host_len == 0 || host_len >= sizeof(host))
+	{
+		return false;
+	}
+	
+	memcpy(host, spec, host_len);
+	host[host_len] = '\0';
+	
+	if(colon != NULL)
+	{
+		port = atoi(colon + 1);
+	}
+	
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	struct addrinfo *result;
+	
+	if(getaddrinfo(host, NULL, &hints, &result) != 0)
+	{
+		return false;
+	}
+	
+	memcpy(&server_addr, result->ai_addr, sizeof(server_addr));
+	server_addr.sin_port = htons(port);
+	
+	freeaddrinfo(result);
+	
+	return true;
+}
+
+/* Accepts a client and starts connecting to the server on its behalf. */
+static void connection_accept(int listener)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	
+	int client_sock = accept4(listener, (struct sockaddr*)(&addr), &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(client_sock < 0)
+	{
+		if(errno != EAGAIN && errno != EINTR)
+		{
+			perror("accept");
+		}
+		
+		return;
+	}
+	
+	int server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(server_sock < 0)
+	{
+		perror("socket");
+		
+		close(client_sock);
+		return;
+	}
+	
+	/* Segments are already held back for as long as they should be, don't
+	 * let Nagle add any more on either side.
+	*/
+	int one = 1;
+	setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(server_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	
+	if(connect(server_sock, (struct sockaddr*)(&server_addr), sizeof(server_addr)) != 0 && errno != EINPROGRESS)
+	{
+		fprintf(stderr, "Unable to connect to %s: %s\n", options.server, strerror(errno));
+		
+		close(server_sock);
+		close(client_sock);
+		
+		return;
+	}
+	
+	struct Connection *connection = &(connections[num_connections++]);
+	memset(connection, 0, sizeof(*connection));
+	
+	connection->client_sock = client_sock;
+	connection->server_sock = server_sock;
+	connection->connecting = true;
+	
+	snprintf(connection->name, sizeof(connection->name), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	
+	fprintf(stderr, "%s: Connected\n", connection->name);
+}
+
+/* Closes both sides of a connection, dropping anything still queued. */
+static void connection_close(int connection_idx, const char *reason)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	fprintf(stderr, "%s: %s\n", connection->name, reason);
+	
+	close(connection->client_sock);
+	close(connection->server_sock);
+	
+	stream_free(&(connection->streams[TO_SERVER]));
+	stream_free(&(connection->streams[TO_CLIENT]));
+	
+	memmove(&(connections[connection_idx]), &(connections[connection_idx + 1]), ((num_connections - connection_idx - 1) * sizeof(*connections)));
+	--num_connections;
+}
+
+static void connection_connected(int connection_idx)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	
+	int error;
+	socklen_t error_len = sizeof(error);
+	
+	if(getsockopt(connection->server_sock, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0)
+	{
+		error = errno;
+	}
+	
+	if(error != 0)
+	{
+		char reason[128];
+		snprintf(reason, sizeof(reason), "Unable to connect to %s: %s", options.server, strerror(error));
+		
+		connection_close(connection_idx, reason);
+		return;
+	}
+	
+	connection->connecting = false;
+}
+
+/* Reads whatever is available from the source of a stream and queues it.
+ * Returns false if the connection was closed.
+*/
+static bool stream_read(int connection_idx, enum Direction direction, uint64_t now_us)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Stream *stream = &(connection->streams[direction]);
+	
+	static unsigned char buf[READ_SIZE];
+	
+	if(stream->read_eof || stream->queued >= options.buffer)
+	{
+		/* Woken by a hangup on a socket we aren't reading from. */
+		return true;
+	}
+	
+	size_t want = options.buffer - stream->queued;
+	if(want > sizeof(buf))
+	{
+		want = sizeof(buf);
+	}
+	
+	ssize_t r = recv(stream_source(connection, direction), buf, want, 0);
+	
+	if(r < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		return true;
+	}
+	else if(r < 0)
+	{
+		char reason[128];
+		snprintf(reason, sizeof(reason), "Error reading from %s: %s", (direction == TO_SERVER ? "client" : "server"), strerror(errno));
+		
+		connection_close(connection_idx, reason);
+		return false;
+	}
+	else if(r == 0)
+	{
+		stream_queue(stream, direction, NULL, 0, now_us);
+		stream->read_eof = true;
+		
+		return true;
+	}
+	
+	size_t split = (options.split > 0 ? options.split : (size_t)(r));
+	
+	for(size_t offset = 0; offset < (size_t)(r); offset += split)
+	{
+		size_t length = ((size_t)(r) - offset) < split ? ((size_t)(r) - offset) : split;
+		stream_queue(stream, direction, (buf + offset), length, now_us);
+	}
+	
+	return true;
+}
+
+/* Writes any segments which have arrived to the destination of a stream.
+ * Returns false if the connection was closed.
+*/
+static bool stream_write(int connection_idx, enum Direction direction, uint64_t now_us)
+{
+	struct Connection *connection = &(connections[connection_idx]);
+	struct Stream *stream = &(connection->streams[direction]);
+	
+	int destination = stream_destination(connection, direction);
+	
+	while(stream->head != NULL && stream->head->due_us <= now_us)
+	{
+		struct Segment *segment = stream->head;
+		
+		if(segment->eof)
+		{
+			shutdown(destination, SHUT_WR);
+			stream->write_eof = true;
+		}
+		else{
+			ssize_t w = send(destination, (segment->data + segment->offset), (segment->length - segment->offset), MSG_NOSIGNAL);
+			
+			if(w < 0 && (errno == EAGAIN || errno == EINTR))
+			{
+				return true;
+			}
+			else if(w < 0)
+			{
+				char reason[128];
+				snprintf(reason, sizeof(reason), "Error writing to %s: %s", (direction == TO_SERVER ? "server" : "client"), strerror(errno));
+				
+				connection_close(connection_idx, reason);
+				return false;
+			}
+			
+			segment->offset += w;
+			stream->queued -= w;
+			
+			if(segment->offset < segment->length)
+			{
+				return true;
+			}
+		}
+		
+		stream->head = segment->next;
+		if(stream->head == NULL)
+		{
+			stream->tail = NULL;
+		}
+		
+		free(segment);
+	}
+	
+	if(connection->streams[TO_SERVER].write_eof && connection->streams[TO_CLIENT].write_eof)
+	{
+		connection_close(connection_idx, "Closed");
+		return false;
+	}
+	
+	return true;
+}
+
+/* Queues a segment, working out when it arrives from the state of the link. */
+static void stream_queue(struct Stream *stream, enum Direction direction, const unsigned char *data, size_t length, uint64_t now_us)
+{
+	struct Segment *segment = malloc(sizeof(struct Segment) + length);
+	if(segment == NULL)
+	{
+		fprintf(stderr, "Memory allocation failed\n");
+		exit(EX_OSERR);
+	}
+	
+	uint64_t *link = &(link_free_us[options.half_duplex ? 0 : direction]);
+	
+	uint64_t sent_us = (*link > now_us ? *link : now_us);
+	
+	if(options.bandwidth > 0)
+	{
+		sent_us += (length * 8ULL * 1000000ULL) / options.bandwidth;
+		*link = sent_us;
+	}
+	
+	uint64_t due_us = sent_us + (options.latency_ms * 1000ULL);
+	
+	if(options.jitter_ms > 0)
+	{
+		due_us += (uint64_t)(random_fraction() * options.jitter_ms * 1000.0);
+	}
+	
+	if(length > 0 && options.loss > 0.0 && (random_fraction() * 100.0) < options.loss)
+	{
+		due_us += options.loss_delay_ms * 1000ULL;
+	}
+	
+	if(due_us < stream->last_due_us)
+	{
+		due_us = stream->last_due_us;
+	}
+	
+	stream->last_due_us = due_us;
+	
+	segment->next = NULL;
+	segment->due_us = due_us;
+	segment->eof = (data == NULL);
+	segment->length = length;
+	segment->offset = 0;
+	
+	if(length > 0)
+	{
+		memcpy(segment->data, data, length);
+	}
+	
+	if(stream->tail != NULL)
+	{
+		stream->tail->next = segment;
+	}
+	else{
+		stream->head = segment;
+	}
+	
+	stream->tail = segment;
+	stream->queued += length;
+}
+
+static void stream_free(struct Stream *stream)
+{
+	while(stream->head != NULL)
+	{
+		struct Segment *next = stream->head->next;
+		
+		free(stream->head);
+		stream->head = next;
+	}
+	
+	stream->tail = NULL;
+	stream->queued = 0;
+}
+
+static int stream_source(const struct Connection *connection, enum Direction direction)
+{
+	return direction == TO_SERVER ? connection->client_sock : connection->server_sock;
+}
+
+static int stream_destination(const struct Connection *connection, enum Direction direction)
+{
+	return direction == TO_SERVER ? connection->server_sock : connection->client_sock;
+}
+
+int main(int argc, char **argv)
+{
+	bool usage = false;
+	
+	for(int i = 1; i < argc && !usage; ++i)
+	{
+		if(strcmp(argv[i], "--listen-port") == 0 && (i + 1) < argc)
+		{
+			options.listen_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--bandwidth") == 0 && (i + 1) < argc)
+		{
+			usage = !parse_bandwidth(argv[++i], &(options.bandwidth));
+		}
+		else if(strcmp(argv[i], "--latency") == 0 && (i + 1) < argc)
+		{
+			options.latency_ms = strtoul(argv[++i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "--jitter") == 0 && (i + 1) < argc)
+		{
+			options.jitter_ms = strtoul(argv[++i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "--split") == 0 && (i + 1) < argc)
+		{
+			options.split = strtoul(argv[++i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "--half-duplex") == 0)
+		{
+			options.half_duplex = true;
+		}
+		else if(strcmp(argv[i], "--loss") == 0 && (i + 1) < argc)
+		{
+			options.loss = strtod(argv[++i], NULL);
+		}
+		else if(strcmp(argv[i], "--loss-delay") == 0 && (i + 1) < argc)
+		{
+			options.loss_delay_ms = strtoul(argv[++i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "--buffer") == 0 && (i + 1) < argc)
+		{
+			options.buffer = strtoul(argv[++i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "--seed") == 0 && (i + 1) < argc)
+		{
+			options.seed = strtoul(argv[++i], NULL, 10);
+		}
+		else if(argv[i][0] != '-' && options.server == NULL)
+		{
+			options.server = argv[i];
+		}
+		else{
+			usage = true;
+		}
+	}
+	
+	if(usage || options.server == NULL || options.listen_port <= 0 || options.buffer == 0)
+	{
+		fprintf(stderr, "Usage: %s [--listen-port <port>] [--bandwidth <bits per second>] [--half-duplex]\n", argv[0]);
+		fprintf(stderr, "       %*s [--latency <ms>] [--jitter <ms>] [--split <bytes>]\n", (int)(strlen(argv[0])), "");
+		fprintf(stderr, "       %*s [--loss <percent>] [--loss-delay <ms>] [--buffer <bytes>] [--seed <n>]\n", (int)(strlen(argv[0])), "");
+		fprintf(stderr, "       %*s <server address>[:<port>]\n", (int)(strlen(argv[0])), "");
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Forwards connections on port %d (by default) to an ICE-9 server, as if\n", DEFAULT_LISTEN_PORT);
+		fprintf(stderr, "over a slower link. e.g. a 10Mbit half-duplex link with a 10ms round trip:\n");
+		fprintf(stderr, "\n");
+		fprintf(stderr, "  %s --bandwidth 10M --half-duplex --latency 5 --split 1460 127.0.0.1\n", argv[0]);
+		
+		return EX_USAGE;
+	}
+	
+	if(!resolve_server(options.server))
+	{
+		fprintf(stderr, "Unable to resolve %s\n", options.server);
+		return EX_NOHOST;
+	}
+	
+	random_state = ((uint64_t)(options.seed) << 1) | 1;
+	
+	int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listener < 0)
+	{
+		perror("socket");
+		return EX_OSERR;
+	}
+	
+	int one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	
+	struct sockaddr_in listen_addr;
+	memset(&listen_addr, 0, sizeof(listen_addr));
+	
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listen_addr.sin_port = htons(options.listen_port);
+	
+	if(bind(listener, (struct sockaddr*)(&listen_addr), sizeof(listen_addr)) != 0 || listen(listener, 16) != 0)
+	{
+		fprintf(stderr, "Unable to listen on port %d: %s\n", options.listen_port, strerror(errno));
+		return EX_OSERR;
+	}
+	
+	while(1)
+	{
+		/* Sockets are only read from while there is room to queue what we
+		 * read, and only written to once there is a segment due. The wait is
+		 * cut short when the next segment which isn't due yet will be.
+		*/
+		
+		struct pollfd pfds[1 + (MAX_CONNECTIONS * 2)];
+		nfds_t num_pfds = 0;
+		
+		uint64_t now_us = monotonic_us();
+		uint64_t next_due_us = UINT64_MAX;
+		
+		pfds[num_pfds++] = (struct pollfd){ listener, (num_connections < MAX_CONNECTIONS ? POLLIN : 0), 0 };
+		
+		for(int i = 0; i < num_connections; ++i)
+		{
+			struct Connection *connection = &(connections[i]);
+			
+			short client_events = 0, server_events = 0;
+			
+			if(connection->connecting)
+			{
+				server_events |= POLLOUT;
+			}
+			
+			for(int d = 0; d < 2; ++d)
+			{
+				enum Direction direction = (enum Direction)(d);
+				struct Stream *stream = &(connection->streams[direction]);
+				
+				short *source_events = (direction == TO_SERVER ? &client_events : &server_events);
+				short *destination_events = (direction == TO_SERVER ? &server_events : &client_events);
+				
+				if(!stream->read_eof && stream->queued < options.buffer && !connection->connecting)
+				{
+					*source_events |= POLLIN;
+				}
+				
+				if(stream->head != NULL && !(direction == TO_SERVER && connection->connecting))
+				{
+					if(stream->head->due_us <= now_us)
+					{
+						*destination_events |= POLLOUT;
+					}
+					else if(stream->head->due_us < next_due_us)
+					{
+						next_due_us = stream->head->due_us;
+					}
+				}
+			}
+			
+			/* Nothing is read from the client until the server connection is
+			 * up, so it isn't polled at all or a hangup would wake us early.
+			*/
+			
+			pfds[num_pfds++] = (struct pollfd){ (connection->connecting ? -1 : connection->client_sock), client_events, 0 };
+			pfds[num_pfds++] = (struct pollfd){ connection->server_sock, server_events, 0 };
+		}
+		
+		struct timespec timeout;
+		bool have_timeout = (next_due_us != UINT64_MAX);
+		
+		if(have_timeout)
+		{
+			timeout.tv_sec = (next_due_us - now_us) / 1000000;
+			timeout.tv_nsec = ((next_due_us - now_us) % 1000000) * 1000;
+		}
+		
+		if(ppoll(pfds, num_pfds, (have_timeout ? &timeout : NULL), NULL) < 0 && errno != EINTR)
+		{
+			perror("poll");
+			return EX_OSERR;
+		}
+		
+		now_us = monotonic_us();
+		
+		/* Connections are visited from the end so closing one doesn't move
+		 * any which haven't been visited yet, or their entries in pfds.
+		*/
+		
+		int polled_connections = num_connections;
+		
+		for(int i = polled_connections - 1; i >= 0; --i)
+		{
+			const struct pollfd *client_pfd = &(pfds[1 + (i * 2)]);
+			const struct pollfd *server_pfd = &(pfds[2 + (i * 2)]);
+			
+			if(connections[i].connecting)
+			{
+				if(server_pfd->revents == 0)
+				{
+					continue;
+				}
+				
+				connection_connected(i);
+				
+				if(i >= num_connections || connections[i].server_sock != server_pfd->fd)
+				{
+					continue;
+				}
+			}
+			
+			if((client_pfd->revents & (POLLIN | POLLHUP | POLLERR)) && !stream_read(i, TO_SERVER, now_us))
+			{
+				continue;
+			}
+			
+			if((server_pfd->revents & (POLLIN | POLLHUP | POLLERR)) && !stream_read(i, TO_CLIENT, now_us))
+			{
+				continue;
+			}
+			
+			if(!stream_write(i, TO_SERVER, now_us))
+			{
+				continue;
+			}
+			
+			stream_write(i, TO_CLIENT, now_us);
+		}
+		
+		if(pfds[0].revents & POLLIN)
+		{
+			connection_accept(listener);
+		}
+	}
+}
@@ -28,29 +28,178 @@
  * POSSIBILITY OF SUCH DAMAGE.
 */
 
-#define ICE9_DEFAULT_PORT 5424
+#define _GNU_SOURCE /* splice(), F_SETPIPE_SZ */
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sysexits.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-struct MessageHeader
+#include "fanout.h"
+#include "master.h"
+#include "protocol.h"
+
+/* Large enough for several maximum size messages, so a busy connection is
+ * drained in as few reads as possible.
+*/
+#define RECVBUF_SIZE (256 * 1024)
+
+/* Stop reading stdin while this much is still waiting to be sent. */
+#define SENDQ_LIMIT (256 * 1024)
+
+/* Output messages with at least this much payload still to arrive are spliced
+ * from the socket rather than read.
+*/
+#define SPLICE_MIN_LENGTH (16 * 1024)
+
+/* Size requested for pipes output is spliced through. */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+/* Typed in interactive mode to give up on the remote program (Ctrl+]). */
+#define INTERACTIVE_ESCAPE 0x1D
+
+/* One program in the (possibly single stage) pipeline to execute. */
+struct Stage
+{
+	const char *program_name;
+	const char *verbatim_cmdline;
+	
+	char *cmdline_buf;
+	size_t cmdline_size;
+	size_t cmdline_len;
+	
+	size_t num_cmdline_args;
+	
+	const char *cmdline;
+};
+
+/* Remote file a standard handle of the child is redirected to. */
+struct Redirect
+{
+	unsigned char mode;
+	const char *path;
+};
+
+/* Messages describing the request, built up before they are sent so the same
+ * request can be sent to many hosts.
+*/
+struct Buffer
 {
-	unsigned char command;
-	uint16_t payload_length;
-} __attribute__((packed));
+	unsigned char *data;
+	size_t size;
+	size_t used;
+};
+
+/* Local stream which output from the server is written to. */
+struct Sink
+{
+	FILE **file;
+	int fd;
+	
+	/* Set if the payload of output messages can be moved straight from the
+	 * socket to fd with splice(). If fd isn't itself a pipe, the data goes via
+	 * splice_pipe.
+	*/
+	bool splice;
+	int splice_pipe[2];
+};
+
+/* Connection to the server when running on a single host. */
+struct Client
+{
+	int sock;
+	
+	/* Received data not yet processed, at most one partial message. */
+	unsigned char *recvbuf;
+	size_t recvbuf_used;
+	
+	/* Messages waiting for the socket to become writable, of which the first
+	 * sendq_sent bytes have already gone.
+	*/
+	struct Buffer sendq;
+	size_t sendq_sent;
+	
+	/* Stdin, when it is a regular file sent with sendfile(). The payload of the
+	 * I message at the end of the queue is sent from the file once the queue
+	 * has drained.
+	*/
+	int sendfile_fd;
+	size_t sendfile_remaining;
+	off_t sendfile_left;
+	
+	struct Sink stdout_sink;
+	struct Sink stderr_sink;
+	
+	/* Payload of the current output message still to be spliced. */
+	struct Sink *splice_sink;
+	size_t splice_remaining;
+	
+	/* Read just one header next time, so a large payload following it can be
+	 * spliced in its entirety.
+	*/
+	bool header_only;
+	
+	bool pipefail;
+	
+	char **batch_commands;
+	size_t num_batch_commands;
+	
+	/* Exit status of the last session or batch command. */
+	bool have_result;
+	int32_t last_result;
+	
+	/* Set once the final status has been received. */
+	bool finished;
+	int exit_code;
+	
+	/* Copy of stderr kept for printing stats, which arrive after the remote
+	 * stderr (and so ours) has been closed. -1 if stats weren't asked for.
+	*/
+	int stats_fd;
+	
+	/* Likewise for the phase breakdown, -1 if it wasn't asked for. */
+	int timing_fd;
+	bool timing_json;
+	
+	/* Our side of the timing, in microseconds from CLOCK_MONOTONIC. */
+	uint64_t started_us;
+	uint64_t connected_us;
+	uint64_t request_us;
+	uint64_t first_output_us;
+	uint64_t exit_us;
+	
+	/* The server's side, if it has been received. */
+	bool have_phases;
+	struct PhaseTimes phases;
+};
+
+/* Terminal settings to put back on exit, once raw mode has been entered. */
+static bool tty_raw = false;
+static struct termios tty_saved;
 
 static void cmdline_push_char(char **cmdline_buf, size_t *cmdline_size, size_t *cmdline_len, char c, size_t repeat);
 static void cmdline_push_string(char **cmdline_buf, size_t *cmdline_size, size_t *cmdline_len, const char *arg);
+static bool parse_output_policy(struct OutputPolicyMessage *policy, unsigned char stream, const char *spec);
 static void print_usage(FILE *output, const char *argv0);
+static char **read_batch_file(const char *path, size_t *num_commands);
+static char *command_program(const char *cmdline);
 
 static void cmdline_push_char(char **cmdline_buf, size_t *cmdline_size, size_t *cmdline_len, char c, size_t repeat)
 {
@@ -137,272 +286,1813 @@ static void cmdline_push_string(char **cmdline_buf, size_t *cmdline_size, size_t
 	cmdline_push_char(cmdline_buf, cmdline_size, cmdline_len, '"', 1);
 }
 
+/* Parses an output policy specification of the form "all", "discard",
+ * "head:<bytes>", "tail:<bytes>" or "cap:<bytes>". The byte count may be
+ * suffixed with K or M.
+*/
+static bool parse_output_policy(struct OutputPolicyMessage *policy, unsigned char stream, const char *spec)
+{
+	policy->stream = stream;
+	policy->limit = 0;
+	
+	const char *limit_s = NULL;
+	
+	if(strcmp(spec, "all") == 0)
+	{
+		policy->mode = 'A';
+	}
+	else if(strcmp(spec, "discard") == 0)
+	{
+		policy->mode = 'D';
+	}
+	else if(strncmp(spec, "head:", 5) == 0)
+	{
+		policy->mode = 'H';
+		limit_s = spec + 5;
+	}
+	else if(strncmp(spec, "tail:", 5) == 0)
+	{
+		policy->mode = 'T';
+		limit_s = spec + 5;
+	}
+	else if(strncmp(spec, "cap:", 4) == 0)
+	{
+		policy->mode = 'C';
+		limit_s = spec + 4;
+	}
+	else{
+		return false;
+	}
+	
+	if(limit_s != NULL)
+	{
+		char *endp;
+		unsigned long long limit = strtoull(limit_s, &endp, 10);
+		
+		if(endp == limit_s)
+		{
+			return false;
+		}
+		
+		if(*endp == 'K' || *endp == 'k')
+		{
+			limit *= 1024;
+			++endp;
+		}
+		else if(*endp == 'M' || *endp == 'm')
+		{
+			limit *= 1024 * 1024;
+			++endp;
+		}
+		
+		if(*endp != '\0' || limit > UINT32_MAX)
+		{
+			return false;
+		}
+		
+		policy->limit = limit;
+	}
+	
+	return true;
+}
+
 static void print_usage(FILE *output, const char *argv0)
 {
-	fprintf(output, "Usage: %s <IP address> [-p <port>] <executable> [<arguments> ...]\n", argv0);
-	fprintf(output, "       %s <IP address> [-p <port>] <executable> [-e <command line>]\n", argv0);
+	fprintf(output, "Usage: %s <IP address> [options] <executable> [<arguments> ...] ['|' <executable> ...]\n", argv0);
+	fprintf(output, "       %s <IP address> [options] <executable> [-e <command line>] ['|' <executable> ...]\n", argv0);
+	fprintf(output, "       %s <IP address> [options] --batch <file>\n", argv0);
+	fprintf(output, "       %s <IP address> [options] --push <local file> <remote path>\n", argv0);
+	fprintf(output, "       %s <IP address> [options] --server-status\n", argv0);
+	fprintf(output, "       %s --control-master <socket path> [--pool <count>]\n", argv0);
 	fprintf(output, "\n");
 	fprintf(output, "The first invocation shown above encodes any given arguments into the process\n");
 	fprintf(output, "argument string in the \"standard\" Windows style.\n");
 	fprintf(output, "\n");
 	fprintf(output, "The second above invocation allows providing an exact argument string, for\n");
 	fprintf(output, "programs which have non-standard argument parsing rules.\n");
+	fprintf(output, "\n");
+	fprintf(output, "Several programs may be separated by a '|' argument to run them as a pipeline\n");
+	fprintf(output, "on the server, only the output of the final program is sent back. Any '|'\n");
+	fprintf(output, "after a -- argument is passed to the program like any other argument.\n");
+	fprintf(output, "\n");
+	fprintf(output, "With --session, the program is started as a command interpreter (e.g.\n");
+	fprintf(output, "command.com) and each line read from stdin is run as a command within it.\n");
+	fprintf(output, "\n");
+	fprintf(output, "The IP address may instead be a comma separated list of hosts, or @<file> to\n");
+	fprintf(output, "read one host per line from a file. The command is run on every host at once\n");
+	fprintf(output, "and each line of output is prefixed with the host it came from. Hosts may be\n");
+	fprintf(output, "given as <host>:<port> to override -p.\n");
+	fprintf(output, "\n");
+	fprintf(output, "With --control-master, no command is run. Instead connections to each host\n");
+	fprintf(output, "are kept open ready for later runs given the same socket with --control-path,\n");
+	fprintf(output, "which then skip waiting for a connection to be established.\n");
+	fprintf(output, "\n");
+	fprintf(output, "With --batch, each line of the file is a command line to run on the server,\n");
+	fprintf(output, "one after another over a single connection. Combined with --session, the\n");
+	fprintf(output, "lines are run within the interpreter instead of stdin.\n");
+	fprintf(output, "\n");
+	fprintf(output, "Options:\n");
+	fprintf(output, "  -p <port>                 Connect to the given port\n");
+	fprintf(output, "  --session                 Run stdin as commands in a persistent interpreter\n");
+	fprintf(output, "  -t, --interactive         Pass each keystroke to the program as it is typed\n");
+	fprintf(output, "                            (Ctrl+] disconnects)\n");
+	fprintf(output, "  --batch <file>            Run each line of a file as a command\n");
+	fprintf(output, "  --push <local> <remote>   Copy a local file to the server\n");
+	fprintf(output, "  --server-status           Print the server's counters instead of running a\n");
+	fprintf(output, "                            program\n");
+	fprintf(output, "  --stop-on-error           Stop a batch or session after a command fails\n");
+	fprintf(output, "  --parallel <count>        Maximum hosts to run on at once (default 32)\n");
+	fprintf(output, "  --fold                    Print identical output from many hosts once\n");
+	fprintf(output, "  --threads <count>         Event loop threads for many hosts (default one\n");
+	fprintf(output, "                            per CPU core)\n");
+	fprintf(output, "  --control-master <path>   Run a connection master listening on a socket\n");
+	fprintf(output, "  --control-path <path>     Use connections held open by a master\n");
+	fprintf(output, "  --pool <count>            Connections the master holds per host (default 1)\n");
+	fprintf(output, "  --connect-timeout <secs>  Give up connecting to a host after this long\n");
+	fprintf(output, "                            (default 10)\n");
+	fprintf(output, "  --stats                   Print counters from the server after the program\n");
+	fprintf(output, "                            exits\n");
+	fprintf(output, "  --timing                  Print how long each phase of running the program\n");
+	fprintf(output, "                            took, on both ends\n");
+	fprintf(output, "  --timing-json             As --timing, but as a single line of JSON\n");
+	fprintf(output, "  --pipefail                Exit with the status of the last pipeline stage\n");
+	fprintf(output, "                            to fail, rather than the final stage\n");
+	fprintf(output, "  --stdout-policy <policy>  Filter stdout on the server\n");
+	fprintf(output, "  --stderr-policy <policy>  Filter stderr on the server\n");
+	fprintf(output, "  --stdin-from <path>       Read stdin from a file on the server\n");
+	fprintf(output, "  --stdout-to <path>        Write stdout to a file on the server\n");
+	fprintf(output, "  --stdout-append <path>    Append stdout to a file on the server\n");
+	fprintf(output, "  --stderr-to <path>        Write stderr to a file on the server\n");
+	fprintf(output, "  --stderr-append <path>    Append stderr to a file on the server\n");
+	fprintf(output, "  --stderr-to-stdout        Send stderr wherever stdout goes\n");
+	fprintf(output, "\n");
+	fprintf(output, "Output policies are applied by the server before data is sent, and may be\n");
+	fprintf(output, "one of \"all\" (default), \"discard\", \"head:<bytes>\" (only the first bytes),\n");
+	fprintf(output, "\"tail:<bytes>\" (only the last bytes, up to 32K) or \"cap:<bytes>\" (terminate\n");
+	fprintf(output, "the process if it writes more). Byte counts may be suffixed with K or M.\n");
 }
 
-static void send_header(int sock, unsigned char command, uint16_t payload_length);
-static void send_all(int sock, const void *data, ssize_t length);
-
-static void send_header(int sock, unsigned char command, uint16_t payload_length)
-{
-	struct MessageHeader header = { command, payload_length };
-	send_all(sock, &header, sizeof(header));
-}
-
-static void send_all(int sock, const void *data, ssize_t length)
+/* Reads the commands from a batch file, one per line. Blank lines are skipped.
+ * Exits on error.
+*/
+static char **read_batch_file(const char *path, size_t *num_commands)
 {
-	const char *p = (const char*)(data);
+	FILE *fh = fopen(path, "r");
+	if(fh == NULL)
+	{
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		exit(EX_NOINPUT);
+	}
 	
-	while(length > 0)
+	char **commands = NULL;
+	size_t commands_size = 0;
+	*num_commands = 0;
+	
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+	
+	while((line_len = getline(&line, &line_size, fh)) >= 0)
 	{
-		ssize_t sent = send(sock, p, length, 0);
-		if(sent < 0)
+		while(line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
 		{
-			perror("send");
-			exit(EX_IOERR);
+			line[--line_len] = '\0';
+		}
+		
+		if(strspn(line, " \t") == (size_t)(line_len))
+		{
+			continue;
+		}
+		
+		if(line_len > 65535)
+		{
+			fprintf(stderr, "Command too long in %s\n", path);
+			exit(EX_DATAERR);
 		}
 		
-		p += sent;
-		length -= sent;
+		if(*num_commands == commands_size)
+		{
+			commands_size = commands_size > 0 ? (commands_size * 2) : 64;
+			
+			commands = realloc(commands, (commands_size * sizeof(*commands)));
+			assert(commands != NULL);
+		}
+		
+		commands[(*num_commands)++] = strdup(line);
+		assert(commands[*num_commands - 1] != NULL);
 	}
-}
-
-static void stream_output(FILE *output, int sock, size_t length)
-{
-	static char buf[1024];
 	
-	while(length > 0)
+	if(ferror(fh))
 	{
-		int r = recv(sock, buf, length > sizeof(buf) ? sizeof(buf) : length, 0);
-		assert(r > 0);
-		
-		assert(fwrite(buf, r, 1, output) == 1);
-		
-		length -= r;
+		fprintf(stderr, "Unable to read %s: %s\n", path, strerror(errno));
+		exit(EX_IOERR);
 	}
 	
-	fflush(output);
+	free(line);
+	fclose(fh);
+	
+	return commands;
 }
 
-int main(int argc, char **argv)
+/* Returns the program name from the start of a command line, which may be
+ * enclosed in double quotes.
+*/
+static char *command_program(const char *cmdline)
 {
-	bool skip_args = false;
+	cmdline += strspn(cmdline, " \t");
 	
-	const char *host = NULL;
-	int port = ICE9_DEFAULT_PORT;
+	size_t length;
 	
-	const char *program_name = NULL;
-	const char *verbatim_cmdline = NULL;
+	if(*cmdline == '"')
+	{
+		++cmdline;
+		length = strcspn(cmdline, "\"");
+	}
+	else{
+		length = strcspn(cmdline, " \t");
+	}
 	
-	char *cmdline_buf = NULL;
-	size_t cmdline_size = 0;
-	size_t cmdline_len = 0;
+	char *program = strndup(cmdline, length);
+	assert(program != NULL);
 	
-	size_t num_cmdline_args = 0;
+	return program;
+}
+
+static void send_command_lines(struct Buffer *out, char *buf, size_t *buf_used, bool eof);
+static unsigned char *buffer_reserve(struct Buffer *buf, size_t length);
+static void buffer_message(struct Buffer *buf, unsigned char command, const void *payload, size_t payload_length);
+static void buffer_redirect(struct Buffer *buf, unsigned char stream, const struct Redirect *redirect);
+static void client_recv(struct Client *client);
+static void client_send(struct Client *client);
+static void client_send_file(struct Client *client);
+static void client_message(struct Client *client, const struct MessageHeader *header, const unsigned char *payload);
+static void client_splice(struct Client *client);
+static void print_stats(int fd, const struct ConnectionStats *stats);
+static uint64_t monotonic_us(void);
+static void print_timing(const struct Client *client, uint64_t done_us);
+static void sink_init(struct Sink *sink, FILE **file);
+static void sink_write(struct Sink *sink, const unsigned char *data, size_t length);
+static void sink_close(struct Sink *sink);
+static void tty_make_raw(int fd);
+static void tty_restore(void);
+
+/* Queues each complete line in buf as a session command and removes it from
+ * the buffer. At end of file, any incomplete last line is also sent, followed
+ * by the empty command which ends the session.
+*/
+static void send_command_lines(struct Buffer *out, char *buf, size_t *buf_used, bool eof)
+{
+	size_t line_begin = 0;
 	
-	for(int i = 1; i < argc; ++i)
+	for(size_t i = 0; i <= *buf_used; ++i)
 	{
-		if(!skip_args && argv[i][0] == '-')
+		if((i < *buf_used && buf[i] == '\n') || (i == *buf_used && eof))
 		{
-			if(strcmp(argv[i], "-p") == 0)
-			{
-				++i;
-				
-				if(i >= argc)
-				{
-					fprintf(stderr, "Option '-p' requires a parameter\n");
-					return EX_USAGE;
-				}
-				
-				port = atoi(argv[i]);
-			}
-			else if(strcmp(argv[i], "-e") == 0)
+			size_t line_end = i;
+			
+			if(line_end > line_begin && buf[line_end - 1] == '\r')
 			{
-				++i;
-				
-				if(i >= argc)
-				{
-					fprintf(stderr, "Option '-e' requires a parameter\n");
-					return EX_USAGE;
-				}
-				
-				verbatim_cmdline = argv[i];
+				--line_end;
 			}
-			else if(strcmp(argv[i], "--") == 0)
+			
+			if(line_end > line_begin)
 			{
-				skip_args = true;
-			}
-			else{
-				fprintf(stderr, "Unrecognised option: %s\n", argv[i]);
-				return EX_USAGE;
+				buffer_message(out, 'K', (buf + line_begin), (line_end - line_begin));
 			}
-		}
-		else if(host == NULL)
-		{
-			host = argv[i];
-		}
-		else if(program_name == NULL)
-		{
-			program_name = argv[i];
-			cmdline_push_string(&cmdline_buf, &cmdline_size, &cmdline_len, argv[i]);
-		}
-		else{
-			cmdline_push_string(&cmdline_buf, &cmdline_size, &cmdline_len, argv[i]);
-			++num_cmdline_args;
+			
+			line_begin = i + 1;
 		}
 	}
 	
-	if(program_name == NULL)
+	if(eof)
 	{
-		print_usage(stderr, argv[0]);
-		return EX_USAGE;
+		buffer_message(out, 'K', NULL, 0);
+		*buf_used = 0;
 	}
-	
-	if(strlen(program_name) > 65535)
-	{
-		fprintf(stderr, "Program name too long\n");
-		return EX_DATAERR;
+	else{
+		memmove(buf, (buf + line_begin), (*buf_used - line_begin));
+		*buf_used -= line_begin;
 	}
-	
-	const char *cmdline = NULL;
-	
-	if(verbatim_cmdline != NULL)
+}
+
+/* Makes room for at least length more bytes at the end of buf and returns a
+ * pointer to it. The caller adds whatever it writes there to buf->used.
+*/
+static unsigned char *buffer_reserve(struct Buffer *buf, size_t length)
+{
+	if((buf->used + length) > buf->size)
 	{
-		if(num_cmdline_args > 0)
-		{
-			fprintf(stderr, "Additional command line arguments cannot be specified when using -e option\n");
-			return EX_USAGE;
-		}
+		buf->size = (buf->used + length) * 2;
 		
-		cmdline = verbatim_cmdline;
-		cmdline_len = strlen(cmdline);
-	}
-	else{
-		cmdline = cmdline_buf;
+		buf->data = realloc(buf->data, buf->size);
+		assert(buf->data != NULL);
 	}
 	
-	if(cmdline_len > 65535)
+	return buf->data + buf->used;
+}
+
+static void buffer_message(struct Buffer *buf, unsigned char command, const void *payload, size_t payload_length)
+{
+	assert(payload_length <= 65535);
+	
+	struct MessageHeader header = { command, payload_length };
+	
+	unsigned char *p = buffer_reserve(buf, (sizeof(header) + payload_length));
+	
+	memcpy(p, &header, sizeof(header));
+	buf->used += sizeof(header);
+	
+	if(payload_length > 0)
 	{
-		fprintf(stderr, "Command line arguments are too long\n");
-		return EX_DATAERR;
+		memcpy((p + sizeof(header)), payload, payload_length);
+		buf->used += payload_length;
 	}
+}
+
+static void buffer_redirect(struct Buffer *buf, unsigned char stream, const struct Redirect *redirect)
+{
+	size_t path_len = redirect->path != NULL ? strlen(redirect->path) : 0;
 	
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	assert(sock >= 0);
+	unsigned char msg[sizeof(struct RedirectMessage) + 65535];
 	
-	struct sockaddr_in addr;
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = inet_addr(host);
-	addr.sin_port = htons(port);
+	((struct RedirectMessage*)(msg))->stream = stream;
+	((struct RedirectMessage*)(msg))->mode = redirect->mode;
 	
-	assert(connect(sock, (struct sockaddr*)(&addr), sizeof(addr)) == 0);
+	memcpy((msg + sizeof(struct RedirectMessage)), redirect->path, path_len);
 	
-	send_header(sock, 'A', strlen(program_name));
-	send_all(sock, program_name, strlen(program_name));
+	buffer_message(buf, 'R', msg, (sizeof(struct RedirectMessage) + path_len));
+}
+
+/* Reads whatever is waiting on the connection and processes every complete
+ * message received, leaving any partial message in the buffer for next time.
+*/
+static void client_recv(struct Client *client)
+{
+	if(client->splice_remaining > 0)
+	{
+		client_splice(client);
+		return;
+	}
 	
-	send_header(sock, 'C', cmdline_len);
-	send_all(sock, cmdline, cmdline_len);
+	size_t recv_length = RECVBUF_SIZE - client->recvbuf_used;
 	
-	send_header(sock, 'E', 0);
+	if(client->header_only)
+	{
+		assert(client->recvbuf_used < sizeof(struct MessageHeader));
+		recv_length = sizeof(struct MessageHeader) - client->recvbuf_used;
+	}
 	
-	int stdin_fd = fileno(stdin);
+	ssize_t r = recv(client->sock, (client->recvbuf + client->recvbuf_used), recv_length, 0);
 	
-	while(1)
+	if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
 	{
-		fd_set read_fds;
-		FD_ZERO(&read_fds);
-		
-		FD_SET(sock, &read_fds);
-		int maxfd = sock;
-		
-		if(stdin_fd >= 0)
+		return;
+	}
+	else if(r < 0)
+	{
+		perror("recv");
+		exit(EX_IOERR);
+	}
+	else if(r == 0)
+	{
+		if(stderr != NULL)
 		{
-			FD_SET(stdin_fd, &read_fds);
-			
-			if(stdin_fd > sock)
-			{
-				maxfd = stdin_fd;
-			}
+			fprintf(stderr, "Connection closed by server\n");
 		}
 		
-		select((maxfd + 1), &read_fds, NULL, NULL, NULL);
+		exit(EX_PROTOCOL);
+	}
+	
+	client->recvbuf_used += r;
+	client->header_only = false;
+	
+	size_t consumed = 0;
+	
+	while(!client->finished && (client->recvbuf_used - consumed) >= sizeof(struct MessageHeader))
+	{
+		const struct MessageHeader *header = (const struct MessageHeader*)(client->recvbuf + consumed);
+		size_t total_length = sizeof(*header) + header->payload_length;
 		
-		if(FD_ISSET(sock, &read_fds))
+		if((client->recvbuf_used - consumed) < total_length)
 		{
-			struct MessageHeader header;
+			/* Incomplete message. If it is a large chunk of output, write what we
+			 * have and splice the rest rather than reading it in.
+			*/
 			
-			int r = recv(sock, &header, sizeof(header), 0);
-			assert(r == sizeof(header));
+			struct Sink *sink = NULL;
 			
-			switch(header.command)
+			if(header->command == 'O')
 			{
-				case 'O':
-					if(header.payload_length == 0)
-					{
-						fclose(stdout);
-						stdout = NULL;
-					}
-					else if(stdout != NULL)
-					{
-						stream_output(stdout, sock, header.payload_length);
-					}
-					
-					break;
-					
-				case 'E':
-					if(header.payload_length == 0)
-					{
-						fclose(stderr);
-						stderr = NULL;
-					}
-					else if(stderr != NULL)
-					{
-						stream_output(stderr, sock, header.payload_length);
-					}
-					
-					break;
-					
-				case 'X':
-					int32_t exit_code;
-					
-					assert(header.payload_length == sizeof(exit_code));
-					assert(recv(sock, &exit_code, sizeof(exit_code), 0) == sizeof(exit_code));
-					
-					close(sock);
-					
-					return exit_code;
+				sink = &(client->stdout_sink);
+			}
+			else if(header->command == 'E')
+			{
+				sink = &(client->stderr_sink);
 			}
-		}
-		
-		if(stdin_fd >= 0 && FD_ISSET(stdin_fd, &read_fds))
-		{
-			static char buf[1024];
-			
-			int r = read(stdin_fd, buf, sizeof(buf));
-			assert(r >= 0);
 			
-			send_header(sock, 'I', r);
-			send_all(sock, buf, r);
+			size_t have = client->recvbuf_used - consumed - sizeof(*header);
 			
-			if(r == 0)
+			if(sink != NULL && sink->splice && (header->payload_length - have) >= SPLICE_MIN_LENGTH)
 			{
-				/* End of file. */
-				stdin_fd = -1;
+				if(have > 0)
+				{
+					sink_write(sink, (const unsigned char*)(header + 1), have);
+				}
+				
+				if(client->first_output_us == 0)
+				{
+					client->first_output_us = monotonic_us();
+				}
+				
+				client->splice_sink = sink;
+				client->splice_remaining = header->payload_length - have;
+				
+				consumed = client->recvbuf_used;
 			}
+			
+			break;
 		}
+		
+		client_message(client, header, (const unsigned char*)(header + 1));
+		
+		consumed += total_length;
 	}
 	
-	close(sock);
-	free(cmdline_buf);
+	memmove(client->recvbuf, (client->recvbuf + consumed), (client->recvbuf_used - consumed));
+	client->recvbuf_used -= consumed;
+}
+
+static void print_stats(int fd, const struct ConnectionStats *stats)
+{
+	dprintf(fd, "--- stats\n");
+	dprintf(fd, "stdin:  %llu bytes in %u messages\n", (unsigned long long)(stats->stdin_bytes), (unsigned)(stats->stdin_frames));
+	dprintf(fd, "stdout: %llu bytes in %u messages\n", (unsigned long long)(stats->stdout_bytes), (unsigned)(stats->stdout_frames));
+	dprintf(fd, "stderr: %llu bytes in %u messages\n", (unsigned long long)(stats->stderr_bytes), (unsigned)(stats->stderr_frames));
+	dprintf(fd, "send buffer full: %u ms\n", (unsigned)(stats->sendbuf_full_ms));
+	dprintf(fd, "stdin stalls: %u (%u ms)\n", (unsigned)(stats->stdin_stalls), (unsigned)(stats->stdin_stall_ms));
+	
+	if(stats->first_output_ms > 0)
+	{
+		dprintf(fd, "first output: %u ms\n", (unsigned)(stats->first_output_ms));
+	}
+	
+	dprintf(fd, "total: %u ms\n", (unsigned)(stats->total_ms));
+	
+	static const char *BUCKET_NAMES[STATS_READ_BUCKETS] = { "<=64", "<=512", "<=4K", "<=16K", "<=32K" };
+	
+	dprintf(fd, "pipe reads:");
+	
+	for(int i = 0; i < STATS_READ_BUCKETS; ++i)
+	{
+		dprintf(fd, " %s: %u", BUCKET_NAMES[i], (unsigned)(stats->read_sizes[i]));
+	}
+	
+	dprintf(fd, "\n");
+}
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ((uint64_t)(ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* Prints how long each phase took, merging the server's timestamps with ours.
+ *
+ * The server counts from receiving the start of the request and we count from
+ * sending it, so the time left over between the exit status being queued and
+ * arriving here (delivery) covers the trip in both directions. Rows which come
+ * out negative, from clock resolution, are reported as unavailable.
+*/
+static void print_timing(const struct Client *client, uint64_t done_us)
+{
+	const struct PhaseTimes *p = &(client->phases);
+	bool have = client->have_phases;
+	
+	/* Our timestamps, relative to sending the request like the server's are to
+	 * receiving it.
+	*/
+	int64_t first_output = client->first_output_us > 0 ? (int64_t)(client->first_output_us - client->request_us) : 0;
+	int64_t exit_received = client->exit_us > 0 ? (int64_t)(client->exit_us - client->request_us) : 0;
+	
+	bool spawned = have && p->spawned_us > 0;
+	bool exited = have && p->exited_us > 0;
+	
+	struct {
+		const char *name;
+		const char *description;
+		bool valid;
+		int64_t us;
+	} rows[] = {
+		{ "connect",             "connect",                true,                                    (int64_t)(client->connected_us - client->started_us) },
+		{ "request",             "request sent",           (have && p->execute_us > 0),             (int64_t)(p->execute_us) },
+		{ "path_search",         "  searching PATH",       spawned,                                 (int64_t)(p->path_search_us) },
+		{ "create_process",      "  CreateProcess()",      spawned,                                 (int64_t)(p->create_process_us) },
+		{ "spawn",               "spawn",                  spawned,                                 (int64_t)(p->spawned_us - p->execute_us) },
+		{ "first_output",        "first output (server)",  (spawned && p->first_output_us > 0),     (int64_t)(p->first_output_us - p->spawned_us) },
+		{ "run",                 "run",                    (spawned && exited),                     (int64_t)(p->exited_us - p->spawned_us) },
+		{ "exit",                "exit status queued",     exited,                                  (int64_t)(p->exit_sent_us - p->exited_us) },
+		{ "delivery",            "delivery (round trip)",  (have && exit_received > 0),             (exit_received - (int64_t)(p->exit_sent_us)) },
+		{ "drain",               "drain",                  (client->exit_us > 0),                   (int64_t)(done_us - client->exit_us) },
+		{ "total",               "total",                  true,                                    (int64_t)(done_us - client->started_us) },
+		{ "client_first_output", "first output (client)",  (first_output > 0),                      first_output },
+	};
+	
+	const size_t num_rows = sizeof(rows) / sizeof(*rows);
+	
+	if(client->timing_json)
+	{
+		dprintf(client->timing_fd, "{");
+		
+		for(size_t i = 0; i < num_rows; ++i)
+		{
+			if(rows[i].valid && rows[i].us >= 0)
+			{
+				dprintf(client->timing_fd, "%s\"%s_ms\":%.3f", (i > 0 ? "," : ""), rows[i].name, ((double)(rows[i].us) / 1000.0));
+			}
+			else{
+				dprintf(client->timing_fd, "%s\"%s_ms\":null", (i > 0 ? "," : ""), rows[i].name);
+			}
+		}
+		
+		dprintf(client->timing_fd, "}\n");
+	}
+	else{
+		dprintf(client->timing_fd, "--- timing\n");
+		
+		for(size_t i = 0; i < num_rows; ++i)
+		{
+			if(rows[i].valid && rows[i].us >= 0)
+			{
+				dprintf(client->timing_fd, "%-24s %10.3f ms\n", rows[i].description, ((double)(rows[i].us) / 1000.0));
+			}
+			else{
+				dprintf(client->timing_fd, "%-24s %10s\n", rows[i].description, "-");
+			}
+		}
+	}
+}
+
+/* Moves the rest of the current output message from the socket to its sink
+ * without copying it through our memory.
+*/
+static void client_splice(struct Client *client)
+{
+	struct Sink *sink = client->splice_sink;
+	
+	while(client->splice_remaining > 0)
+	{
+		int out_fd = sink->splice_pipe[1] >= 0 ? sink->splice_pipe[1] : sink->fd;
+		
+		ssize_t r = splice(client->sock, NULL, out_fd, NULL, client->splice_remaining, SPLICE_F_MOVE);
+		
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		else if(r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if(r < 0)
+		{
+			perror("splice");
+			exit(EX_IOERR);
+		}
+		else if(r == 0)
+		{
+			if(stderr != NULL)
+			{
+				fprintf(stderr, "Connection closed by server\n");
+			}
+			
+			exit(EX_PROTOCOL);
+		}
+		
+		client->splice_remaining -= r;
+		
+		/* Drain the intermediate pipe into the file. */
+		
+		while(r > 0 && sink->splice_pipe[0] >= 0)
+		{
+			ssize_t w = splice(sink->splice_pipe[0], NULL, sink->fd, NULL, r, SPLICE_F_MOVE);
+			
+			if(w < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			else if(w <= 0)
+			{
+				perror("splice");
+				exit(EX_IOERR);
+			}
+			
+			r -= w;
+		}
+	}
+	
+	client->splice_sink = NULL;
+	client->header_only = true;
+}
+
+/* Sends as much of the queue, and then the file being sent from, as the socket
+ * will take without blocking.
+*/
+static void client_send(struct Client *client)
+{
+	while(client->sendq_sent < client->sendq.used || client->sendfile_remaining > 0)
+	{
+		ssize_t sent;
+		
+		if(client->request_us == 0)
+		{
+			client->request_us = monotonic_us();
+		}
+		
+		if(client->sendq_sent < client->sendq.used)
+		{
+			/* A header followed by a payload from the file is held back until
+			 * they can go in the same segment.
+			*/
+			
+			int flags = MSG_NOSIGNAL | (client->sendfile_remaining > 0 ? MSG_MORE : 0);
+			
+			sent = send(client->sock, (client->sendq.data + client->sendq_sent), (client->sendq.used - client->sendq_sent), flags);
+		}
+		else{
+			sent = sendfile(client->sock, client->sendfile_fd, NULL, client->sendfile_remaining);
+			
+			if(sent == 0)
+			{
+				fprintf(stderr, "Stdin was truncated while being sent\n");
+				exit(EX_IOERR);
+			}
+		}
+		
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			/* Reclaim the space already sent once there is enough of it to be
+			 * worth moving the rest.
+			*/
+			
+			if(client->sendq_sent >= SENDQ_LIMIT)
+			{
+				memmove(client->sendq.data, (client->sendq.data + client->sendq_sent), (client->sendq.used - client->sendq_sent));
+				
+				client->sendq.used -= client->sendq_sent;
+				client->sendq_sent = 0;
+			}
+			
+			return;
+		}
+		else if(sent < 0 && errno != EINTR)
+		{
+			perror("send");
+			exit(EX_IOERR);
+		}
+		else if(sent > 0 && client->sendq_sent < client->sendq.used)
+		{
+			client->sendq_sent += sent;
+			
+			if(client->sendq_sent == client->sendq.used)
+			{
+				client->sendq.used = 0;
+				client->sendq_sent = 0;
+			}
+		}
+		else if(sent > 0)
+		{
+			client->sendfile_remaining -= sent;
+			
+			if(client->sendfile_remaining == 0)
+			{
+				client_send_file(client);
+			}
+		}
+	}
+	
+	client->sendq.used = 0;
+	client->sendq_sent = 0;
+}
+
+/* Queues the header of the next I message to be sent from the file, or the
+ * empty one marking end of file once it has all been sent.
+*/
+static void client_send_file(struct Client *client)
+{
+	size_t length = client->sendfile_left > 65535 ? 65535 : client->sendfile_left;
+	
+	struct MessageHeader header = { 'I', length };
+	
+	memcpy(buffer_reserve(&(client->sendq), sizeof(header)), &header, sizeof(header));
+	client->sendq.used += sizeof(header);
+	
+	client->sendfile_remaining = length;
+	client->sendfile_left -= length;
+	
+	if(length == 0)
+	{
+		client->sendfile_fd = -1;
+	}
+}
+
+static void client_message(struct Client *client, const struct MessageHeader *header, const unsigned char *payload)
+{
+	if((header->command == 'O' || header->command == 'E') && header->payload_length > 0 && client->first_output_us == 0)
+	{
+		client->first_output_us = monotonic_us();
+	}
+	
+	switch(header->command)
+	{
+		case 'O':
+			sink_write(&(client->stdout_sink), payload, header->payload_length);
+			break;
+			
+		case 'E':
+			sink_write(&(client->stderr_sink), payload, header->payload_length);
+			break;
+			
+		case 'X':
+		{
+			/* One exit status for each stage of the pipeline. */
+			
+			int32_t exit_codes[MAX_PIPELINE_STAGES];
+			
+			assert(header->payload_length > 0);
+			assert(header->payload_length <= sizeof(exit_codes));
+			assert((header->payload_length % sizeof(*exit_codes)) == 0);
+			
+			memcpy(exit_codes, payload, header->payload_length);
+			
+			size_t num_exit_codes = header->payload_length / sizeof(*exit_codes);
+			int32_t exit_code = exit_codes[num_exit_codes - 1];
+			
+			if(client->have_result)
+			{
+				/* Exit status of a session is that of the last command run. */
+				exit_code = client->last_result;
+			}
+			
+			for(size_t s = num_exit_codes; client->pipefail && s > 0; --s)
+			{
+				if(exit_codes[s - 1] != 0)
+				{
+					exit_code = exit_codes[s - 1];
+					break;
+				}
+			}
+			
+			client->finished = true;
+			client->exit_code = exit_code;
+			client->exit_us = monotonic_us();
+			
+			break;
+		}
+		
+		case 'T':
+		{
+			struct ConnectionStats stats;
+			
+			assert(header->payload_length == sizeof(stats));
+			memcpy(&stats, payload, sizeof(stats));
+			
+			if(client->stats_fd >= 0)
+			{
+				print_stats(client->stats_fd, &stats);
+			}
+			
+			break;
+		}
+		
+		case 'M':
+		{
+			assert(header->payload_length == sizeof(client->phases));
+			memcpy(&(client->phases), payload, sizeof(client->phases));
+			
+			client->have_phases = true;
+			
+			break;
+		}
+		
+		case 'R':
+		{
+			struct CommandResult result;
+			
+			assert(header->payload_length == sizeof(result));
+			memcpy(&result, payload, sizeof(result));
+			
+			client->have_result = true;
+			client->last_result = result.exit_code;
+			
+			if(result.index < client->num_batch_commands && stderr != NULL)
+			{
+				fprintf(stderr, "[%u] Exit status %d: %s\n",
+					(unsigned)(result.index + 1), (int)(result.exit_code), client->batch_commands[result.index]);
+			}
+			
+			break;
+		}
+	}
+}
+
+/* Sets up a sink writing to one of our standard streams, which is written to
+ * directly from here on rather than through stdio.
+*/
+static void sink_init(struct Sink *sink, FILE **file)
+{
+	sink->file = file;
+	sink->fd = fileno(*file);
+	
+	sink->splice = false;
+	sink->splice_pipe[0] = -1;
+	sink->splice_pipe[1] = -1;
+	
+	struct stat st;
+	
+	if(fstat(sink->fd, &st) != 0)
+	{
+		return;
+	}
+	
+	/* Splicing into a file opened for appending isn't supported everywhere. */
+	
+	if(S_ISFIFO(st.st_mode))
+	{
+		/* Bigger pipes mean fewer, larger splices. Not fatal if we can't. */
+		fcntl(sink->fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+		
+		sink->splice = true;
+	}
+	else if(S_ISREG(st.st_mode) && !(fcntl(sink->fd, F_GETFL) & O_APPEND) && pipe2(sink->splice_pipe, O_CLOEXEC) == 0)
+	{
+		fcntl(sink->splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+		
+		sink->splice = true;
+	}
+}
+
+/* Writes the payload of an O or E message to a sink, which is closed by the
+ * empty message marking end of file.
+*/
+static void sink_write(struct Sink *sink, const unsigned char *data, size_t length)
+{
+	if(sink->fd < 0)
+	{
+		return;
+	}
+	
+	if(length == 0)
+	{
+		sink_close(sink);
+		return;
+	}
+	
+	while(length > 0)
+	{
+		ssize_t w = write(sink->fd, data, length);
+		
+		if(w < 0 && errno == EAGAIN)
+		{
+			/* Inherited a non-blocking stream. */
+			
+			struct pollfd pfd = { sink->fd, POLLOUT, 0 };
+			poll(&pfd, 1, -1);
+			
+			continue;
+		}
+		else if(w < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		
+		assert(w > 0);
+		
+		data += w;
+		length -= w;
+	}
+}
+
+static void sink_close(struct Sink *sink)
+{
+	if(sink->fd < 0)
+	{
+		return;
+	}
+	
+	if(sink->splice_pipe[0] >= 0)
+	{
+		close(sink->splice_pipe[0]);
+		close(sink->splice_pipe[1]);
+	}
+	
+	fclose(*(sink->file));
+	*(sink->file) = NULL;
+	
+	sink->fd = -1;
+	sink->splice = false;
+}
+
+/* Puts the terminal into raw mode, so each keystroke is passed through to the
+ * remote program as soon as it is typed rather than a line at a time.
+*/
+static void tty_make_raw(int fd)
+{
+	if(tcgetattr(fd, &tty_saved) != 0)
+	{
+		return;
+	}
+	
+	struct termios raw = tty_saved;
+	cfmakeraw(&raw);
+	
+	/* Keep translating output newlines, not everything run remotely writes a
+	 * carriage return before each one.
+	*/
+	raw.c_oflag |= (OPOST | ONLCR);
+	
+	if(tcsetattr(fd, TCSAFLUSH, &raw) == 0)
+	{
+		tty_raw = true;
+		atexit(&tty_restore);
+	}
+}
+
+static void tty_restore(void)
+{
+	if(tty_raw)
+	{
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &tty_saved);
+		tty_raw = false;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool skip_args = false;
+	
+	const char *host = NULL;
+	int port = ICE9_DEFAULT_PORT;
+	
+	struct Stage stages[MAX_PIPELINE_STAGES];
+	memset(stages, 0, sizeof(stages));
+	
+	size_t num_stages = 1;
+	struct Stage *stage = &(stages[0]);
+	
+	bool pipefail = false;
+	bool session = false;
+	bool interactive = false;
+	bool stats = false;
+	int timing = 0;  /* 1 for --timing, 2 for --timing-json */
+	
+	const char *batch_file = NULL;
+	uint32_t flags = 0;
+	
+	const char *push_local = NULL;
+	const char *push_remote = NULL;
+	
+	bool server_status = false;
+	
+	int max_parallel = 32;
+	int connect_timeout = 10000;
+	int threads = 0;
+	bool fold = false;
+	
+	const char *control_master = NULL;
+	const char *control_path = NULL;
+	int pool_size = 1;
+	
+	struct OutputPolicyMessage stdout_policy = { 'O', 'A', 0 };
+	struct OutputPolicyMessage stderr_policy = { 'E', 'A', 0 };
+	
+	struct Redirect stdin_redirect = { 0, NULL };
+	struct Redirect stdout_redirect = { 0, NULL };
+	struct Redirect stderr_redirect = { 0, NULL };
+	
+	for(int i = 1; i < argc; ++i)
+	{
+		if(!skip_args && argv[i][0] == '-')
+		{
+			if(strcmp(argv[i], "-p") == 0)
+			{
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '-p' requires a parameter\n");
+					return EX_USAGE;
+				}
+				
+				port = atoi(argv[i]);
+			}
+			else if(strcmp(argv[i], "-e") == 0)
+			{
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '-e' requires a parameter\n");
+					return EX_USAGE;
+				}
+				
+				stage->verbatim_cmdline = argv[i];
+			}
+			else if(strcmp(argv[i], "--pipefail") == 0)
+			{
+				pipefail = true;
+			}
+			else if(strcmp(argv[i], "--session") == 0)
+			{
+				session = true;
+			}
+			else if(strcmp(argv[i], "--stats") == 0)
+			{
+				stats = true;
+				flags |= CF_STATS;
+			}
+			else if(strcmp(argv[i], "--timing") == 0)
+			{
+				timing = 1;
+				flags |= CF_TIMING;
+			}
+			else if(strcmp(argv[i], "--timing-json") == 0)
+			{
+				timing = 2;
+				flags |= CF_TIMING;
+			}
+			else if(strcmp(argv[i], "--interactive") == 0 || strcmp(argv[i], "-t") == 0)
+			{
+				interactive = true;
+				flags |= CF_INTERACTIVE;
+			}
+			else if(strcmp(argv[i], "--batch") == 0)
+			{
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '--batch' requires a parameter\n");
+					return EX_USAGE;
+				}
+				
+				batch_file = argv[i];
+			}
+			else if(strcmp(argv[i], "--server-status") == 0)
+			{
+				server_status = true;
+			}
+			else if(strcmp(argv[i], "--push") == 0)
+			{
+				if((i + 2) >= argc)
+				{
+					fprintf(stderr, "Option '--push' requires two parameters\n");
+					return EX_USAGE;
+				}
+				
+				push_local = argv[++i];
+				push_remote = argv[++i];
+				
+				if(strlen(push_remote) > 65535)
+				{
+					fprintf(stderr, "Path too long: %s\n", push_remote);
+					return EX_DATAERR;
+				}
+			}
+			else if(strcmp(argv[i], "--stop-on-error") == 0)
+			{
+				flags |= CF_STOP_ON_FAILURE;
+			}
+			else if(strcmp(argv[i], "--parallel") == 0)
+			{
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '--parallel' requires a parameter\n");
+					return EX_USAGE;
+				}
+				
+				max_parallel = atoi(argv[i]);
+				
+				if(max_parallel <= 0)
+				{
+					fprintf(stderr, "Invalid concurrency limit: %s\n", argv[i]);
+					return EX_USAGE;
+				}
+			}
+			else if(strcmp(argv[i], "--fold") == 0)
+			{
+				fold = true;
+			}
+			else if(strcmp(argv[i], "--threads") == 0)
+			{
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '--threads' requires a parameter\n");
+					return EX_USAGE;
+				}
+				
+				threads = atoi(argv[i]);
+				
+				if(threads <= 0)
+				{
+					fprintf(stderr, "Invalid thread count: %s\n", argv[i]);
+					return EX_USAGE;
+				}
+			}
+			else if(strcmp(argv[i], "--control-master") == 0 || strcmp(argv[i], "--control-path") == 0)
+			{
+				bool is_master = strcmp(argv[i], "--control-master") == 0;
+				
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '%s' requires a parameter\n", argv[i - 1]);
+					return EX_USAGE;
+				}
+				
+				if(is_master)
+				{
+					control_master = argv[i];
+				}
+				else{
+					control_path = argv[i];
+				}
+			}
+			else if(strcmp(argv[i], "--pool") == 0)
+			{
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '--pool' requires a parameter\n");
+					return EX_USAGE;
+				}
+				
+				pool_size = atoi(argv[i]);
+				
+				if(pool_size <= 0)
+				{
+					fprintf(stderr, "Invalid pool size: %s\n", argv[i]);
+					return EX_USAGE;
+				}
+			}
+			else if(strcmp(argv[i], "--connect-timeout") == 0)
+			{
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '--connect-timeout' requires a parameter\n");
+					return EX_USAGE;
+				}
+				
+				char *end;
+				double seconds = strtod(argv[i], &end);
+				
+				if(*end != '\0' || seconds <= 0.0)
+				{
+					fprintf(stderr, "Invalid connect timeout: %s\n", argv[i]);
+					return EX_USAGE;
+				}
+				
+				connect_timeout = seconds * 1000.0;
+			}
+			else if(strcmp(argv[i], "--stdout-policy") == 0 || strcmp(argv[i], "--stderr-policy") == 0)
+			{
+				bool is_stdout = strcmp(argv[i], "--stdout-policy") == 0;
+				
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '%s' requires a parameter\n", argv[i - 1]);
+					return EX_USAGE;
+				}
+				
+				if(!parse_output_policy((is_stdout ? &stdout_policy : &stderr_policy), (is_stdout ? 'O' : 'E'), argv[i]))
+				{
+					fprintf(stderr, "Invalid output policy: %s\n", argv[i]);
+					return EX_USAGE;
+				}
+			}
+			else if(strcmp(argv[i], "--stdin-from") == 0
+				|| strcmp(argv[i], "--stdout-to") == 0 || strcmp(argv[i], "--stdout-append") == 0
+				|| strcmp(argv[i], "--stderr-to") == 0 || strcmp(argv[i], "--stderr-append") == 0)
+			{
+				struct Redirect *redirect;
+				
+				if(strncmp(argv[i], "--stdin", 7) == 0)
+				{
+					redirect = &stdin_redirect;
+				}
+				else if(strncmp(argv[i], "--stdout", 8) == 0)
+				{
+					redirect = &stdout_redirect;
+				}
+				else{
+					redirect = &stderr_redirect;
+				}
+				
+				if(strcmp(argv[i], "--stdin-from") == 0)
+				{
+					redirect->mode = 'R';
+				}
+				else if(strstr(argv[i], "-append") != NULL)
+				{
+					redirect->mode = 'A';
+				}
+				else{
+					redirect->mode = 'W';
+				}
+				
+				++i;
+				
+				if(i >= argc)
+				{
+					fprintf(stderr, "Option '%s' requires a parameter\n", argv[i - 1]);
+					return EX_USAGE;
+				}
+				
+				if(strlen(argv[i]) > (65535 - sizeof(struct RedirectMessage)))
+				{
+					fprintf(stderr, "Path too long: %s\n", argv[i]);
+					return EX_DATAERR;
+				}
+				
+				redirect->path = argv[i];
+			}
+			else if(strcmp(argv[i], "--stderr-to-stdout") == 0)
+			{
+				stderr_redirect.mode = 'O';
+				stderr_redirect.path = NULL;
+			}
+			else if(strcmp(argv[i], "--") == 0)
+			{
+				skip_args = true;
+			}
+			else{
+				fprintf(stderr, "Unrecognised option: %s\n", argv[i]);
+				return EX_USAGE;
+			}
+		}
+		else if(host == NULL)
+		{
+			host = argv[i];
+		}
+		else if(!skip_args && strcmp(argv[i], "|") == 0)
+		{
+			if(stage->program_name == NULL)
+			{
+				print_usage(stderr, argv[0]);
+				return EX_USAGE;
+			}
+			
+			if(num_stages == MAX_PIPELINE_STAGES)
+			{
+				fprintf(stderr, "Too many pipeline stages (maximum is %d)\n", MAX_PIPELINE_STAGES);
+				return EX_USAGE;
+			}
+			
+			stage = &(stages[num_stages++]);
+		}
+		else if(stage->program_name == NULL)
+		{
+			stage->program_name = argv[i];
+			cmdline_push_string(&(stage->cmdline_buf), &(stage->cmdline_size), &(stage->cmdline_len), argv[i]);
+		}
+		else{
+			cmdline_push_string(&(stage->cmdline_buf), &(stage->cmdline_size), &(stage->cmdline_len), argv[i]);
+			++(stage->num_cmdline_args);
+		}
+	}
+	
+	if(control_master != NULL)
+	{
+		if(host != NULL)
+		{
+			print_usage(stderr, argv[0]);
+			return EX_USAGE;
+		}
+		
+		return master_run(control_master, pool_size);
+	}
+	
+	/* A batch without a session has no program of its own, just the commands
+	 * listed in the file. Neither does pushing a file or asking for the status.
+	*/
+	bool batch_only = batch_file != NULL && !session;
+	bool no_program = batch_only || push_local != NULL || server_status;
+	
+	if(host == NULL || (no_program && (stages[0].program_name != NULL || num_stages > 1)))
+	{
+		print_usage(stderr, argv[0]);
+		return EX_USAGE;
+	}
+	
+	if(push_local != NULL && (batch_file != NULL || session))
+	{
+		fprintf(stderr, "Pushing a file cannot be combined with batches or sessions\n");
+		return EX_USAGE;
+	}
+	
+	if(server_status && (batch_file != NULL || session || push_local != NULL || interactive))
+	{
+		fprintf(stderr, "--server-status cannot be combined with running anything else\n");
+		return EX_USAGE;
+	}
+	
+	for(size_t s = 0; s < num_stages && !no_program; ++s)
+	{
+		stage = &(stages[s]);
+		
+		if(stage->program_name == NULL)
+		{
+			print_usage(stderr, argv[0]);
+			return EX_USAGE;
+		}
+		
+		if(strlen(stage->program_name) > 65535)
+		{
+			fprintf(stderr, "Program name too long\n");
+			return EX_DATAERR;
+		}
+		
+		if(stage->verbatim_cmdline != NULL)
+		{
+			if(stage->num_cmdline_args > 0)
+			{
+				fprintf(stderr, "Additional command line arguments cannot be specified when using -e option\n");
+				return EX_USAGE;
+			}
+			
+			stage->cmdline = stage->verbatim_cmdline;
+			stage->cmdline_len = strlen(stage->cmdline);
+		}
+		else{
+			stage->cmdline = stage->cmdline_buf;
+		}
+		
+		if(stage->cmdline_len > 65535)
+		{
+			fprintf(stderr, "Command line arguments are too long\n");
+			return EX_DATAERR;
+		}
+	}
+	
+	if(session && (num_stages > 1 || stdin_redirect.mode != 0 || stdout_redirect.mode != 0))
+	{
+		fprintf(stderr, "Sessions cannot be combined with pipelines or redirecting stdin/stdout\n");
+		return EX_USAGE;
+	}
+	
+	if(interactive && (session || batch_file != NULL || push_local != NULL || stdin_redirect.mode != 0))
+	{
+		fprintf(stderr, "Interactive mode needs stdin to go to a single program\n");
+		return EX_USAGE;
+	}
+	
+	/* More than one host, or a list which might contain more than one, runs the
+	 * command on all of them at once. Pushes always go this way, even to one.
+	*/
+	bool fanout = host[0] == '@' || strchr(host, ',') != NULL || push_local != NULL;
+	
+	char **fanout_hosts = NULL;
+	size_t num_fanout_hosts = 0;
+	
+	if(fanout)
+	{
+		if(session && batch_file == NULL)
+		{
+			fprintf(stderr, "Sessions reading commands from stdin cannot be run on several hosts\n");
+			return EX_USAGE;
+		}
+		
+		fanout_hosts = fanout_parse_hosts(host, &num_fanout_hosts);
+		if(fanout_hosts == NULL)
+		{
+			return EX_NOINPUT;
+		}
+	}
+	
+	char **batch_commands = NULL;
+	size_t num_batch_commands = 0;
+	
+	if(batch_file != NULL)
+	{
+		batch_commands = read_batch_file(batch_file, &num_batch_commands);
+		
+		if(num_batch_commands == 0)
+		{
+			fprintf(stderr, "No commands in %s\n", batch_file);
+			return EX_DATAERR;
+		}
+	}
+	
+	struct Buffer request = { NULL, 0, 0 };
+	
+	for(size_t c = 0; c < num_batch_commands && batch_only; ++c)
+	{
+		char *program = command_program(batch_commands[c]);
+		
+		buffer_message(&request, 'A', program, strlen(program));
+		buffer_message(&request, 'C', batch_commands[c], strlen(batch_commands[c]));
+		buffer_message(&request, 'Q', NULL, 0);
+		
+		free(program);
+	}
+	
+	for(size_t s = 0; s < num_stages && !no_program; ++s)
+	{
+		stage = &(stages[s]);
+		
+		if(s > 0)
+		{
+			buffer_message(&request, '|', NULL, 0);
+		}
+		
+		buffer_message(&request, 'A', stage->program_name, strlen(stage->program_name));
+		buffer_message(&request, 'C', stage->cmdline, stage->cmdline_len);
+	}
+	
+	if(stdout_policy.mode != 'A')
+	{
+		buffer_message(&request, 'P', &stdout_policy, sizeof(stdout_policy));
+	}
+	
+	if(stderr_policy.mode != 'A')
+	{
+		buffer_message(&request, 'P', &stderr_policy, sizeof(stderr_policy));
+	}
+	
+	if(stdin_redirect.mode != 0)
+	{
+		buffer_redirect(&request, 'I', &stdin_redirect);
+	}
+	
+	if(stdout_redirect.mode != 0)
+	{
+		buffer_redirect(&request, 'O', &stdout_redirect);
+	}
+	
+	if(stderr_redirect.mode != 0)
+	{
+		buffer_redirect(&request, 'E', &stderr_redirect);
+	}
+	
+	if(flags != 0)
+	{
+		buffer_message(&request, 'F', &flags, sizeof(flags));
+	}
+	
+	if(push_local != NULL)
+	{
+		/* The file takes the place of a process. */
+		buffer_message(&request, 'U', push_remote, strlen(push_remote));
+	}
+	else if(server_status)
+	{
+		buffer_message(&request, 'G', NULL, 0);
+	}
+	else{
+		buffer_message(&request, (session ? 'S' : 'E'), NULL, 0);
+	}
+	
+	if(session && batch_file != NULL)
+	{
+		/* The whole batch is queued in the session up front. */
+		
+		for(size_t c = 0; c < num_batch_commands; ++c)
+		{
+			buffer_message(&request, 'K', batch_commands[c], strlen(batch_commands[c]));
+		}
+		
+		buffer_message(&request, 'K', NULL, 0);
+	}
+	
+	if(fanout)
+	{
+		/* Local stdin can't be shared between hosts, so every child sees end of
+		 * file immediately.
+		*/
+		
+		if(!session && push_local == NULL && !server_status)
+		{
+			buffer_message(&request, 'I', NULL, 0);
+		}
+		
+		struct FanoutOptions options;
+		
+		options.push = push_local != NULL;
+		options.push_data = NULL;
+		options.push_length = 0;
+		
+		if(options.push)
+		{
+			/* Mapped once and sent to every host from the same pages. */
+			
+			int fd = open(push_local, O_RDONLY);
+			if(fd < 0)
+			{
+				fprintf(stderr, "Unable to open %s: %s\n", push_local, strerror(errno));
+				return EX_NOINPUT;
+			}
+			
+			struct stat st;
+			
+			if(fstat(fd, &st) != 0)
+			{
+				fprintf(stderr, "Unable to stat %s: %s\n", push_local, strerror(errno));
+				return EX_IOERR;
+			}
+			
+			options.push_length = st.st_size;
+			
+			if(options.push_length > 0)
+			{
+				void *map = mmap(NULL, options.push_length, PROT_READ, MAP_SHARED, fd, 0);
+				if(map == MAP_FAILED)
+				{
+					fprintf(stderr, "Unable to map %s: %s\n", push_local, strerror(errno));
+					return EX_IOERR;
+				}
+				
+				madvise(map, options.push_length, MADV_SEQUENTIAL);
+				options.push_data = map;
+			}
+			
+			close(fd);
+		}
+		
+		options.request = request.data;
+		options.request_length = request.used;
+		options.default_port = port;
+		options.max_parallel = max_parallel;
+		options.connect_timeout = connect_timeout;
+		options.threads = threads;
+		options.fold = fold;
+		options.pipefail = pipefail;
+		
+		int status = fanout_run(fanout_hosts, num_fanout_hosts, &options);
+		
+		if(options.push_data != NULL)
+		{
+			munmap((void*)(options.push_data), options.push_length);
+		}
+		
+		fanout_free_hosts(fanout_hosts, num_fanout_hosts);
+		free(request.data);
+		
+		return status;
+	}
+	
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(host);
+	addr.sin_port = htons(port);
+	
+	/* Take over a connection the master already has open if we can, otherwise
+	 * connect the slow way.
+	*/
+	
+	uint64_t started_us = monotonic_us();
+	
+	int sock = control_path != NULL ? master_request(control_path, &addr) : -1;
+	
+	if(sock < 0)
+	{
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		assert(sock >= 0);
+		
+		assert(connect(sock, (struct sockaddr*)(&addr), sizeof(addr)) == 0);
+	}
+	
+	uint64_t connected_us = monotonic_us();
+	
+	/* Nothing below may block, so we can always read output from the server
+	 * while it is still reading our stdin, and vice versa.
+	*/
+	fcntl(sock, F_SETFL, (fcntl(sock, F_GETFL) | O_NONBLOCK));
+	
+	if(interactive)
+	{
+		/* Each keystroke goes out in its own segment straight away. */
+		
+		int nodelay = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+		
+		if(isatty(STDIN_FILENO))
+		{
+			tty_make_raw(STDIN_FILENO);
+		}
+	}
+	
+	/* Local stdin is only forwarded if the remote stdin isn't redirected and
+	 * isn't replaced by a batch file, and there is a program to read it.
+	*/
+	int stdin_fd = (stdin_redirect.mode == 0 && batch_file == NULL && !server_status) ? fileno(stdin) : -1;
+	
+	/* Session commands read from stdin, split into lines. */
+	static char command_buf[65535];
+	size_t command_buf_used = 0;
+	
+	struct Client client;
+	memset(&client, 0, sizeof(client));
+	
+	client.sock = sock;
+	client.pipefail = pipefail;
+	client.stats_fd = stats ? dup(STDERR_FILENO) : -1;
+	client.timing_fd = timing > 0 ? dup(STDERR_FILENO) : -1;
+	client.timing_json = timing == 2;
+	client.started_us = started_us;
+	client.connected_us = connected_us;
+	
+	if(batch_file != NULL)
+	{
+		client.batch_commands = batch_commands;
+		client.num_batch_commands = num_batch_commands;
+	}
+	
+	client.recvbuf = malloc(RECVBUF_SIZE);
+	assert(client.recvbuf != NULL);
+	
+	sink_init(&(client.stdout_sink), &stdout);
+	sink_init(&(client.stderr_sink), &stderr);
+	
+	/* The request goes out ahead of anything read from stdin. */
+	client.sendq = request;
+	client.sendfile_fd = -1;
+	
+	/* Stdin from a regular file is sent without reading it in at all. The
+	 * length of the file is taken now, starting from wherever it has been left
+	 * positioned.
+	*/
+	
+	struct stat stdin_st;
+	off_t stdin_pos;
+	
+	if(stdin_fd >= 0 && !session
+		&& fstat(stdin_fd, &stdin_st) == 0 && S_ISREG(stdin_st.st_mode)
+		&& (stdin_pos = lseek(stdin_fd, 0, SEEK_CUR)) >= 0)
+	{
+		client.sendfile_fd = stdin_fd;
+		client.sendfile_left = stdin_st.st_size > stdin_pos ? (stdin_st.st_size - stdin_pos) : 0;
+		
+		client_send_file(&client);
+		
+		stdin_fd = -1;
+	}
+	
+	while(!client.finished)
+	{
+		fd_set read_fds, write_fds;
+		FD_ZERO(&read_fds);
+		FD_ZERO(&write_fds);
+		
+		FD_SET(sock, &read_fds);
+		int maxfd = sock;
+		
+		if(client.sendq.used > client.sendq_sent || client.sendfile_remaining > 0)
+		{
+			FD_SET(sock, &write_fds);
+		}
+		
+		/* Stdin is left alone while the server isn't keeping up with it. */
+		bool stdin_wanted = stdin_fd >= 0 && (client.sendq.used - client.sendq_sent) < SENDQ_LIMIT;
+		
+		if(stdin_wanted)
+		{
+			FD_SET(stdin_fd, &read_fds);
+			
+			if(stdin_fd > sock)
+			{
+				maxfd = stdin_fd;
+			}
+		}
+		
+		if(select((maxfd + 1), &read_fds, &write_fds, NULL, NULL) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			
+			perror("select");
+			return EX_OSERR;
+		}
+		
+		if(FD_ISSET(sock, &read_fds))
+		{
+			client_recv(&client);
+			
+			if(client.finished)
+			{
+				break;
+			}
+		}
+		
+		if(FD_ISSET(sock, &write_fds))
+		{
+			client_send(&client);
+		}
+		
+		if(stdin_wanted && FD_ISSET(stdin_fd, &read_fds) && session)
+		{
+			if(command_buf_used == sizeof(command_buf))
+			{
+				if(stderr != NULL)
+				{
+					fprintf(stderr, "Command too long\n");
+				}
+				
+				return EX_DATAERR;
+			}
+			
+			int r = read(stdin_fd, (command_buf + command_buf_used), (sizeof(command_buf) - command_buf_used));
+			assert(r >= 0);
+			
+			command_buf_used += r;
+			
+			send_command_lines(&(client.sendq), command_buf, &command_buf_used, (r == 0));
+			client_send(&client);
+			
+			if(r == 0)
+			{
+				/* End of file. */
+				stdin_fd = -1;
+			}
+		}
+		else if(stdin_wanted && FD_ISSET(stdin_fd, &read_fds))
+		{
+			/* Read straight into the queue, leaving room for the header. */
+			
+			unsigned char *msg = buffer_reserve(&(client.sendq), (sizeof(struct MessageHeader) + 65535));
+			
+			ssize_t r = read(stdin_fd, (msg + sizeof(struct MessageHeader)), 65535);
+			assert(r >= 0);
+			
+			if(tty_raw && memchr((msg + sizeof(struct MessageHeader)), INTERACTIVE_ESCAPE, r) != NULL)
+			{
+				tty_restore();
+				
+				if(stderr != NULL)
+				{
+					fprintf(stderr, "\nEscape typed, disconnecting\n");
+				}
+				
+				return 128 + SIGINT;
+			}
+			
+			struct MessageHeader header = { 'I', r };
+			memcpy(msg, &header, sizeof(header));
+			
+			client.sendq.used += sizeof(header) + r;
+			
+			client_send(&client);
+			
+			if(r == 0)
+			{
+				/* End of file. */
+				stdin_fd = -1;
+			}
+		}
+	}
+	
+	close(sock);
+	free(client.recvbuf);
+	
+	if(client.stats_fd >= 0)
+	{
+		close(client.stats_fd);
+	}
+	free(client.sendq.data);
+	
+	sink_close(&(client.stdout_sink));
+	sink_close(&(client.stderr_sink));
+	
+	if(client.timing_fd >= 0)
+	{
+		print_timing(&client, monotonic_us());
+		close(client.timing_fd);
+	}
+	
+	for(size_t s = 0; s < num_stages; ++s)
+	{
+		free(stages[s].cmdline_buf);
+	}
+	
+	for(size_t c = 0; c < num_batch_commands; ++c)
+	{
+		free(batch_commands[c]);
+	}
+	
+	free(batch_commands);
 	
-	return 1;
+	return client.exit_code;
 }
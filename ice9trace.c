@@ -0,0 +1,411 @@
+/* ice9trace - Decoder for ice9d event traces
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/* Must match the definitions in ice9d.c */
+
+struct TraceHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} __attribute__((packed));
+
+struct TraceRecord
+{
+	uint64_t timestamp_us;
+	uint32_t connection_id;
+	uint32_t bytes;
+	uint16_t wait_handles;
+	uint8_t event;
+	uint8_t reserved;
+} __attribute__((packed));
+
+enum TraceEvent
+{
+	TE_WAKE = 1,
+	TE_ACCEPT,
+	TE_REJECT,
+	TE_RECV,
+	TE_SEND,
+	TE_STDOUT_READ,
+	TE_STDERR_READ,
+	TE_STDIN_WRITE,
+	TE_SPAWN,
+	TE_EXIT,
+	TE_CLOSE,
+	
+	TE_MAX,
+};
+
+static const char *EVENT_NAMES[TE_MAX] = {
+	[TE_WAKE]        = "wake",
+	[TE_ACCEPT]      = "accept",
+	[TE_REJECT]      = "reject",
+	[TE_RECV]        = "recv",
+	[TE_SEND]        = "send",
+	[TE_STDOUT_READ] = "stdout-read",
+	[TE_STDERR_READ] = "stderr-read",
+	[TE_STDIN_WRITE] = "stdin-write",
+	[TE_SPAWN]       = "spawn",
+	[TE_EXIT]        = "exit",
+	[TE_CLOSE]       = "close",
+};
+
+/* Values are counted in power of two buckets, up to 2^31 and over. */
+#define HISTOGRAM_BUCKETS 33
+
+struct Histogram
+{
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+/* Highest connection ID which lifetimes are tracked for. */
+#define MAX_TRACKED_CONNECTIONS 65536
+
+static struct TraceRecord *read_trace(const char *path, size_t *num_records);
+static const char *event_name(uint8_t event);
+static void print_timeline(const struct TraceRecord *records, size_t num_records);
+static void print_summary(const struct TraceRecord *records, size_t num_records);
+static void histogram_add(struct Histogram *histogram, uint64_t value);
+static void histogram_print(const struct Histogram *histogram, const char *title, const char *unit);
+
+static struct TraceRecord *read_trace(const char *path, size_t *num_records)
+{
+	FILE *fh = fopen(path, "rb");
+	if(fh == NULL)
+	{
+		perror(path);
+		return NULL;
+	}
+	
+	struct TraceHeader header;
+	
+	if(fread(&header, sizeof(header), 1, fh) != 1
+		|| memcmp(header.magic, "ICE9TRAC", sizeof(header.magic)) != 0)
+	{
+		fprintf(stderr, "%s is not an ice9d trace\n", path);
+		
+		fclose(fh);
+		return NULL;
+	}
+	
+	if(header.version != 1 || header.record_size != sizeof(struct TraceRecord))
+	{
+		fprintf(stderr, "%s is an unsupported trace version (%u)\n", path, (unsigned)(header.version));
+		
+		fclose(fh);
+		return NULL;
+	}
+	
+	struct TraceRecord *records = NULL;
+	size_t records_size = 0;
+	
+	*num_records = 0;
+	
+	while(true)
+	{
+		if(*num_records == records_size)
+		{
+			records_size = records_size > 0 ? (records_size * 2) : 4096;
+			
+			records = realloc(records, (records_size * sizeof(*records)));
+			if(records == NULL)
+			{
+				fprintf(stderr, "Unable to allocate memory\n");
+				exit(EX_SOFTWARE);
+			}
+		}
+		
+		size_t r = fread((records + *num_records), sizeof(*records), (records_size - *num_records), fh);
+		*num_records += r;
+		
+		if(*num_records < records_size)
+		{
+			break;
+		}
+	}
+	
+	if(ferror(fh))
+	{
+		perror(path);
+		
+		free(records);
+		fclose(fh);
+		
+		return NULL;
+	}
+	
+	fclose(fh);
+	
+	return records;
+}
+
+static const char *event_name(uint8_t event)
+{
+	if(event < TE_MAX && EVENT_NAMES[event] != NULL)
+	{
+		return EVENT_NAMES[event];
+	}
+	else{
+		return "unknown";
+	}
+}
+
+static void print_timeline(const struct TraceRecord *records, size_t num_records)
+{
+	printf("%12s %6s  %-12s %10s %7s\n", "time (ms)", "conn", "event", "bytes", "waiting");
+	
+	for(size_t i = 0; i < num_records; ++i)
+	{
+		const struct TraceRecord *record = &(records[i]);
+		double ms = (double)(record->timestamp_us - records[0].timestamp_us) / 1000.0;
+		
+		if(record->event == TE_WAKE && record->bytes == 0xFFFFFFFF)
+		{
+			printf("%12.3f %6s  %-12s %10s %7u\n", ms, "-", event_name(record->event), "timeout", (unsigned)(record->wait_handles));
+		}
+		else if(record->connection_id == 0)
+		{
+			printf("%12.3f %6s  %-12s %10u %7u\n", ms, "-", event_name(record->event), (unsigned)(record->bytes), (unsigned)(record->wait_handles));
+		}
+		else{
+			printf("%12.3f %6u  %-12s %10u %7u\n", ms, (unsigned)(record->connection_id), event_name(record->event), (unsigned)(record->bytes), (unsigned)(record->wait_handles));
+		}
+	}
+}
+
+static void print_summary(const struct TraceRecord *records, size_t num_records)
+{
+	struct Histogram *sizes = calloc(TE_MAX, sizeof(*sizes));
+	struct Histogram wait_handles, busy_us, lifetime_ms;
+	
+	uint64_t *accepted_at = calloc(MAX_TRACKED_CONNECTIONS, sizeof(*accepted_at));
+	
+	if(sizes == NULL || accepted_at == NULL)
+	{
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(EX_SOFTWARE);
+	}
+	
+	memset(&wait_handles, 0, sizeof(wait_handles));
+	memset(&busy_us, 0, sizeof(busy_us));
+	memset(&lifetime_ms, 0, sizeof(lifetime_ms));
+	
+	const struct TraceRecord *last_wake = NULL;
+	
+	for(size_t i = 0; i < num_records; ++i)
+	{
+		const struct TraceRecord *record = &(records[i]);
+		
+		if(record->event < TE_MAX)
+		{
+			/* Wakes just count, the index woken isn't worth adding up. */
+			histogram_add(&(sizes[record->event]), (record->event != TE_WAKE ? record->bytes : 0));
+		}
+		
+		if(record->event == TE_WAKE)
+		{
+			/* Time from waking until the last thing done before waiting again. */
+			
+			if(last_wake != NULL)
+			{
+				histogram_add(&busy_us, (records[i - 1].timestamp_us - last_wake->timestamp_us));
+			}
+			
+			histogram_add(&wait_handles, record->wait_handles);
+			last_wake = record;
+		}
+		else if(record->event == TE_ACCEPT && record->connection_id < MAX_TRACKED_CONNECTIONS)
+		{
+			accepted_at[record->connection_id] = record->timestamp_us;
+		}
+		else if(record->event == TE_CLOSE && record->connection_id < MAX_TRACKED_CONNECTIONS
+			&& accepted_at[record->connection_id] != 0)
+		{
+			histogram_add(&lifetime_ms, ((record->timestamp_us - accepted_at[record->connection_id]) / 1000));
+		}
+	}
+	
+	double duration_ms = num_records > 0
+		? ((double)(records[num_records - 1].timestamp_us - records[0].timestamp_us) / 1000.0)
+		: 0.0;
+	
+	printf("%zu records over %.3f ms\n\n", num_records, duration_ms);
+	
+	/* Totals are in bytes, except for spawn (microseconds) and exit (codes). */
+	
+	printf("%-12s %10s %14s %10s\n", "event", "count", "total", "max");
+	
+	for(int e = 1; e < TE_MAX; ++e)
+	{
+		if(sizes[e].count > 0)
+		{
+			printf("%-12s %10llu %14llu %10llu\n", event_name(e),
+				(unsigned long long)(sizes[e].count), (unsigned long long)(sizes[e].sum), (unsigned long long)(sizes[e].max));
+		}
+	}
+	
+	static const int SIZE_EVENTS[] = { TE_RECV, TE_SEND, TE_STDOUT_READ, TE_STDERR_READ, TE_STDIN_WRITE };
+	
+	for(size_t i = 0; i < (sizeof(SIZE_EVENTS) / sizeof(*SIZE_EVENTS)); ++i)
+	{
+		histogram_print(&(sizes[SIZE_EVENTS[i]]), event_name(SIZE_EVENTS[i]), "bytes");
+	}
+	
+	histogram_print(&(sizes[TE_SPAWN]), "spawn time", "us");
+	histogram_print(&busy_us, "time spent per wake", "us");
+	histogram_print(&wait_handles, "wait array size", "handles");
+	histogram_print(&lifetime_ms, "connection lifetime", "ms");
+	
+	free(accepted_at);
+	free(sizes);
+}
+
+static void histogram_add(struct Histogram *histogram, uint64_t value)
+{
+	int bucket = 0;
+	
+	while(bucket < (HISTOGRAM_BUCKETS - 1) && value > ((uint64_t)(1) << bucket))
+	{
+		++bucket;
+	}
+	
+	++(histogram->buckets[bucket]);
+	++(histogram->count);
+	histogram->sum += value;
+	
+	if(value > histogram->max)
+	{
+		histogram->max = value;
+	}
+}
+
+static void histogram_print(const struct Histogram *histogram, const char *title, const char *unit)
+{
+	if(histogram->count == 0)
+	{
+		return;
+	}
+	
+	printf("\n%s (%s), mean %.1f, max %llu:\n", title, unit,
+		((double)(histogram->sum) / (double)(histogram->count)), (unsigned long long)(histogram->max));
+	
+	uint64_t biggest = 0;
+	
+	for(int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		if(histogram->buckets[i] > biggest)
+		{
+			biggest = histogram->buckets[i];
+		}
+	}
+	
+	for(int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		if(histogram->buckets[i] == 0)
+		{
+			continue;
+		}
+		
+		int bar = (int)((histogram->buckets[i] * 40) / biggest);
+		
+		if((i + 1) < HISTOGRAM_BUCKETS)
+		{
+			printf("  <= %-10llu %10llu %.*s\n", (unsigned long long)((uint64_t)(1) << i),
+				(unsigned long long)(histogram->buckets[i]), (bar > 0 ? bar : 1), "########################################");
+		}
+		else{
+			printf("   > %-10llu %10llu %.*s\n", (unsigned long long)((uint64_t)(1) << (i - 1)),
+				(unsigned long long)(histogram->buckets[i]), (bar > 0 ? bar : 1), "########################################");
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool summary = false;
+	const char *path = NULL;
+	
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "--summary") == 0)
+		{
+			summary = true;
+		}
+		else if(path == NULL && argv[i][0] != '-')
+		{
+			path = argv[i];
+		}
+		else{
+			path = NULL;
+			break;
+		}
+	}
+	
+	if(path == NULL)
+	{
+		fprintf(stderr, "Usage: %s [--summary] <trace file>\n", argv[0]);
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Prints a trace written by ice9d --trace as a timeline of events, or with\n");
+		fprintf(stderr, "--summary, as totals and histograms of each kind of event.\n");
+		
+		return EX_USAGE;
+	}
+	
+	size_t num_records;
+	struct TraceRecord *records = read_trace(path, &num_records);
+	
+	if(records == NULL)
+	{
+		return EX_NOINPUT;
+	}
+	
+	if(summary)
+	{
+		print_summary(records, num_records);
+	}
+	else{
+		print_timeline(records, num_records);
+	}
+	
+	free(records);
+	
+	return 0;
+}
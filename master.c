@@ -0,0 +1,472 @@
+/* ice9r - Client to remotely run a command on a Windows 9x computer
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE /* accept4(), POLLRDHUP */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "master.h"
+
+/* How long a client waits for the master to answer before connecting itself. */
+#define REQUEST_TIMEOUT_MS 1000
+
+/* Connections kept ready for one host. */
+struct PoolHost
+{
+	struct sockaddr_in addr;
+	
+	int *ready;
+	size_t num_ready;
+	
+	/* Socket waiting for a non-blocking connect() to finish, or -1. */
+	int connecting;
+	
+	/* Set when a connection fails, so we don't keep retrying a host which is
+	 * down until someone asks for it again.
+	*/
+	bool failed;
+};
+
+struct Master
+{
+	int listener;
+	int pool_size;
+	
+	struct PoolHost *hosts;
+	size_t num_hosts;
+	size_t hosts_size;
+};
+
+static bool unix_addr(struct sockaddr_un *sun, const char *socket_path);
+static void master_client(struct Master *master);
+static struct PoolHost *pool_find(struct Master *master, const struct sockaddr_in *addr);
+static void pool_refill(struct PoolHost *host, int pool_size);
+static void pool_connected(struct PoolHost *host, int pool_size);
+static void pool_discard(struct PoolHost *host, size_t ready_idx);
+
+int master_run(const char *socket_path, int pool_size)
+{
+	struct sockaddr_un sun;
+	
+	if(!unix_addr(&sun, socket_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", socket_path);
+		return EX_USAGE;
+	}
+	
+	signal(SIGPIPE, SIG_IGN);
+	
+	struct Master master;
+	memset(&master, 0, sizeof(master));
+	
+	master.pool_size = pool_size;
+	
+	master.listener = socket(AF_UNIX, (SOCK_STREAM | SOCK_CLOEXEC), 0);
+	if(master.listener < 0)
+	{
+		perror("socket");
+		return EX_OSERR;
+	}
+	
+	/* Replace the socket left behind by a previous master. */
+	unlink(socket_path);
+	
+	if(bind(master.listener, (struct sockaddr*)(&sun), sizeof(sun)) != 0 || listen(master.listener, 16) != 0)
+	{
+		fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+		return EX_OSERR;
+	}
+	
+	fprintf(stderr, "Master listening on %s\n", socket_path);
+	
+	while(1)
+	{
+		/* Wait for clients, connections completing and for the server closing
+		 * any of the connections we are holding.
+		*/
+		
+		size_t max_fds = 1 + (master.num_hosts * (pool_size + 1));
+		
+		struct pollfd *fds = malloc(max_fds * sizeof(*fds));
+		assert(fds != NULL);
+		
+		size_t num_fds = 0;
+		
+		fds[num_fds].fd = master.listener;
+		fds[num_fds].events = POLLIN;
+		++num_fds;
+		
+		for(size_t h = 0; h < master.num_hosts; ++h)
+		{
+			struct PoolHost *host = &(master.hosts[h]);
+			
+			if(host->connecting >= 0)
+			{
+				fds[num_fds].fd = host->connecting;
+				fds[num_fds].events = POLLOUT;
+				++num_fds;
+			}
+			
+			for(size_t r = 0; r < host->num_ready; ++r)
+			{
+				fds[num_fds].fd = host->ready[r];
+				fds[num_fds].events = POLLIN | POLLRDHUP;
+				++num_fds;
+			}
+		}
+		
+		if(poll(fds, num_fds, -1) < 0)
+		{
+			free(fds);
+			
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			
+			perror("poll");
+			return EX_OSERR;
+		}
+		
+		/* Handle events in the same order the array was built, before anything
+		 * is added or removed.
+		*/
+		
+		size_t f = 1;
+		
+		for(size_t h = 0; h < master.num_hosts; ++h)
+		{
+			struct PoolHost *host = &(master.hosts[h]);
+			
+			bool connected = host->connecting >= 0 && fds[f++].revents != 0;
+			
+			/* Idle connections should never become readable, if one does then
+			 * the server has dropped it.
+			*/
+			
+			size_t num_ready = host->num_ready;
+			
+			for(size_t r = 0, i = 0; r < num_ready; ++r, ++f)
+			{
+				if(fds[f].revents != 0)
+				{
+					pool_discard(host, i);
+				}
+				else{
+					++i;
+				}
+			}
+			
+			/* Only once the ready connections polled above are done with, as
+			 * this adds another which has no entry in fds.
+			*/
+			
+			if(connected)
+			{
+				pool_connected(host, pool_size);
+			}
+			
+			pool_refill(host, pool_size);
+		}
+		
+		bool client_waiting = (fds[0].revents & POLLIN) != 0;
+		
+		free(fds);
+		
+		if(client_waiting)
+		{
+			master_client(&master);
+		}
+	}
+}
+
+int master_request(const char *socket_path, const struct sockaddr_in *addr)
+{
+	struct sockaddr_un sun;
+	
+	if(!unix_addr(&sun, socket_path))
+	{
+		return -1;
+	}
+	
+	int sock = socket(AF_UNIX, (SOCK_STREAM | SOCK_CLOEXEC), 0);
+	if(sock < 0)
+	{
+		return -1;
+	}
+	
+	struct timeval timeout = { (REQUEST_TIMEOUT_MS / 1000), ((REQUEST_TIMEOUT_MS % 1000) * 1000) };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	
+	if(connect(sock, (struct sockaddr*)(&sun), sizeof(sun)) != 0
+		|| send(sock, addr, sizeof(*addr), MSG_NOSIGNAL) != sizeof(*addr))
+	{
+		close(sock);
+		return -1;
+	}
+	
+	/* The reply is a single byte, carrying the connection if there is one. */
+	
+	char status;
+	struct iovec iov = { &status, 1 };
+	
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	
+	ssize_t r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	
+	close(sock);
+	
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	
+	if(r != 1 || status != 'Y' || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	{
+		return -1;
+	}
+	
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	
+	/* The master's connections are non-blocking. */
+	fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL) & ~O_NONBLOCK));
+	
+	return fd;
+}
+
+static bool unix_addr(struct sockaddr_un *sun, const char *socket_path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	
+	if(strlen(socket_path) >= sizeof(sun->sun_path))
+	{
+		return false;
+	}
+	
+	strcpy(sun->sun_path, socket_path);
+	
+	return true;
+}
+
+/* Accepts a client and hands over a ready connection to the host it asks for,
+ * if there is one.
+*/
+static void master_client(struct Master *master)
+{
+	int client = accept4(master->listener, NULL, NULL, SOCK_CLOEXEC);
+	if(client < 0)
+	{
+		return;
+	}
+	
+	/* Clients send their request straight after connecting, don't let one which
+	 * doesn't hold everyone else up.
+	*/
+	
+	struct timeval timeout = { (REQUEST_TIMEOUT_MS / 1000), ((REQUEST_TIMEOUT_MS % 1000) * 1000) };
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	
+	struct sockaddr_in addr;
+	
+	if(recv(client, &addr, sizeof(addr), MSG_WAITALL) != sizeof(addr) || addr.sin_family != AF_INET)
+	{
+		close(client);
+		return;
+	}
+	
+	struct PoolHost *host = pool_find(master, &addr);
+	
+	char status = 'N';
+	struct iovec iov = { &status, 1 };
+	
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	
+	int fd = -1;
+	
+	if(host->num_ready > 0)
+	{
+		/* Oldest connection first. */
+		
+		fd = host->ready[0];
+		
+		--(host->num_ready);
+		memmove(host->ready, (host->ready + 1), (host->num_ready * sizeof(*(host->ready))));
+		
+		status = 'Y';
+		
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	}
+	
+	sendmsg(client, &msg, MSG_NOSIGNAL);
+	
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+	
+	close(client);
+	
+	host->failed = false;
+	pool_refill(host, master->pool_size);
+}
+
+/* Returns the pool for a host, creating it if this is the first request. */
+static struct PoolHost *pool_find(struct Master *master, const struct sockaddr_in *addr)
+{
+	for(size_t h = 0; h < master->num_hosts; ++h)
+	{
+		if(master->hosts[h].addr.sin_addr.s_addr == addr->sin_addr.s_addr && master->hosts[h].addr.sin_port == addr->sin_port)
+		{
+			return &(master->hosts[h]);
+		}
+	}
+	
+	if(master->num_hosts == master->hosts_size)
+	{
+		master->hosts_size = master->hosts_size > 0 ? (master->hosts_size * 2) : 8;
+		
+		master->hosts = realloc(master->hosts, (master->hosts_size * sizeof(*(master->hosts))));
+		assert(master->hosts != NULL);
+	}
+	
+	struct PoolHost *host = &(master->hosts[master->num_hosts++]);
+	
+	host->addr = *addr;
+	host->num_ready = 0;
+	host->connecting = -1;
+	host->failed = false;
+	
+	host->ready = malloc(master->pool_size * sizeof(*(host->ready)));
+	assert(host->ready != NULL);
+	
+	return host;
+}
+
+/* Starts connecting another connection if the pool isn't full. One connection
+ * is established at a time.
+*/
+static void pool_refill(struct PoolHost *host, int pool_size)
+{
+	if(host->connecting >= 0 || host->failed || host->num_ready >= (size_t)(pool_size))
+	{
+		return;
+	}
+	
+	host->connecting = socket(AF_INET, (SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC), 0);
+	if(host->connecting < 0)
+	{
+		perror("socket");
+		return;
+	}
+	
+	if(connect(host->connecting, (struct sockaddr*)(&(host->addr)), sizeof(host->addr)) != 0 && errno != EINPROGRESS)
+	{
+		fprintf(stderr, "Unable to connect to %s:%d: %s\n",
+			inet_ntoa(host->addr.sin_addr), ntohs(host->addr.sin_port), strerror(errno));
+		
+		close(host->connecting);
+		host->connecting = -1;
+		host->failed = true;
+	}
+}
+
+static void pool_connected(struct PoolHost *host, int pool_size)
+{
+	int error = 0;
+	socklen_t error_len = sizeof(error);
+	
+	getsockopt(host->connecting, SOL_SOCKET, SO_ERROR, &error, &error_len);
+	
+	if(error != 0)
+	{
+		fprintf(stderr, "Unable to connect to %s:%d: %s\n",
+			inet_ntoa(host->addr.sin_addr), ntohs(host->addr.sin_port), strerror(error));
+		
+		close(host->connecting);
+		host->failed = true;
+	}
+	else{
+		assert(host->num_ready < (size_t)(pool_size));
+		host->ready[host->num_ready++] = host->connecting;
+	}
+	
+	host->connecting = -1;
+}
+
+static void pool_discard(struct PoolHost *host, size_t ready_idx)
+{
+	close(host->ready[ready_idx]);
+	
+	--(host->num_ready);
+	memmove((host->ready + ready_idx), (host->ready + ready_idx + 1), ((host->num_ready - ready_idx) * sizeof(*(host->ready))));
+}
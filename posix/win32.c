@@ -0,0 +1,1630 @@
+/* ice9d - Remote command execution server for Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE /* accept4(), pipe2() */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "win32.h"
+
+/* How often processes are polled for exit when pidfds aren't available. */
+#define PROCESS_POLL_MS 10
+
+/* How long a closed socket is kept around for the peer to finish sending. */
+#define LINGER_MS 2000
+
+enum HandleType
+{
+	HT_FILE = 1,
+	HT_EVENT,
+	HT_PROCESS,
+	HT_THREAD,
+	HT_PIPE_READ_EVENT,
+	HT_PIPE_WRITE_EVENT,
+	
+	/* GetCurrentProcess() and GetStdHandle(), never closed. */
+	HT_PSEUDO,
+};
+
+struct Win32Handle
+{
+	enum HandleType type;
+	
+	/* File descriptor for files, events and processes (pidfd), -1 if none. */
+	int fd;
+	
+	bool manual_reset;
+	
+	pid_t pid;
+	bool reaped;
+	bool terminated;
+	DWORD exit_code;
+	
+	pthread_t thread;
+	
+	struct Pipe9xRead *read_pipe;
+	struct Pipe9xWrite *write_pipe;
+};
+
+struct Pipe9xRead
+{
+	struct Win32Handle pipe;
+	struct Win32Handle event;
+	
+	unsigned char *buf;
+	size_t buf_size;
+};
+
+struct Pipe9xWrite
+{
+	struct Win32Handle pipe;
+	struct Win32Handle event;
+	
+	unsigned char *buf;
+	size_t buf_size;
+	
+	size_t data_size;
+	size_t data_written;
+	
+	bool pending;
+	DWORD error;
+};
+
+/* Socket registered with WSAEventSelect(), indexed by descriptor. */
+struct SocketSelect
+{
+	HANDLE event;
+	long events;
+};
+
+struct ThreadStart
+{
+	LPTHREAD_START_ROUTINE func;
+	LPVOID param;
+};
+
+static __thread DWORD last_error;
+
+static struct SocketSelect *selects;
+static size_t selects_size;
+
+/* Processes whose handles were closed before they could be reaped. */
+static pid_t *orphans;
+static size_t num_orphans;
+
+/* Sockets closed with data possibly still on the way from the peer, which
+ * would be answered with a reset discarding whatever we last sent it if they
+ * were closed outright. Windows closes gracefully.
+*/
+struct Lingering
+{
+	int sock;
+	int64_t deadline;
+};
+
+static struct Lingering *lingering;
+static size_t num_lingering;
+
+static struct Win32Handle current_process = { HT_PSEUDO, -1 };
+static struct Win32Handle std_handles[3] = {
+	{ HT_PSEUDO, STDIN_FILENO },
+	{ HT_PSEUDO, STDOUT_FILENO },
+	{ HT_PSEUDO, STDERR_FILENO },
+};
+
+static DWORD error_from_errno(int error);
+static HANDLE handle_new(enum HandleType type, int fd);
+static int64_t monotonic_ms(void);
+static bool process_reap(HANDLE process, bool wait);
+static bool process_exited(HANDLE process);
+static void orphans_reap(void);
+static void lingering_drain(void);
+static bool pipe_write_continue(struct Pipe9xWrite *pipe);
+static void *pipe_write_drain(void *param);
+static char **command_line_split(const char *command_line);
+static void *thread_main(void *param);
+
+static DWORD error_from_errno(int error)
+{
+	switch(error)
+	{
+		case 0:       return ERROR_SUCCESS;
+		case ENOENT:  return ERROR_FILE_NOT_FOUND;
+		case ENOTDIR: return ERROR_PATH_NOT_FOUND;
+		case EACCES:
+		case EPERM:   return ERROR_ACCESS_DENIED;
+		case EBADF:   return ERROR_INVALID_HANDLE;
+		case ENOMEM:  return ERROR_NOT_ENOUGH_MEMORY;
+		case EEXIST:  return ERROR_FILE_EXISTS;
+		case EINVAL:  return ERROR_INVALID_PARAMETER;
+		case EPIPE:   return ERROR_BROKEN_PIPE;
+		case ENOSPC:  return ERROR_DISK_FULL;
+		
+		/* Anything else is passed through as-is, it can be looked up in errno.h
+		 * if it ever appears in the log.
+		*/
+		default:      return error;
+	}
+}
+
+static HANDLE handle_new(enum HandleType type, int fd)
+{
+	HANDLE handle = calloc(1, sizeof(struct Win32Handle));
+	if(handle == NULL)
+	{
+		last_error = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	
+	handle->type = type;
+	handle->fd = fd;
+	
+	return handle;
+}
+
+static int64_t monotonic_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return ((int64_t)(now.tv_sec) * 1000) + (now.tv_nsec / 1000000);
+}
+
+DWORD GetLastError(void)
+{
+	return last_error;
+}
+
+DWORD GetTickCount(void)
+{
+	return (DWORD)(monotonic_ms());
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	count->QuadPart = ((int64_t)(now.tv_sec) * 1000000000) + now.tv_nsec;
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+{
+	frequency->QuadPart = 1000000000;
+	return TRUE;
+}
+
+void GlobalMemoryStatus(MEMORYSTATUS *status)
+{
+	memset(status, 0, sizeof(*status));
+	status->dwLength = sizeof(*status);
+	
+	struct sysinfo info;
+	if(sysinfo(&info) == 0)
+	{
+		status->dwTotalPhys = (SIZE_T)(info.totalram) * info.mem_unit;
+		status->dwAvailPhys = (SIZE_T)(info.freeram + info.bufferram) * info.mem_unit;
+		
+		if(status->dwTotalPhys > 0)
+		{
+			status->dwMemoryLoad = 100 - (DWORD)((status->dwAvailPhys * 100) / status->dwTotalPhys);
+		}
+	}
+	
+	/* There is no fixed address space to report the free part of, so the total
+	 * is just what we have mapped - only the difference is used by ice9d.
+	*/
+	
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if(statm != NULL)
+	{
+		unsigned long pages;
+		if(fscanf(statm, "%lu", &pages) == 1)
+		{
+			status->dwTotalVirtual = (SIZE_T)(pages) * sysconf(_SC_PAGESIZE);
+		}
+		
+		fclose(statm);
+	}
+}
+
+DWORD GetTempPath(DWORD size, char *buf)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	if(tmpdir == NULL || tmpdir[0] == '\0')
+	{
+		tmpdir = "/tmp";
+	}
+	
+	size_t length = strlen(tmpdir);
+	bool slash = tmpdir[length - 1] != '/';
+	
+	if((length + slash + 1) > size)
+	{
+		/* Windows returns the size required, including the terminator. */
+		return length + slash + 1;
+	}
+	
+	snprintf(buf, size, "%s%s", tmpdir, (slash ? "/" : ""));
+	return length + slash;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+	if(handle == NULL || handle == INVALID_HANDLE_VALUE)
+	{
+		last_error = ERROR_INVALID_HANDLE;
+		return FALSE;
+	}
+	
+	switch(handle->type)
+	{
+		case HT_PSEUDO:
+			return TRUE;
+			
+		case HT_PIPE_READ_EVENT:
+		case HT_PIPE_WRITE_EVENT:
+			/* Owned by the pipe9x handle. */
+			last_error = ERROR_INVALID_HANDLE;
+			return FALSE;
+			
+		case HT_PROCESS:
+			if(!process_reap(handle, false))
+			{
+				pid_t *new_orphans = realloc(orphans, (num_orphans + 1) * sizeof(*orphans));
+				if(new_orphans != NULL)
+				{
+					orphans = new_orphans;
+					orphans[num_orphans++] = handle->pid;
+				}
+			}
+			
+			break;
+			
+		case HT_THREAD:
+			pthread_detach(handle->thread);
+			break;
+			
+		default:
+			break;
+	}
+	
+	if(handle->fd >= 0)
+	{
+		close(handle->fd);
+	}
+	
+	free(handle);
+	
+	return TRUE;
+}
+
+HANDLE GetCurrentProcess(void)
+{
+	return &current_process;
+}
+
+HANDLE GetStdHandle(DWORD which)
+{
+	switch(which)
+	{
+		case STD_INPUT_HANDLE:  return &(std_handles[0]);
+		case STD_OUTPUT_HANDLE: return &(std_handles[1]);
+		case STD_ERROR_HANDLE:  return &(std_handles[2]);
+		
+		default:
+			last_error = ERROR_INVALID_PARAMETER;
+			return INVALID_HANDLE_VALUE;
+	}
+}
+
+BOOL DuplicateHandle(HANDLE source_process, HANDLE source, HANDLE target_process, HANDLE *target, DWORD access, BOOL inherit, DWORD options)
+{
+	/* Inheritance is decided when the handle is given to CreateProcess(). */
+	
+	if(source->fd < 0)
+	{
+		last_error = ERROR_INVALID_HANDLE;
+		return FALSE;
+	}
+	
+	int fd = fcntl(source->fd, F_DUPFD_CLOEXEC, 0);
+	if(fd < 0)
+	{
+		last_error = error_from_errno(errno);
+		return FALSE;
+	}
+	
+	*target = handle_new(HT_FILE, fd);
+	if(*target == NULL)
+	{
+		close(fd);
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+HANDLE CreateFile(const char *path, DWORD access, DWORD share, SECURITY_ATTRIBUTES *sa, DWORD disposition, DWORD attributes, HANDLE template_file)
+{
+	int flags = O_CLOEXEC;
+	
+	if((access & GENERIC_READ) && (access & GENERIC_WRITE))
+	{
+		flags |= O_RDWR;
+	}
+	else if(access & GENERIC_WRITE)
+	{
+		flags |= O_WRONLY;
+	}
+	else{
+		flags |= O_RDONLY;
+	}
+	
+	switch(disposition)
+	{
+		case CREATE_NEW:        flags |= O_CREAT | O_EXCL;  break;
+		case CREATE_ALWAYS:     flags |= O_CREAT | O_TRUNC; break;
+		case OPEN_ALWAYS:       flags |= O_CREAT;           break;
+		case TRUNCATE_EXISTING: flags |= O_TRUNC;           break;
+		default:                                            break;
+	}
+	
+	if(strcasecmp(path, "NUL") == 0)
+	{
+		path = "/dev/null";
+	}
+	
+	int fd = open(path, flags, 0666);
+	if(fd < 0)
+	{
+		last_error = error_from_errno(errno);
+		return INVALID_HANDLE_VALUE;
+	}
+	
+	HANDLE handle = handle_new(HT_FILE, fd);
+	if(handle == NULL)
+	{
+		close(fd);
+		return INVALID_HANDLE_VALUE;
+	}
+	
+	return handle;
+}
+
+BOOL WriteFile(HANDLE file, const void *buf, DWORD size, DWORD *written, void *overlapped)
+{
+	*written = 0;
+	
+	while(*written < size)
+	{
+		ssize_t w = write(file->fd, ((const char*)(buf) + *written), (size - *written));
+		if(w < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			
+			last_error = error_from_errno(errno);
+			return FALSE;
+		}
+		
+		*written += w;
+	}
+	
+	return TRUE;
+}
+
+DWORD SetFilePointer(HANDLE file, LONG distance, LONG *distance_high, DWORD method)
+{
+	int whence = (method == FILE_END ? SEEK_END : (method == FILE_CURRENT ? SEEK_CUR : SEEK_SET));
+	
+	off_t offset = distance;
+	if(distance_high != NULL)
+	{
+		offset = (off_t)(((uint64_t)(uint32_t)(*distance_high) << 32) | (uint32_t)(distance));
+	}
+	
+	offset = lseek(file->fd, offset, whence);
+	if(offset < 0)
+	{
+		last_error = error_from_errno(errno);
+		return 0xFFFFFFFF;
+	}
+	
+	if(distance_high != NULL)
+	{
+		*distance_high = (LONG)((uint64_t)(offset) >> 32);
+	}
+	
+	return (DWORD)(offset);
+}
+
+DWORD GetFileAttributes(const char *path)
+{
+	struct stat st;
+	if(stat(path, &st) != 0)
+	{
+		last_error = error_from_errno(errno);
+		return INVALID_FILE_ATTRIBUTES;
+	}
+	
+	return S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+}
+
+BOOL DeleteFile(const char *path)
+{
+	if(unlink(path) != 0)
+	{
+		last_error = error_from_errno(errno);
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+BOOL CreatePipe(HANDLE *read_pipe, HANDLE *write_pipe, SECURITY_ATTRIBUTES *sa, DWORD size)
+{
+	int fds[2];
+	if(pipe2(fds, O_CLOEXEC) != 0)
+	{
+		last_error = error_from_errno(errno);
+		return FALSE;
+	}
+	
+	*read_pipe = handle_new(HT_FILE, fds[0]);
+	*write_pipe = handle_new(HT_FILE, fds[1]);
+	
+	if(*read_pipe == NULL || *write_pipe == NULL)
+	{
+		free(*read_pipe);
+		free(*write_pipe);
+		
+		close(fds[0]);
+		close(fds[1]);
+		
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+HANDLE CreateEvent(SECURITY_ATTRIBUTES *sa, BOOL manual_reset, BOOL initial_state, const char *name)
+{
+	int fd = eventfd((initial_state ? 1 : 0), (EFD_CLOEXEC | EFD_NONBLOCK));
+	if(fd < 0)
+	{
+		last_error = error_from_errno(errno);
+		return NULL;
+	}
+	
+	HANDLE event = handle_new(HT_EVENT, fd);
+	if(event == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+	
+	event->manual_reset = manual_reset;
+	
+	return event;
+}
+
+BOOL SetEvent(HANDLE event)
+{
+	uint64_t one = 1;
+	
+	if(write(event->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	{
+		last_error = error_from_errno(errno);
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD timeout)
+{
+	if(handle->type != HT_EVENT)
+	{
+		return WaitForMultipleObjects(1, &handle, FALSE, timeout);
+	}
+	
+	/* Events are waited on from the logging thread, which mustn't look at the
+	 * socket table the main thread is modifying.
+	*/
+	
+	struct pollfd pfd = { handle->fd, POLLIN, 0 };
+	
+	while(true)
+	{
+		int result = poll(&pfd, 1, (timeout == INFINITE ? -1 : (int)(timeout)));
+		
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if(result < 0)
+		{
+			last_error = error_from_errno(errno);
+			return WAIT_FAILED;
+		}
+		else if(result == 0)
+		{
+			return WAIT_TIMEOUT;
+		}
+		
+		uint64_t count;
+		
+		if(handle->manual_reset || read(handle->fd, &count, sizeof(count)) == sizeof(count))
+		{
+			return WAIT_OBJECT_0;
+		}
+		
+		/* Lost a race with another waiter for an auto-reset event. */
+	}
+}
+
+/* Waits for any one of the handles to become signalled, returning the lowest
+ * index among those which are, like Windows does.
+ *
+ * Only waiting for any handle is supported, not all of them.
+*/
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL wait_all, DWORD timeout)
+{
+	assert(!wait_all);
+	
+	int64_t deadline = (timeout == INFINITE ? -1 : (monotonic_ms() + timeout));
+	
+	struct pollfd *pfds = NULL;
+	size_t pfds_size = 0;
+	
+	/* Index of the first pollfd belonging to each handle, and one past the last. */
+	size_t *first = malloc((count + 1) * sizeof(size_t));
+	
+	DWORD result = WAIT_FAILED;
+	
+	if(first == NULL)
+	{
+		last_error = ERROR_NOT_ENOUGH_MEMORY;
+		return WAIT_FAILED;
+	}
+	
+	orphans_reap();
+	
+	while(true)
+	{
+		lingering_drain();
+		
+		size_t num_pfds = 0;
+		bool signalled = false;
+		bool process_poll = false;
+		
+		for(DWORD i = 0; i < count; ++i)
+		{
+			HANDLE handle = handles[i];
+			first[i] = num_pfds;
+			
+			/* Worst case for this handle is its own descriptor plus every socket. */
+			
+			size_t needed = num_pfds + 1 + (handle->type == HT_EVENT ? selects_size : 0);
+			
+			if(needed > pfds_size)
+			{
+				struct pollfd *new_pfds = realloc(pfds, needed * sizeof(*pfds));
+				if(new_pfds == NULL)
+				{
+					last_error = ERROR_NOT_ENOUGH_MEMORY;
+					goto OUT;
+				}
+				
+				pfds = new_pfds;
+				pfds_size = needed;
+			}
+			
+			switch(handle->type)
+			{
+				case HT_EVENT:
+					pfds[num_pfds++] = (struct pollfd){ handle->fd, POLLIN, 0 };
+					
+					for(size_t s = 0; s < selects_size; ++s)
+					{
+						if(selects[s].event == handle && selects[s].events != 0)
+						{
+							short events = 0;
+							
+							if(selects[s].events & (FD_READ | FD_ACCEPT | FD_CLOSE))
+							{
+								events |= POLLIN;
+							}
+							
+							if(selects[s].events & FD_WRITE)
+							{
+								events |= POLLOUT;
+							}
+							
+							pfds[num_pfds++] = (struct pollfd){ (int)(s), events, 0 };
+						}
+					}
+					
+					break;
+					
+				case HT_PROCESS:
+					if(handle->fd >= 0)
+					{
+						pfds[num_pfds++] = (struct pollfd){ handle->fd, POLLIN, 0 };
+					}
+					else if(process_exited(handle))
+					{
+						signalled = true;
+					}
+					else{
+						process_poll = true;
+					}
+					
+					break;
+					
+				case HT_PIPE_READ_EVENT:
+					pfds[num_pfds++] = (struct pollfd){ handle->read_pipe->pipe.fd, POLLIN, 0 };
+					break;
+					
+				case HT_PIPE_WRITE_EVENT:
+					if(handle->write_pipe->data_written < handle->write_pipe->data_size && handle->write_pipe->error == ERROR_SUCCESS)
+					{
+						pfds[num_pfds++] = (struct pollfd){ handle->write_pipe->pipe.fd, POLLOUT, 0 };
+					}
+					else{
+						signalled = true;
+					}
+					
+					break;
+					
+				default:
+					last_error = ERROR_INVALID_HANDLE;
+					goto OUT;
+			}
+		}
+		
+		first[count] = num_pfds;
+		
+		if((num_pfds + num_lingering) > pfds_size)
+		{
+			struct pollfd *new_pfds = realloc(pfds, (num_pfds + num_lingering) * sizeof(*pfds));
+			if(new_pfds == NULL)
+			{
+				last_error = ERROR_NOT_ENOUGH_MEMORY;
+				goto OUT;
+			}
+			
+			pfds = new_pfds;
+			pfds_size = num_pfds + num_lingering;
+		}
+		
+		int64_t linger_deadline = -1;
+		
+		for(size_t l = 0; l < num_lingering; ++l)
+		{
+			pfds[num_pfds++] = (struct pollfd){ lingering[l].sock, POLLIN, 0 };
+			
+			if(linger_deadline < 0 || lingering[l].deadline < linger_deadline)
+			{
+				linger_deadline = lingering[l].deadline;
+			}
+		}
+		
+		int poll_timeout = -1;
+		
+		if(signalled)
+		{
+			poll_timeout = 0;
+		}
+		else if(deadline >= 0)
+		{
+			int64_t remaining = deadline - monotonic_ms();
+			poll_timeout = remaining > 0 ? (int)(remaining) : 0;
+		}
+		
+		if(process_poll && (poll_timeout < 0 || poll_timeout > PROCESS_POLL_MS))
+		{
+			poll_timeout = PROCESS_POLL_MS;
+		}
+		
+		if(linger_deadline >= 0)
+		{
+			int64_t remaining = linger_deadline - monotonic_ms();
+			
+			if(remaining < 0)
+			{
+				remaining = 0;
+			}
+			
+			if(poll_timeout < 0 || remaining < poll_timeout)
+			{
+				poll_timeout = remaining;
+			}
+		}
+		
+		if(poll(pfds, num_pfds, poll_timeout) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			
+			last_error = error_from_errno(errno);
+			goto OUT;
+		}
+		
+		for(DWORD i = 0; i < count; ++i)
+		{
+			HANDLE handle = handles[i];
+			bool ready = false;
+			
+			for(size_t p = first[i]; p < first[i + 1]; ++p)
+			{
+				if(pfds[p].revents != 0)
+				{
+					ready = true;
+				}
+			}
+			
+			if(handle->type == HT_EVENT && pfds[first[i]].revents != 0 && !handle->manual_reset)
+			{
+				uint64_t value;
+				
+				if(read(handle->fd, &value, sizeof(value)) != sizeof(value))
+				{
+					/* Somebody else reset it first, we may still have a socket. */
+					
+					ready = false;
+					
+					for(size_t p = (first[i] + 1); p < first[i + 1]; ++p)
+					{
+						if(pfds[p].revents != 0)
+						{
+							ready = true;
+						}
+					}
+				}
+			}
+			else if(handle->type == HT_PROCESS && handle->fd < 0)
+			{
+				ready = process_exited(handle);
+			}
+			else if(handle->type == HT_PIPE_WRITE_EVENT)
+			{
+				/* Keep writing as the pipe drains, only signalled once it's all gone. */
+				
+				ready = pipe_write_continue(handle->write_pipe);
+			}
+			
+			if(ready)
+			{
+				result = WAIT_OBJECT_0 + i;
+				goto OUT;
+			}
+		}
+		
+		if(deadline >= 0 && monotonic_ms() >= deadline)
+		{
+			result = WAIT_TIMEOUT;
+			goto OUT;
+		}
+	}
+	
+	OUT:
+	
+	free(pfds);
+	free(first);
+	
+	return result;
+}
+
+static void *thread_main(void *param)
+{
+	struct ThreadStart start = *(struct ThreadStart*)(param);
+	free(param);
+	
+	start.func(start.param);
+	
+	return NULL;
+}
+
+HANDLE CreateThread(SECURITY_ATTRIBUTES *sa, SIZE_T stack_size, LPTHREAD_START_ROUTINE func, LPVOID param, DWORD flags, DWORD *thread_id)
+{
+	struct ThreadStart *start = malloc(sizeof(struct ThreadStart));
+	HANDLE thread = handle_new(HT_THREAD, -1);
+	
+	if(start == NULL || thread == NULL)
+	{
+		free(start);
+		free(thread);
+		
+		last_error = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	
+	start->func = func;
+	start->param = param;
+	
+	int error = pthread_create(&(thread->thread), NULL, &thread_main, start);
+	if(error != 0)
+	{
+		free(start);
+		free(thread);
+		
+		last_error = error_from_errno(error);
+		return NULL;
+	}
+	
+	if(thread_id != NULL)
+	{
+		*thread_id = 0;
+	}
+	
+	return thread;
+}
+
+/* Splits a command line into arguments the way the Microsoft C runtime does,
+ * which is how ice9r quotes them.
+ *
+ *   - Arguments are separated by unquoted spaces or tabs.
+ *   - Double quotes toggle quoting and are removed.
+ *   - 2n backslashes followed by a quote produce n backslashes, 2n+1 produce
+ *     n backslashes and a literal quote. Other backslashes are literal.
+*/
+static char **command_line_split(const char *command_line)
+{
+	size_t length = strlen(command_line);
+	
+	/* No more arguments than half the characters, plus the terminating NULL. */
+	char **argv = calloc((length / 2) + 2, sizeof(char*));
+	char *buf = malloc(length + 1);
+	
+	if(argv == NULL || buf == NULL)
+	{
+		free(argv);
+		free(buf);
+		
+		return NULL;
+	}
+	
+	size_t argc = 0;
+	char *out = buf;
+	
+	const char *p = command_line;
+	
+	while(true)
+	{
+		while(*p == ' ' || *p == '\t')
+		{
+			++p;
+		}
+		
+		if(*p == '\0')
+		{
+			break;
+		}
+		
+		argv[argc++] = out;
+		bool quoted = false;
+		
+		while(*p != '\0' && (quoted || (*p != ' ' && *p != '\t')))
+		{
+			if(*p == '\\')
+			{
+				size_t backslashes = 0;
+				
+				while(*p == '\\')
+				{
+					++backslashes;
+					++p;
+				}
+				
+				if(*p == '"')
+				{
+					for(size_t i = 0; i < (backslashes / 2); ++i)
+					{
+						*(out++) = '\\';
+					}
+					
+					if(backslashes % 2)
+					{
+						*(out++) = '"';
+						++p;
+					}
+				}
+				else{
+					for(size_t i = 0; i < backslashes; ++i)
+					{
+						*(out++) = '\\';
+					}
+				}
+			}
+			else if(*p == '"')
+			{
+				quoted = !quoted;
+				++p;
+			}
+			else{
+				*(out++) = *(p++);
+			}
+		}
+		
+		*(out++) = '\0';
+	}
+	
+	if(argc == 0)
+	{
+		/* Keep buf reachable for the caller to free. */
+		argv[0] = buf;
+		argv[1] = NULL;
+		
+		buf[0] = '\0';
+	}
+	
+	return argv;
+}
+
+BOOL CreateProcess(const char *application_path, char *command_line, SECURITY_ATTRIBUTES *process_sa, SECURITY_ATTRIBUTES *thread_sa,
+	BOOL inherit_handles, DWORD flags, LPVOID environment, const char *working_directory, STARTUPINFO *si, PROCESS_INFORMATION *pi)
+{
+	char **argv = command_line_split(command_line != NULL ? command_line : application_path);
+	if(argv == NULL)
+	{
+		last_error = ERROR_NOT_ENOUGH_MEMORY;
+		return FALSE;
+	}
+	
+	if(application_path == NULL)
+	{
+		application_path = argv[0];
+	}
+	
+	HANDLE process = handle_new(HT_PROCESS, -1);
+	HANDLE thread = handle_new(HT_FILE, -1);
+	
+	/* The child reports a failure to exec through this pipe, which is closed
+	 * without anything being written if it succeeds.
+	*/
+	
+	int status_pipe[2] = { -1, -1 };
+	
+	if(process == NULL || thread == NULL || pipe2(status_pipe, O_CLOEXEC) != 0)
+	{
+		last_error = (process == NULL || thread == NULL) ? ERROR_NOT_ENOUGH_MEMORY : error_from_errno(errno);
+		goto FAIL;
+	}
+	
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		last_error = error_from_errno(errno);
+		goto FAIL;
+	}
+	else if(pid == 0)
+	{
+		/* SIGPIPE is ignored by WSAStartup() and the disposition would otherwise
+		 * carry over into the child.
+		*/
+		
+		signal(SIGPIPE, SIG_DFL);
+		
+		if(si->dwFlags & STARTF_USESTDHANDLES)
+		{
+			/* Move the handles clear of 0-2 first so none of them get clobbered. */
+			
+			HANDLE std[3] = { si->hStdInput, si->hStdOutput, si->hStdError };
+			int fds[3];
+			
+			for(int i = 0; i < 3; ++i)
+			{
+				fds[i] = (std[i] != NULL && std[i] != INVALID_HANDLE_VALUE) ? fcntl(std[i]->fd, F_DUPFD_CLOEXEC, 3) : -1;
+			}
+			
+			for(int i = 0; i < 3; ++i)
+			{
+				if(fds[i] >= 0)
+				{
+					dup2(fds[i], i);
+				}
+			}
+		}
+		
+		if(working_directory == NULL || chdir(working_directory) == 0)
+		{
+			execv(application_path, argv);
+		}
+		
+		int error = errno;
+		if(write(status_pipe[1], &error, sizeof(error))) {}
+		
+		_exit(127);
+	}
+	
+	close(status_pipe[1]);
+	status_pipe[1] = -1;
+	
+	int child_error;
+	ssize_t r;
+	
+	while((r = read(status_pipe[0], &child_error, sizeof(child_error))) < 0 && errno == EINTR) {}
+	
+	close(status_pipe[0]);
+	status_pipe[0] = -1;
+	
+	if(r == sizeof(child_error))
+	{
+		waitpid(pid, NULL, 0);
+		
+		last_error = error_from_errno(child_error);
+		goto FAIL;
+	}
+	
+	process->pid = pid;
+
+#ifdef SYS_pidfd_open
+	process->fd = syscall(SYS_pidfd_open, pid, 0);
+	if(process->fd >= 0)
+	{
+		fcntl(process->fd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	
+	free(argv[0]);
+	free(argv);
+	
+	pi->hProcess = process;
+	pi->hThread = thread;
+	pi->dwProcessId = pid;
+	pi->dwThreadId = 0;
+	
+	return TRUE;
+	
+	FAIL:
+	
+	if(status_pipe[0] >= 0)
+	{
+		close(status_pipe[0]);
+	}
+	
+	if(status_pipe[1] >= 0)
+	{
+		close(status_pipe[1]);
+	}
+	
+	free(process);
+	free(thread);
+	
+	free(argv[0]);
+	free(argv);
+	
+	return FALSE;
+}
+
+/* Reaps the process if it has exited, optionally waiting for it. Returns true
+ * once it has been reaped.
+*/
+static bool process_reap(HANDLE process, bool wait)
+{
+	if(process->reaped)
+	{
+		return true;
+	}
+	
+	int status;
+	pid_t result;
+	
+	while((result = waitpid(process->pid, &status, (wait ? 0 : WNOHANG))) < 0 && errno == EINTR) {}
+	
+	if(result != process->pid)
+	{
+		return false;
+	}
+	
+	process->reaped = true;
+	
+	if(process->terminated)
+	{
+		/* exit_code was set by TerminateProcess(). */
+	}
+	else if(WIFEXITED(status))
+	{
+		process->exit_code = WEXITSTATUS(status);
+	}
+	else{
+		/* Killed by a signal, report it like a shell would. */
+		process->exit_code = 128 + WTERMSIG(status);
+	}
+	
+	return true;
+}
+
+/* Checks whether the process has exited without reaping it. */
+static bool process_exited(HANDLE process)
+{
+	if(process->reaped)
+	{
+		return true;
+	}
+	
+	siginfo_t info;
+	info.si_pid = 0;
+	
+	return waitid(P_PID, process->pid, &info, (WEXITED | WNOHANG | WNOWAIT)) == 0 && info.si_pid == process->pid;
+}
+
+static void orphans_reap(void)
+{
+	for(size_t i = 0; i < num_orphans;)
+	{
+		if(waitpid(orphans[i], NULL, WNOHANG) != 0)
+		{
+			orphans[i] = orphans[--num_orphans];
+		}
+		else{
+			++i;
+		}
+	}
+}
+
+BOOL TerminateProcess(HANDLE process, DWORD exit_code)
+{
+	if(process->reaped || process_exited(process))
+	{
+		/* Already gone, as far as Windows is concerned too. */
+		last_error = ERROR_ACCESS_DENIED;
+		return FALSE;
+	}
+	
+	if(kill(process->pid, SIGKILL) != 0)
+	{
+		last_error = error_from_errno(errno);
+		return FALSE;
+	}
+	
+	process->terminated = true;
+	process->exit_code = exit_code;
+	
+	return TRUE;
+}
+
+BOOL GetExitCodeProcess(HANDLE process, DWORD *exit_code)
+{
+	*exit_code = process_reap(process, false) ? process->exit_code : STILL_ACTIVE;
+	return TRUE;
+}
+
+int WSAStartup(WORD version, WSADATA *data)
+{
+	/* Writing to a socket or pipe whose other end has gone away is reported by
+	 * the error from send()/write(), like on Windows.
+	*/
+	
+	signal(SIGPIPE, SIG_IGN);
+	
+	data->wVersion = version;
+	data->wHighVersion = version;
+	
+	return 0;
+}
+
+int WSACleanup(void)
+{
+	return 0;
+}
+
+int WSAGetLastError(void)
+{
+	if(errno == EAGAIN || errno == EWOULDBLOCK)
+	{
+		return WSAEWOULDBLOCK;
+	}
+	
+	return errno;
+}
+
+/* Associates a socket with an event, which WaitForMultipleObjects() will then
+ * consider signalled while the socket is ready for any of the given events.
+ * The socket is made non-blocking, as on Windows.
+*/
+int WSAEventSelect(int sock, WSAEVENT event, long events)
+{
+	if((size_t)(sock) >= selects_size)
+	{
+		size_t new_size = (sock + 1) * 2;
+		
+		struct SocketSelect *new_selects = realloc(selects, new_size * sizeof(*selects));
+		if(new_selects == NULL)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		
+		memset((new_selects + selects_size), 0, ((new_size - selects_size) * sizeof(*selects)));
+		
+		selects = new_selects;
+		selects_size = new_size;
+	}
+	
+	if(selects[sock].event == NULL)
+	{
+		int flags = fcntl(sock, F_GETFL);
+		if(flags < 0 || fcntl(sock, F_SETFL, (flags | O_NONBLOCK)) < 0)
+		{
+			return -1;
+		}
+	}
+	
+	selects[sock].event = event;
+	selects[sock].events = events;
+	
+	return 0;
+}
+
+int closesocket(int sock)
+{
+	if((size_t)(sock) < selects_size)
+	{
+		selects[sock].event = NULL;
+		selects[sock].events = 0;
+	}
+	
+	struct Lingering *new_lingering = realloc(lingering, (num_lingering + 1) * sizeof(*lingering));
+	
+	if(new_lingering != NULL && shutdown(sock, SHUT_WR) == 0)
+	{
+		lingering = new_lingering;
+		lingering[num_lingering++] = (struct Lingering){ sock, (monotonic_ms() + LINGER_MS) };
+		
+		return 0;
+	}
+	
+	if(new_lingering != NULL)
+	{
+		lingering = new_lingering;
+	}
+	
+	return close(sock);
+}
+
+/* Discards anything received on lingering sockets, closing them once the peer
+ * has closed its end or it has taken too long.
+*/
+static void lingering_drain(void)
+{
+	int64_t now = monotonic_ms();
+	
+	for(size_t i = 0; i < num_lingering;)
+	{
+		char buf[4096];
+		ssize_t r;
+		
+		while((r = recv(lingering[i].sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {}
+		
+		if((r < 0 && errno != EAGAIN && errno != EINTR) || r == 0 || now >= lingering[i].deadline)
+		{
+			close(lingering[i].sock);
+			lingering[i] = lingering[--num_lingering];
+		}
+		else{
+			++i;
+		}
+	}
+}
+
+int win32_accept(int sock, struct sockaddr *addr, socklen_t *addrlen)
+{
+	return accept4(sock, addr, addrlen, (SOCK_NONBLOCK | SOCK_CLOEXEC));
+}
+
+int win32_bind(int sock, const struct sockaddr *addr, socklen_t addrlen)
+{
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	
+	return (bind)(sock, addr, addrlen);
+}
+
+/* pipe9x: our end of each pipe is non-blocking, the child's end is left
+ * blocking as any program would expect.
+*/
+
+DWORD pipe9x_create(PipeReadHandle *read_handle, size_t read_size, BOOL read_inherit, PipeWriteHandle *write_handle, size_t write_size, BOOL write_inherit)
+{
+	struct Pipe9xRead *read_pipe = calloc(1, sizeof(struct Pipe9xRead));
+	struct Pipe9xWrite *write_pipe = calloc(1, sizeof(struct Pipe9xWrite));
+	
+	unsigned char *read_buf = malloc(read_size);
+	
+	int fds[2] = { -1, -1 };
+	
+	if(read_pipe == NULL || write_pipe == NULL || read_buf == NULL)
+	{
+		free(read_buf);
+		free(write_pipe);
+		free(read_pipe);
+		
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	
+	if(pipe2(fds, O_CLOEXEC) != 0
+		|| (!read_inherit && fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0)
+		|| (!write_inherit && fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0))
+	{
+		DWORD error = error_from_errno(errno);
+		
+		if(fds[0] >= 0)
+		{
+			close(fds[0]);
+			close(fds[1]);
+		}
+		
+		free(read_buf);
+		free(write_pipe);
+		free(read_pipe);
+		
+		return error;
+	}
+	
+	read_pipe->pipe = (struct Win32Handle){ .type = HT_FILE, .fd = fds[0] };
+	read_pipe->event = (struct Win32Handle){ .type = HT_PIPE_READ_EVENT, .fd = -1, .read_pipe = read_pipe };
+	read_pipe->buf = read_buf;
+	read_pipe->buf_size = read_size;
+	
+	write_pipe->pipe = (struct Win32Handle){ .type = HT_FILE, .fd = fds[1] };
+	write_pipe->event = (struct Win32Handle){ .type = HT_PIPE_WRITE_EVENT, .fd = -1, .write_pipe = write_pipe };
+	
+	*read_handle = read_pipe;
+	*write_handle = write_pipe;
+	
+	return ERROR_SUCCESS;
+}
+
+void pipe9x_read_close(PipeReadHandle handle)
+{
+	close(handle->pipe.fd);
+	
+	free(handle->buf);
+	free(handle);
+}
+
+HANDLE pipe9x_read_pipe(PipeReadHandle handle)
+{
+	return &(handle->pipe);
+}
+
+DWORD pipe9x_read_initiate(PipeReadHandle handle)
+{
+	/* The read itself is done by pipe9x_read_result() once the event says
+	 * there is something to read.
+	*/
+	
+	return ERROR_IO_PENDING;
+}
+
+DWORD pipe9x_read_result(PipeReadHandle handle, void **data, size_t *data_size, BOOL wait)
+{
+	if(wait)
+	{
+		struct pollfd pfd = { handle->pipe.fd, POLLIN, 0 };
+		while(poll(&pfd, 1, -1) < 0 && errno == EINTR) {}
+	}
+	
+	ssize_t r;
+	while((r = read(handle->pipe.fd, handle->buf, handle->buf_size)) < 0 && errno == EINTR) {}
+	
+	if(r > 0)
+	{
+		*data = handle->buf;
+		*data_size = r;
+		
+		return ERROR_SUCCESS;
+	}
+	else if(r == 0)
+	{
+		return ERROR_BROKEN_PIPE;
+	}
+	else if(errno == EAGAIN)
+	{
+		/* Woken spuriously, a zero-sized read will just start another one. */
+		
+		*data = handle->buf;
+		*data_size = 0;
+		
+		return ERROR_SUCCESS;
+	}
+	else{
+		return error_from_errno(errno);
+	}
+}
+
+HANDLE pipe9x_read_event(PipeReadHandle handle)
+{
+	return &(handle->event);
+}
+
+/* Finishes a write the pipe was closed in the middle of, then closes it. */
+static void *pipe_write_drain(void *param)
+{
+	struct Pipe9xWrite *handle = param;
+	
+	int flags = fcntl(handle->pipe.fd, F_GETFL);
+	fcntl(handle->pipe.fd, F_SETFL, (flags & ~O_NONBLOCK));
+	
+	pipe_write_continue(handle);
+	
+	close(handle->pipe.fd);
+	
+	free(handle->buf);
+	free(handle);
+	
+	return NULL;
+}
+
+void pipe9x_write_close(PipeWriteHandle handle)
+{
+	/* Closing straight after a write is how end of file follows the last of
+	 * the data, so whatever hasn't been written yet still has to be. That
+	 * can't block us since the child might be waiting for us to read its
+	 * output first.
+	*/
+	
+	if(handle->pending && handle->data_written < handle->data_size && handle->error == ERROR_SUCCESS)
+	{
+		pthread_t thread;
+		
+		if(pthread_create(&thread, NULL, &pipe_write_drain, handle) == 0)
+		{
+			pthread_detach(thread);
+			return;
+		}
+	}
+	
+	close(handle->pipe.fd);
+	
+	free(handle->buf);
+	free(handle);
+}
+
+HANDLE pipe9x_write_pipe(PipeWriteHandle handle)
+{
+	return &(handle->pipe);
+}
+
+/* Writes as much of the pending data as the pipe will take. Returns true once
+ * the write has finished, successfully or not.
+*/
+static bool pipe_write_continue(struct Pipe9xWrite *pipe)
+{
+	while(pipe->data_written < pipe->data_size && pipe->error == ERROR_SUCCESS)
+	{
+		ssize_t w = write(pipe->pipe.fd, (pipe->buf + pipe->data_written), (pipe->data_size - pipe->data_written));
+		
+		if(w >= 0)
+		{
+			pipe->data_written += w;
+		}
+		else if(errno == EAGAIN)
+		{
+			return false;
+		}
+		else if(errno != EINTR)
+		{
+			pipe->error = error_from_errno(errno);
+		}
+	}
+	
+	return true;
+}
+
+DWORD pipe9x_write_initiate(PipeWriteHandle handle, const void *data, size_t data_size)
+{
+	if(handle->pending)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	/* The caller's buffer may not outlive the call, as with pipe9x on Windows. */
+	
+	if(data_size > handle->buf_size)
+	{
+		unsigned char *new_buf = realloc(handle->buf, data_size);
+		if(new_buf == NULL)
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+		
+		handle->buf = new_buf;
+		handle->buf_size = data_size;
+	}
+	
+	memcpy(handle->buf, data, data_size);
+	
+	handle->data_size = data_size;
+	handle->data_written = 0;
+	handle->error = ERROR_SUCCESS;
+	handle->pending = true;
+	
+	pipe_write_continue(handle);
+	
+	return ERROR_IO_PENDING;
+}
+
+BOOL pipe9x_write_pending(PipeWriteHandle handle)
+{
+	return handle->pending;
+}
+
+DWORD pipe9x_write_result(PipeWriteHandle handle, size_t *data_written, BOOL wait)
+{
+	while(!pipe_write_continue(handle))
+	{
+		if(!wait)
+		{
+			return ERROR_IO_INCOMPLETE;
+		}
+		
+		struct pollfd pfd = { handle->pipe.fd, POLLOUT, 0 };
+		while(poll(&pfd, 1, -1) < 0 && errno == EINTR) {}
+	}
+	
+	handle->pending = false;
+	*data_written = handle->data_written;
+	
+	return handle->error;
+}
+
+HANDLE pipe9x_write_event(PipeWriteHandle handle)
+{
+	return &(handle->event);
+}
@@ -0,0 +1,257 @@
+/* ice9d - Remote command execution server for Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* The subset of the Win32, Winsock and pipe9x APIs used by ice9d, implemented
+ * on top of POSIX so the same event loop can be built and exercised natively
+ * on Linux rather than only under Windows 9x.
+ *
+ * Handles are file descriptors wrapped with enough state to be waited on by
+ * WaitForMultipleObjects(), which builds a poll() set from them each call:
+ *
+ *   - Events are eventfds, sockets associated with one by WSAEventSelect()
+ *     are polled alongside it for the requested conditions.
+ *   - Processes are pidfds, or polled with waitid() on kernels without them.
+ *   - The pipe9x read event is ready when the pipe is readable, the read is
+ *     done by pipe9x_read_result(). Writes are made non-blocking, the write
+ *     event is ready once all of the data has been written.
+ *
+ * Everything is created close-on-exec, so a child only ever inherits the
+ * handles given to it in STARTUPINFO, as with bInheritHandles on Windows.
+*/
+
+#ifndef ICE9_POSIX_WIN32_H
+#define ICE9_POSIX_WIN32_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+typedef int BOOL;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef size_t SIZE_T;
+typedef void *LPVOID;
+
+typedef struct Win32Handle *HANDLE;
+typedef HANDLE WSAEVENT;
+
+typedef union {
+	int64_t QuadPart;
+} LARGE_INTEGER;
+
+#define TRUE  1
+#define FALSE 0
+
+#define WINAPI
+#define MAX_PATH 260
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(-1))
+
+#define ERROR_SUCCESS           0
+#define ERROR_FILE_NOT_FOUND    2
+#define ERROR_PATH_NOT_FOUND    3
+#define ERROR_ACCESS_DENIED     5
+#define ERROR_INVALID_HANDLE    6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_WRITE_FAULT       29
+#define ERROR_FILE_EXISTS       80
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_BROKEN_PIPE       109
+#define ERROR_DISK_FULL         112
+#define ERROR_IO_INCOMPLETE     996
+#define ERROR_IO_PENDING        997
+
+#define INFINITE      0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT  258
+#define WAIT_FAILED   0xFFFFFFFF
+
+#define STILL_ACTIVE 259
+
+#define GENERIC_READ  0x80000000
+#define GENERIC_WRITE 0x40000000
+
+#define FILE_SHARE_READ  0x00000001
+#define FILE_SHARE_WRITE 0x00000002
+
+#define CREATE_NEW        1
+#define CREATE_ALWAYS     2
+#define OPEN_EXISTING     3
+#define OPEN_ALWAYS       4
+#define TRUNCATE_EXISTING 5
+
+#define FILE_ATTRIBUTE_DIRECTORY 0x00000010
+#define FILE_ATTRIBUTE_NORMAL    0x00000080
+#define INVALID_FILE_ATTRIBUTES  ((DWORD)(-1))
+
+#define FILE_BEGIN   0
+#define FILE_CURRENT 1
+#define FILE_END     2
+
+#define DUPLICATE_SAME_ACCESS 0x00000002
+
+#define STARTF_USESTDHANDLES 0x00000100
+#define DETACHED_PROCESS     0x00000008
+
+#define STD_INPUT_HANDLE  ((DWORD)(-10))
+#define STD_OUTPUT_HANDLE ((DWORD)(-11))
+#define STD_ERROR_HANDLE  ((DWORD)(-12))
+
+typedef struct {
+	DWORD nLength;
+	LPVOID lpSecurityDescriptor;
+	BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES;
+
+typedef struct {
+	DWORD cb;
+	DWORD dwFlags;
+	HANDLE hStdInput;
+	HANDLE hStdOutput;
+	HANDLE hStdError;
+} STARTUPINFO;
+
+typedef struct {
+	HANDLE hProcess;
+	HANDLE hThread;
+	DWORD dwProcessId;
+	DWORD dwThreadId;
+} PROCESS_INFORMATION;
+
+typedef struct {
+	DWORD dwLength;
+	DWORD dwMemoryLoad;
+	SIZE_T dwTotalPhys;
+	SIZE_T dwAvailPhys;
+	SIZE_T dwTotalPageFile;
+	SIZE_T dwAvailPageFile;
+	SIZE_T dwTotalVirtual;
+	SIZE_T dwAvailVirtual;
+} MEMORYSTATUS;
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+
+DWORD GetLastError(void);
+DWORD GetTickCount(void);
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency);
+void GlobalMemoryStatus(MEMORYSTATUS *status);
+DWORD GetTempPath(DWORD size, char *buf);
+
+BOOL CloseHandle(HANDLE handle);
+HANDLE GetCurrentProcess(void);
+HANDLE GetStdHandle(DWORD which);
+BOOL DuplicateHandle(HANDLE source_process, HANDLE source, HANDLE target_process, HANDLE *target, DWORD access, BOOL inherit, DWORD options);
+
+HANDLE CreateFile(const char *path, DWORD access, DWORD share, SECURITY_ATTRIBUTES *sa, DWORD disposition, DWORD attributes, HANDLE template_file);
+BOOL WriteFile(HANDLE file, const void *buf, DWORD size, DWORD *written, void *overlapped);
+DWORD SetFilePointer(HANDLE file, LONG distance, LONG *distance_high, DWORD method);
+DWORD GetFileAttributes(const char *path);
+BOOL DeleteFile(const char *path);
+BOOL CreatePipe(HANDLE *read_pipe, HANDLE *write_pipe, SECURITY_ATTRIBUTES *sa, DWORD size);
+
+HANDLE CreateEvent(SECURITY_ATTRIBUTES *sa, BOOL manual_reset, BOOL initial_state, const char *name);
+BOOL SetEvent(HANDLE event);
+DWORD WaitForSingleObject(HANDLE handle, DWORD timeout);
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL wait_all, DWORD timeout);
+
+HANDLE CreateThread(SECURITY_ATTRIBUTES *sa, SIZE_T stack_size, LPTHREAD_START_ROUTINE func, LPVOID param, DWORD flags, DWORD *thread_id);
+
+BOOL CreateProcess(const char *application_path, char *command_line, SECURITY_ATTRIBUTES *process_sa, SECURITY_ATTRIBUTES *thread_sa,
+	BOOL inherit_handles, DWORD flags, LPVOID environment, const char *working_directory, STARTUPINFO *si, PROCESS_INFORMATION *pi);
+BOOL TerminateProcess(HANDLE process, DWORD exit_code);
+BOOL GetExitCodeProcess(HANDLE process, DWORD *exit_code);
+
+#define InterlockedExchange(target, value) __atomic_exchange_n((target), (value), __ATOMIC_SEQ_CST)
+
+/* Winsock */
+
+typedef struct {
+	WORD wVersion;
+	WORD wHighVersion;
+} WSADATA;
+
+#define MAKEWORD(low, high) ((WORD)(((uint8_t)(low)) | (((WORD)((uint8_t)(high))) << 8)))
+
+#define INVALID_SOCKET    (-1)
+#define WSA_INVALID_EVENT ((WSAEVENT)(NULL))
+#define WSAEWOULDBLOCK    10035
+
+#define FD_READ   0x01
+#define FD_WRITE  0x02
+#define FD_ACCEPT 0x08
+#define FD_CLOSE  0x20
+
+/* Sockets accepted from a listener selected with WSAEventSelect() are
+ * non-blocking on Windows, as the event loop expects.
+*/
+#define accept(sock, addr, addrlen) win32_accept((sock), (addr), (addrlen))
+
+/* Windows lets a port be listened on again while connections from the last
+ * server to use it are in TIME_WAIT, Linux needs SO_REUSEADDR for that.
+*/
+#define bind(sock, addr, addrlen) win32_bind((sock), (addr), (addrlen))
+
+int WSAStartup(WORD version, WSADATA *data);
+int WSACleanup(void);
+int WSAGetLastError(void);
+int WSAEventSelect(int sock, WSAEVENT event, long events);
+int closesocket(int sock);
+
+int win32_accept(int sock, struct sockaddr *addr, socklen_t *addrlen);
+int win32_bind(int sock, const struct sockaddr *addr, socklen_t addrlen);
+
+/* pipe9x */
+
+typedef struct Pipe9xRead *PipeReadHandle;
+typedef struct Pipe9xWrite *PipeWriteHandle;
+
+DWORD pipe9x_create(PipeReadHandle *read_handle, size_t read_size, BOOL read_inherit, PipeWriteHandle *write_handle, size_t write_size, BOOL write_inherit);
+
+void pipe9x_read_close(PipeReadHandle handle);
+HANDLE pipe9x_read_pipe(PipeReadHandle handle);
+DWORD pipe9x_read_initiate(PipeReadHandle handle);
+DWORD pipe9x_read_result(PipeReadHandle handle, void **data, size_t *data_size, BOOL wait);
+HANDLE pipe9x_read_event(PipeReadHandle handle);
+
+void pipe9x_write_close(PipeWriteHandle handle);
+HANDLE pipe9x_write_pipe(PipeWriteHandle handle);
+DWORD pipe9x_write_initiate(PipeWriteHandle handle, const void *data, size_t data_size);
+BOOL pipe9x_write_pending(PipeWriteHandle handle);
+DWORD pipe9x_write_result(PipeWriteHandle handle, size_t *data_written, BOOL wait);
+HANDLE pipe9x_write_event(PipeWriteHandle handle);
+
+#endif /* !ICE9_POSIX_WIN32_H */
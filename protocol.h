@@ -0,0 +1,108 @@
+/* ice9r - Client to remotely run a command on a Windows 9x computer
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef ICE9_PROTOCOL_H
+#define ICE9_PROTOCOL_H
+
+/* Message formats shared by the ice9r client modules, see ice9d.c for the
+ * meaning of each message.
+*/
+
+#include <stdint.h>
+
+#define ICE9_DEFAULT_PORT 5424
+#define MAX_PIPELINE_STAGES 8
+
+#define CF_STOP_ON_FAILURE (1 << 0)
+#define CF_INTERACTIVE     (1 << 1)
+#define CF_STATS           (1 << 2)
+#define CF_TIMING          (1 << 3)
+
+#define STATS_READ_BUCKETS 5
+
+struct MessageHeader
+{
+	unsigned char command;
+	uint16_t payload_length;
+} __attribute__((packed));
+
+struct OutputPolicyMessage
+{
+	unsigned char stream;
+	unsigned char mode;
+	uint32_t limit;
+} __attribute__((packed));
+
+struct CommandResult
+{
+	uint32_t index;
+	int32_t exit_code;
+} __attribute__((packed));
+
+struct ConnectionStats
+{
+	uint64_t stdin_bytes;
+	uint64_t stdout_bytes;
+	uint64_t stderr_bytes;
+	
+	uint32_t stdin_frames;
+	uint32_t stdout_frames;
+	uint32_t stderr_frames;
+	
+	uint32_t sendbuf_full_ms;
+	
+	uint32_t stdin_stalls;
+	uint32_t stdin_stall_ms;
+	
+	uint32_t first_output_ms;
+	uint32_t total_ms;
+	
+	uint32_t read_sizes[STATS_READ_BUCKETS];
+} __attribute__((packed));
+
+struct PhaseTimes
+{
+	uint64_t execute_us;
+	uint64_t spawned_us;
+	uint64_t first_output_us;
+	uint64_t exited_us;
+	uint64_t exit_sent_us;
+	
+	uint32_t path_search_us;
+	uint32_t create_process_us;
+} __attribute__((packed));
+
+struct RedirectMessage
+{
+	unsigned char stream;
+	unsigned char mode;
+} __attribute__((packed));
+
+#endif /* !ICE9_PROTOCOL_H */